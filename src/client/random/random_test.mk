@@ -42,7 +42,7 @@ do_put=../unagi_client.py $(port) send_file msgs/put_msg_$*
 do_get=../unagi_client.py $(port) send_file msgs/get_msg_$*
 
 help :
-	@echo "make -f random_test.mk prepare/put/get/put_get"
+	@echo "make -f random_test.mk prepare/put/get/put_get/gets_huge_k/getdoc_negative/session_prefix/getcm_huge_n"
 
 all : prepare
 
@@ -73,6 +73,42 @@ quit :
 save :
 	../unagi_client.py $(port) save
 
+# gets に巨大なKを送っても, サーバが(出現の数で抑えて)すぐに返事をし,
+# 上限を超えるKを無効とした後も処理を続けること
+gets_huge_k :
+	timeout 10 ../unagi_client.py $(port) gets a 4294967296 | head -1 | grep -q '^OK'
+	-timeout 10 ../unagi_client.py $(port) gets a 4611686018427387904
+	timeout 10 ../unagi_client.py $(port) getc a | head -1 | grep -q '^OK'
+
+# getdoc の負の OFFSET, LEN は(他のドキュメントやバッファの外を
+# 返さずに) NG となること
+getdoc_negative :
+	../unagi_client.py $(port) put getdoc_negative_a AsecretA | sed -n 1p | grep -q '^OK'
+	../unagi_client.py $(port) put getdoc_negative_b B | sed -n 1p | grep -q '^OK'
+	d=$$(../unagi_client.py $(port) getlabel getdoc_negative_b | sed -n 2p | awk '{print $$3}') ; \
+	../unagi_client.py $(port) getdoc $$d -8 8 | sed -n 1p | grep -q '^NG' && \
+	../unagi_client.py $(port) getdoc $$d 0 -3 | sed -n 1p | grep -q '^NG' && \
+	../unagi_client.py $(port) getdoc $$d 0 0 | sed -n 1p | grep -q '^OK'
+
+# 1つの接続で complete の後に短い query を get しても, セッションが
+# 覚えている(より短い)接頭辞の範囲を使わず, 新しい接続と同じ結果を返すこと
+session_prefix : status/created
+	../unagi_client.py $(port) put session_prefix_a "hello world" | sed -n 1p | grep -q '^OK'
+	../unagi_client.py $(port) put session_prefix_b "hi how hat" | sed -n 1p | grep -q '^OK'
+	printf 'complete\n5\n1\nhget\n2\nhe' > status/session_prefix_msg
+	../unagi_client.py $(port) send_file status/session_prefix_msg | sed -e '1,/^0$$/d' -e '/^command took/d' > status/session_prefix_1
+	../unagi_client.py $(port) get he | sed -e '/^command took/d' > status/session_prefix_0
+	cmp status/session_prefix_0 status/session_prefix_1
+
+# getcm に上限を超える N や長さの合計を送っても, サーバが(メモリを
+# 確保しようとせずに)無効とし, その後も処理を続けること
+getcm_huge_n : status/created
+	printf 'getcm\n4611686018427387904\n' > status/getcm_huge_n_msg
+	printf 'getcm\n2\n1\na 4611686018427387904\n' > status/getcm_huge_len_msg
+	-timeout 10 ../unagi_client.py $(port) send_file status/getcm_huge_n_msg
+	-timeout 10 ../unagi_client.py $(port) send_file status/getcm_huge_len_msg
+	timeout 10 ../unagi_client.py $(port) getcm a b | sed -n 1p | grep -q '^OK'
+
 status/created :
 	mkdir -p $@
 
@@ -12,6 +12,11 @@ def recv_until_eos(so):
         print(rep.decode("utf-8", "ignore"), end="")
     so.close()
 
+#
+# @brief 各メッセージの前に送るメッセージ(limit など)
+#
+msg_prefix = b""
+
 #
 # @brief 接続し, メッセージを送り, 接続が切れるまでデータを受取り表示
 # @param (ip) 接続先IPアドレス
@@ -21,7 +26,7 @@ def recv_until_eos(so):
 def send_msg_and_wait(ip, port, msg):
     so = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     so.connect((ip, port))
-    so.sendall(msg)
+    so.sendall(msg_prefix + msg)
     so.shutdown(socket.SHUT_WR)
     recv_until_eos(so)
     
@@ -65,6 +70,15 @@ def mk_get_msg(query):
     msg = b"get\n%d\n%s" % (len(query), query)
     return msg
 
+#
+# @brief 文字列を検索し結果をドキュメント, 位置の順に得る(geto)ためのメッセージ(wire data)を生成
+# @param (query) 検索文字列
+#
+def mk_geto_msg(query):
+    query = bytes(query, "utf8")
+    msg = b"geto\n%d\n%s" % (len(query), query)
+    return msg
+
 #
 # @brief 文字列の出現数を問い合わせる(getc)するためのメッセージ(wire data)を生成
 # @param (query) 検索文字列
@@ -74,6 +88,128 @@ def mk_getc_msg(query):
     msg = b"getc\n%d\n%s" % (len(query), query)
     return msg
 
+#
+# @brief 複数の文字列の出現数をまとめて問い合わせる(getcm)ためのメッセージ(wire data)を生成
+# @param (queries) 検索文字列のリスト
+#
+def mk_getcm_msg(queries):
+    msg = b"getcm\n%d" % len(queries)
+    for query in queries:
+        query = bytes(query, "utf8")
+        msg += b"\n%d\n%s" % (len(query), query)
+    return msg
+
+#
+# @brief 文字列が出現するドキュメントを問い合わせる(getd)ためのメッセージ(wire data)を生成
+# @param (query) 検索文字列
+# @param (top_n) 出現回数の多い順に何件返すか(0なら全て)
+#
+def mk_getd_msg(query, top_n):
+    query = bytes(query, "utf8")
+    msg = b"getd\n%d\n%d\n%s" % (top_n, len(query), query)
+    return msg
+
+#
+# @brief 文字列の出現を無作為に抽出(gets)するためのメッセージ(wire data)を生成
+# @param (query) 検索文字列
+# @param (k) 抽出する出現の数
+#
+def mk_gets_msg(query, k):
+    query = bytes(query, "utf8")
+    msg = b"gets\n%d\n%d\n%s" % (k, len(query), query)
+    return msg
+
+#
+# @brief 文字列の密度の高いドキュメントを問い合わせる(getr)ためのメッセージ(wire data)を生成
+# @param (query) 検索文字列
+# @param (top_k) 密度の高い順に何件返すか
+#
+def mk_getr_msg(query, top_k):
+    query = bytes(query, "utf8")
+    msg = b"getr\n%d\n%d\n%s" % (top_k, len(query), query)
+    return msg
+
+#
+# @brief ラベルを検索(getl)するためのメッセージ(wire data)を生成
+# @param (match) exact, prefix, substr のいずれか
+# @param (query) 検索文字列
+#
+def mk_getl_msg(match, query):
+    match = bytes(match, "utf8")
+    query = bytes(query, "utf8")
+    msg = b"getl\n%s\n%d\n%s" % (match, len(query), query)
+    return msg
+
+#
+# @brief 番号でドキュメント(の一部)を取得(getdoc)するためのメッセージ(wire data)を生成
+# @param (doc) ドキュメント番号(putが返した番号)
+# @param (offset) 読み出す範囲の先頭(バイト)
+# @param (length) 読み出す長さ(バイト数. 0ならドキュメントの終わりまで)
+#
+def mk_getdoc_msg(doc, offset, length):
+    msg = b"getdoc\n%d\n%d\n%d\n" % (doc, offset, length)
+    return msg
+
+#
+# @brief ラベルでドキュメントを取得(getlabel)するためのメッセージ(wire data)を生成
+# @param (label) ラベル
+#
+def mk_getlabel_msg(label):
+    label = bytes(label, "utf8")
+    msg = b"getlabel\n%d\n%s" % (len(label), label)
+    return msg
+
+#
+# @brief 入力補完の候補を問い合わせる(complete)ためのメッセージ(wire data)を生成
+# @param (prefix) 検索文字列(補完する単語の先頭)
+# @param (top_n) 出現回数の多い順に何件返すか(0なら全て)
+#
+def mk_complete_msg(prefix, top_n):
+    prefix = bytes(prefix, "utf8")
+    msg = b"complete\n%d\n%d\n%s" % (top_n, len(prefix), prefix)
+    return msg
+
+#
+# @brief 2つの文字列が近くに出現する範囲を検索(near)するためのメッセージ(wire data)を生成
+# @param (query0) 検索文字列
+# @param (query1) 検索文字列
+# @param (window) 出現位置の差の上限(バイト数)
+#
+def mk_near_msg(query0, query1, window):
+    query0 = bytes(query0, "utf8")
+    query1 = bytes(query1, "utf8")
+    msg = b"near\n%d\n%d\n%s\n%d\n%s" % (window, len(query0), query0, len(query1), query1)
+    return msg
+
+#
+# @brief 検索の方法の選択とその根拠を問い合わせる(explain)ためのメッセージ(wire data)を生成
+# @param (query) 検索文字列
+#
+def mk_explain_msg(query):
+    query = bytes(query, "utf8")
+    msg = b"explain\n%d\n%s" % (len(query), query)
+    return msg
+
+#
+# @brief この接続のリクエストの時間と結果件数の上限を設定(limit)するためのメッセージ(wire data)を生成
+# @param (timeout_ms) 1リクエストの処理時間の上限(ミリ秒. 0なら無し)
+# @param (max_results) 1リクエストの結果の件数の上限(0なら無し)
+#
+def mk_limit_msg(timeout_ms, max_results):
+    msg = b"limit\n%d\n%d\n" % (timeout_ms, max_results)
+    return msg
+
+#
+# @brief この接続の検索の対象とするドキュメントの条件を設定(filter)するためのメッセージ(wire data)を生成
+# @param (doc_begin) 対象とするドキュメント番号の下限
+# @param (doc_end) 対象とするドキュメント番号の上限(の次. 0なら無し)
+# @param (label_prefix) 対象とするドキュメントのラベルの接頭辞(""なら無し)
+#
+def mk_filter_msg(doc_begin, doc_end, label_prefix):
+    label_prefix = bytes(label_prefix, "utf8")
+    msg = b"filter\n%d\n%d\n%d\n%s\n" % (doc_begin, doc_end, len(label_prefix), label_prefix)
+    return msg
+
 #
 # @brief ランダムな文字列をputするためのwire dataをファイルに格納
 # @param (label) 文書のラベル
@@ -164,6 +300,16 @@ def send_get(ip, port, query):
     msg = mk_get_msg(query)
     send_msg_and_wait(ip, port, msg)
 
+#
+# @brief 文字列を検索し結果をドキュメント, 位置の順に得る
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query) 検索文字列
+#
+def send_geto(ip, port, query):
+    msg = mk_geto_msg(query)
+    send_msg_and_wait(ip, port, msg)
+
 #
 # @brief 文字列の出現数を問い合わせ
 # @param (ip) 接続先IPアドレス
@@ -174,6 +320,115 @@ def send_getc(ip, port, query):
     msg = mk_getc_msg(query)
     send_msg_and_wait(ip, port, msg)
 
+#
+# @brief 複数の文字列の出現数をまとめて問い合わせ
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (queries) 検索文字列のリスト
+#
+def send_getcm(ip, port, queries):
+    msg = mk_getcm_msg(queries)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 文字列が出現するドキュメントとその出現回数を問い合わせ
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query) 検索文字列
+# @param (top_n) 出現回数の多い順に何件返すか(0なら全て)
+#
+def send_getd(ip, port, query, top_n):
+    msg = mk_getd_msg(query, top_n)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 文字列の出現を無作為に抽出
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query) 検索文字列
+# @param (k) 抽出する出現の数
+#
+def send_gets(ip, port, query, k):
+    msg = mk_gets_msg(query, k)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 文字列の密度(出現回数 / ドキュメント長)の高いドキュメントを問い合わせ
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query) 検索文字列
+# @param (top_k) 密度の高い順に何件返すか
+#
+def send_getr(ip, port, query, top_k):
+    msg = mk_getr_msg(query, top_k)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief ラベルを検索
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (match) exact, prefix, substr のいずれか
+# @param (query) 検索文字列
+#
+def send_getl(ip, port, match, query):
+    msg = mk_getl_msg(match, query)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 番号でドキュメント(の一部)を取得
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (doc) ドキュメント番号(putが返した番号)
+# @param (offset) 読み出す範囲の先頭(バイト)
+# @param (length) 読み出す長さ(バイト数. 0ならドキュメントの終わりまで)
+#
+def send_getdoc(ip, port, doc, offset, length):
+    msg = mk_getdoc_msg(doc, offset, length)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief ラベルでドキュメントを取得
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (label) ラベル
+#
+def send_getlabel(ip, port, label):
+    msg = mk_getlabel_msg(label)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 入力補完の候補(検索文字列に続く単語)とその出現回数を問い合わせ
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (prefix) 検索文字列(補完する単語の先頭)
+# @param (top_n) 出現回数の多い順に何件返すか(0なら全て)
+#
+def send_complete(ip, port, prefix, top_n):
+    msg = mk_complete_msg(prefix, top_n)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 2つの文字列が近く(window バイト以内)に出現する範囲を検索
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query0) 検索文字列
+# @param (query1) 検索文字列
+# @param (window) 出現位置の差の上限(バイト数)
+#
+def send_near(ip, port, query0, query1, window):
+    msg = mk_near_msg(query0, query1, window)
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 検索の方法の選択とその根拠を問い合わせる
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (query) 検索文字列
+#
+def send_explain(ip, port, query):
+    msg = mk_explain_msg(query)
+    send_msg_and_wait(ip, port, msg)
+
 #
 # @brief ランダムな文字列を検索
 # @param (ip) 接続先IPアドレス
@@ -238,6 +493,35 @@ def send_save(ip, port):
     msg = b"save\n"
     send_msg_and_wait(ip, port, msg)
 
+#
+# @brief 検索用の静的探索木を作らせる
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+#
+def send_freeze(ip, port):
+    msg = b"freeze\n"
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief 長い共通部分を持つドキュメントの組を求めるジョブを始めさせる
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (min_len) 共通部分の最小の長さ(バイト数)
+#
+def send_dups(ip, port, min_len):
+    msg = b"dups\n%d\n" % min_len
+    send_msg_and_wait(ip, port, msg)
+
+#
+# @brief dups のジョブの結果を問い合わせ
+# @param (ip) 接続先IPアドレス
+# @param (port) 接続先ポート
+# @param (top_n) 共有する部分の多い順に何件返すか(0なら全て)
+#
+def send_dupsr(ip, port, top_n):
+    msg = b"dupsr\n%d\n" % top_n
+    send_msg_and_wait(ip, port, msg)
+
 #
 # @brief ファイルの中身をwire dataとして送信
 # @param (ip) 接続先IPアドレス
@@ -256,17 +540,53 @@ def send_file(ip, port, filename):
 #   ./unagi_client.py ポート番号 コマンド コマンド固有の引数
 #   コマンド: put, get, getc, put_random, get_random, get_random, prepare_random
 def run_cmd():
+    global msg_prefix
     ip = "localhost"
     port = int(sys.argv[1])
     cmd = sys.argv[2]
     args = sys.argv[3:]
+    while cmd in [ "limit", "filter" ]:
+        if cmd == "limit":
+            # TIMEOUT_MS MAX_RESULTS COMMAND args ...
+            msg_prefix += mk_limit_msg(int(args[0]), int(args[1]))
+            cmd = args[2]
+            args = args[3:]
+        else:
+            # DOC_BEGIN DOC_END LABEL_PREFIX COMMAND args ...
+            msg_prefix += mk_filter_msg(int(args[0]), int(args[1]), args[2])
+            cmd = args[3]
+            args = args[4:]
     letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ" + " " * 18
     if cmd == "put":
         send_put(ip, port, args[0], args[1])
     elif cmd == "get":
         send_get(ip, port, args[0])
+    elif cmd == "geto":
+        send_geto(ip, port, args[0])
     elif cmd == "getc":
         send_getc(ip, port, args[0])
+    elif cmd == "getcm":
+        send_getcm(ip, port, args)
+    elif cmd == "getl":
+        send_getl(ip, port, args[0], args[1])
+    elif cmd == "gets":
+        send_gets(ip, port, args[0], int(args[1]) if len(args) > 1 else 10)
+    elif cmd == "getr":
+        send_getr(ip, port, args[0], int(args[1]) if len(args) > 1 else 10)
+    elif cmd == "getdoc":
+        send_getdoc(ip, port, int(args[0]),
+                    int(args[1]) if len(args) > 1 else 0,
+                    int(args[2]) if len(args) > 2 else 0)
+    elif cmd == "getlabel":
+        send_getlabel(ip, port, args[0])
+    elif cmd == "getd":
+        send_getd(ip, port, args[0], int(args[1]) if len(args) > 1 else 0)
+    elif cmd == "complete":
+        send_complete(ip, port, args[0], int(args[1]) if len(args) > 1 else 10)
+    elif cmd == "near":
+        send_near(ip, port, args[0], args[1], int(args[2]) if len(args) > 2 else 50)
+    elif cmd == "explain":
+        send_explain(ip, port, args[0])
     elif cmd == "put_random":
         # label, seed, n, alphabet
         send_put_random(ip, port,
@@ -296,20 +616,26 @@ def run_cmd():
         send_dumpc(ip, port)
     elif cmd == "save":
         send_save(ip, port)
+    elif cmd == "freeze":
+        send_freeze(ip, port)
+    elif cmd == "dups":
+        send_dups(ip, port, int(args[0]))
+    elif cmd == "dupsr":
+        send_dupsr(ip, port, int(args[0]) if len(args) > 0 else 0)
     elif cmd == "quit":
         send_quit(ip, port)
     else:
-        assert(cmd in [ "put", "get", "getc",
+        assert(cmd in [ "put", "get", "geto", "getc", "getcm", "getd", "gets", "getr", "getl", "getdoc", "getlabel", "complete", "near", "explain",
                         "put_random", "get_random", "getc_random",
                         "make_put_random", "send_file",
-                        "dump", "dumpc", "save", "quit" ]), cmd
+                        "dump", "dumpc", "save", "freeze", "dups", "dupsr", "quit" ]), cmd
 
 def usage():
     print("""usage:
 
   %(prog)s PORT COMMAND args ...
 
-    COMMAND: put, get, getc, dump, dumpc, quit, put_random, get_random, getc_random, make_put_random, send_file
+    COMMAND: limit, filter, put, get, geto, getc, getcm, getd, gets, getr, getl, getdoc, getlabel, complete, near, explain, dump, dumpc, freeze, dups, dupsr, quit, put_random, get_random, getc_random, make_put_random, send_file
 
     (1)  %(prog)s PORT put LABEL DATA
     (2)  %(prog)s PORT get QUERY
@@ -322,6 +648,22 @@ def usage():
     (9)  %(prog)s PORT get_random RANDOM_SEED SKIP_CHARS NUM_CHARS
     (10) %(prog)s PORT make_put_random LABEL RANDOM_SEED NUM_CHARS FILENAME
     (11) %(prog)s PORT send_file FILENAME
+    (12) %(prog)s PORT freeze
+    (13) %(prog)s PORT getd QUERY [TOP_N]
+    (14) %(prog)s PORT getl exact/prefix/substr QUERY
+    (15) %(prog)s PORT complete PREFIX [TOP_N]
+    (16) %(prog)s PORT near QUERY0 QUERY1 [WINDOW]
+    (17) %(prog)s PORT geto QUERY
+    (18) %(prog)s PORT limit TIMEOUT_MS MAX_RESULTS COMMAND args ...
+    (19) %(prog)s PORT explain QUERY
+    (20) %(prog)s PORT getcm QUERY [QUERY ...]
+    (21) %(prog)s PORT getdoc DOC_ID [OFFSET [LENGTH]]
+    (22) %(prog)s PORT getlabel LABEL
+    (23) %(prog)s PORT filter DOC_BEGIN DOC_END LABEL_PREFIX COMMAND args ...
+    (24) %(prog)s PORT gets QUERY [K]
+    (25) %(prog)s PORT getr QUERY [TOP_K]
+    (26) %(prog)s PORT dups MIN_LEN
+    (27) %(prog)s PORT dupsr [TOP_N]
 
     """ % { "prog" : sys.argv[0] })
         
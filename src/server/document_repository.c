@@ -19,6 +19,7 @@ static void document_array_init(document_array_t * da) {
   da->sz = 0;
   da->n = 0;
   da->a = 0;
+  da->f = 0;
 }
 
 /**
@@ -36,6 +37,15 @@ static void document_array_destroy(document_array_t * da) {
     my_free(a);
     da->a = 0;
   }
+  trigram_filter_t * f = da->f;
+  if (f) {
+    size_t n = da->n;
+    for (size_t i = 0; i < n; i++) {
+      if (f[i].bits) my_free(f[i].bits);
+    }
+    my_free(f);
+    da->f = 0;
+  }
 }
 
 /**
@@ -44,11 +54,12 @@ static void document_array_destroy(document_array_t * da) {
 static const size_t document_array_init_sz = 16;
 
 /**
-   @brief ドキュメント配列の末尾にドキュメントを追加
+   @brief ドキュメント配列の末尾にドキュメント(とそのtrigramフィルタ)を追加
 
    @details 必要ならば配列を拡張する. 1要素追加するたびに拡張(メモリ割り当て+コピー)するのを避けるため, 拡張するときは大きさを2倍にする.
  */
-static ssize_t document_array_pushback(document_array_t * da, document_t d) {
+static ssize_t document_array_pushback(document_array_t * da, document_t d,
+                                       trigram_filter_t f) {
   size_t n = da->n;             /* 現在の要素数 */
   size_t sz = da->sz;           /* 現在のサイズ */
   document_t * a = da->a;
@@ -64,17 +75,133 @@ static ssize_t document_array_pushback(document_array_t * da, document_t d) {
     /* メモリ割り当て + コピー */
     document_t * new_a = malloc_or_err(sizeof(document_t) * new_sz);
     if (!new_a) return -1;
-    memcpy(new_a, a, sizeof(document_t) * sz);
-    my_free(a);
+    trigram_filter_t * new_f = malloc_or_err(sizeof(trigram_filter_t) * new_sz);
+    if (!new_f) {
+      my_free(new_a);
+      return -1;
+    }
+    if (a) {
+      memcpy(new_a, a, sizeof(document_t) * sz);
+      memcpy(new_f, da->f, sizeof(trigram_filter_t) * sz);
+      my_free(a);
+      my_free(da->f);
+    }
     da->a = a = new_a;
+    da->f = new_f;
     da->sz = new_sz;
   }
   /* ドキュメントを配列に追加 */
   a[n] = d;
+  da->f[n] = f;
   da->n = n + 1;
   return n;
 }
 
+/** trigramフィルタのビット数の下限(unsigned long 1語) */
+static const size_t trigram_filter_min_bits = 8 * sizeof(unsigned long);
+/** trigramフィルタを作るときの初期ビット数の上限 */
+static const size_t trigram_filter_max_bits = (size_t)1 << 27;
+/** trigramフィルタを縮める際, 立っているビットの割合の上限(分母) */
+static const size_t trigram_filter_max_fill_denom = 4;
+
+/**
+   @brief trigram(3バイト)のハッシュ値
+
+   @details 下位32ビットと上位32ビットをそれぞれ独立なハッシュ値として
+   使う(ビット2つを立てるBloomフィルタ)
+ */
+static unsigned long long trigram_hash(const char * p) {
+  unsigned long long x = ((unsigned long long)(unsigned char)p[0] << 16)
+    | ((unsigned long long)(unsigned char)p[1] << 8)
+    | (unsigned long long)(unsigned char)p[2];
+  /* splitmix64 の最終段 */
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/** フィルタ中のビット h & mask を立てる */
+static void trigram_filter_set(unsigned long * bits, size_t mask, size_t h) {
+  const size_t w = 8 * sizeof(unsigned long);
+  h &= mask;
+  bits[h / w] |= 1UL << (h % w);
+}
+
+/** フィルタ中のビット h & mask が立っているか */
+static int trigram_filter_get(const unsigned long * bits, size_t mask, size_t h) {
+  const size_t w = 8 * sizeof(unsigned long);
+  h &= mask;
+  return (bits[h / w] >> (h % w)) & 1;
+}
+
+/**
+   @brief ドキュメントの中身からtrigramフィルタを作る
+
+   @details ドキュメント長の16倍程度のビット数(異なるtrigramの数はド
+   キュメント長以下なので十分疎)で全trigramを登録した後, 後半を前半に
+   OR で重ねて半分の大きさにする操作を, 立っているビットの割合が
+   1/trigram_filter_max_fill_denom を超えない限り繰り返す. ビット位置は
+   ハッシュ値 & mask なので, 半分に重ねたものは mask を半分にして作った
+   フィルタと同じになる. 自然言語の文章では異なるtrigramの数はドキュメ
+   ント長よりずっと少ないので, 大きいドキュメントほどフィルタは(長さに
+   比べて)小さくなる.
+   メモリ割り当てに失敗したら bits == 0 のフィルタ(何も除外しない)を返す.
+ */
+static trigram_filter_t trigram_filter_make(const char * data, size_t data_len) {
+  const size_t w = 8 * sizeof(unsigned long);
+  trigram_filter_t f = { 0, 0 };
+  size_t m = trigram_filter_min_bits;
+  while (m < 16 * data_len && m < trigram_filter_max_bits) m *= 2;
+  unsigned long * bits = malloc_or_err(m / 8);
+  if (!bits) return f;
+  memset(bits, 0, m / 8);
+  for (size_t j = 0; j + 3 <= data_len; j++) {
+    unsigned long long h = trigram_hash(data + j);
+    trigram_filter_set(bits, m - 1, (size_t)(h & 0xffffffffULL));
+    trigram_filter_set(bits, m - 1, (size_t)(h >> 32));
+  }
+  /* 立っているビットが少ないうちは半分に重ねる */
+  while (m > trigram_filter_min_bits) {
+    size_t half = m / w / 2;
+    size_t ones = 0;
+    for (size_t k = 0; k < half; k++) {
+      ones += __builtin_popcountl(bits[k] | bits[k + half]);
+    }
+    if (ones * trigram_filter_max_fill_denom > m / 2) break;
+    for (size_t k = 0; k < half; k++) bits[k] |= bits[k + half];
+    m /= 2;
+  }
+  f.bits = malloc_or_err(m / 8);
+  if (f.bits) {
+    memcpy(f.bits, bits, m / 8);
+    f.mask = m - 1;
+  }
+  my_free(bits);
+  return f;
+}
+
+/**
+   @brief 検索文字列 query (長さ query_len) が, フィルタ f を持つドキュメ
+   ントに出現し得るか
+   @return 出現し得るなら1, 出現しないことが確実なら0
+
+   @details query の全trigramがフィルタにあるかを調べる. 3バイト未満の
+   query はフィルタでは除外できないので常に1
+ */
+static int trigram_filter_may_contain(const trigram_filter_t * f,
+                                      const char * query, size_t query_len) {
+  if (!f->bits) return 1;
+  for (size_t j = 0; j + 3 <= query_len; j++) {
+    unsigned long long h = trigram_hash(query + j);
+    if (!trigram_filter_get(f->bits, f->mask, (size_t)(h & 0xffffffffULL))
+        || !trigram_filter_get(f->bits, f->mask, (size_t)(h >> 32))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /**
    @brief ドキュメントレポジトリ(document_repo_t)の初期化(空にする)
 
@@ -102,12 +229,17 @@ void document_repo_destroy(document_repo_t * repo) {
    @brief ドキュメントレポジトリ(document_repo_t)にドキュメントを追加する
    @return 成功したら, 非負の整数. 失敗(メモリ割り当て失敗)したら-1. 
 
+   @details ドキュメントのtrigramフィルタ(trigram_filter_t)もここで作る.
+
    @sa document_repo_init
    @sa document_repo_destroy
    @sa document_repo_t
   */
 ssize_t document_repo_add(document_repo_t * repo, document_t d) {
-  return document_array_pushback(repo->da, d);
+  trigram_filter_t f = trigram_filter_make(d.data, d.data_len);
+  ssize_t i = document_array_pushback(repo->da, d, f);
+  if (i == -1 && f.bits) my_free(f.bits);
+  return i;
 }
 
 /**
@@ -155,11 +287,17 @@ occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが
   size_t n_docs = da->n;
   document_t * a = da->a;
   size_t start_i = qr->i;
+  /* strstr が見るのは最初の0まで */
+  size_t query_len = strnlen(query, qr->query_len);
   /* qr->i 番目のドキュメントから検索 */
   for (size_t i = start_i; i < n_docs; i++) {
     char * data = a[i].data;
     /* ドキュメント先頭もしくは最後に見つかった場所 + 1から検索 */
     char * p = ((i == start_i && qr->p) ? qr->p : data);
+    /* 新しいドキュメントに出現し得ないならば読まずに次へ */
+    if (p == data && !trigram_filter_may_contain(&da->f[i], query, query_len)) {
+      continue;
+    }
     while (p) {
       /* pから始まる文字列中から, queryの出現を検索 */
       char * q = strstr(p, query);
@@ -205,10 +343,13 @@ document_repo_queryc(document_repo_t * repo, /**< 検索対象のドキュメン
   document_array_t * da = repo->da;
   size_t n_docs = da->n;
   document_t * a = da->a;
-  /* 以下では文字列の終わりは0と仮定しているので不要 */
-  (void)query_len;
+  /* 以下では文字列の終わりは0と仮定しているので,
+     trigramフィルタを調べるときだけ使う */
+  query_len = strnlen(query, query_len);
   size_t c = 0;
   for (size_t i = 0; i < n_docs; i++) {
+    /* 出現し得ないドキュメントは読まない */
+    if (!trigram_filter_may_contain(&da->f[i], query, query_len)) continue;
     char * p = a[i].data;
     while (p) {
       /* pから始まる文字列中から, queryの出現を検索 */
@@ -224,6 +365,202 @@ document_repo_queryc(document_repo_t * repo, /**< 検索対象のドキュメン
   return c;
 }
 
+/**
+   @brief 複数の検索文字列を同時に検索するための Aho-Corasick オートマトン
+
+   @sa document_repo_querycm
+
+   @details 全検索文字列からなるトライに失敗遷移を書き込んで完全な
+   DFA にしたもの. 遷移表は状態ごとに1行の密な配列 next[状態 *
+   n_classes + 文字クラス] で, 1バイトあたりの処理は表引き1回になる.
+   表を小さく(キャッシュに載りやすく)するため,
+
+   - 文字は検索文字列に現れるバイトごとにクラス 1, 2, ... に分け,
+     検索文字列に現れないバイトはすべてクラス 0 にまとめる.
+     行の幅は 256 ではなく n_classes になる.
+   - 状態は根からの幅優先順に番号を振り直す. よく訪れる浅い状態が
+     表の先頭にまとまる.
+
+   幅優先順なので fail[s] < s (s > 0) が成り立つ.
+ */
+typedef struct {
+  unsigned char cls[256];       /**< バイト -> 文字クラス */
+  size_t n_classes;             /**< 文字クラス数(=遷移表の行の幅) */
+  size_t n_states;              /**< 状態数(状態0が根) */
+  unsigned int * next;          /**< 遷移表(n_states * n_classes) */
+  unsigned int * fail;          /**< 失敗遷移(最長の真の接尾辞に対応する状態) */
+  unsigned int * term;          /**< 検索文字列i を読み終えた状態 */
+} ac_automaton_t;
+
+/** 遷移表の未定義を表す値(構築中のみ使う) */
+static const unsigned int ac_none = (unsigned int)-1;
+
+/**
+   @brief Aho-Corasick オートマトンを破壊. メモリを開放
+ */
+static void ac_automaton_destroy(ac_automaton_t * ac) {
+  if (ac->next) my_free(ac->next);
+  if (ac->fail) my_free(ac->fail);
+  if (ac->term) my_free(ac->term);
+  ac->next = ac->fail = ac->term = 0;
+}
+
+/**
+   @brief n 個の検索文字列から Aho-Corasick オートマトンを作る
+   @return 成功したら0, 失敗(メモリ割り当て失敗)したら-1
+
+   @details まず挿入順に番号を振ったトライを作り, 幅優先探索で失敗遷移
+   を求めながら未定義の遷移を埋める. 最後に状態を幅優先順に並べ替えた
+   表を作り直す.
+ */
+static int ac_automaton_build(ac_automaton_t * ac,
+                              char ** queries, size_t * query_lens, size_t n) {
+  ac->next = ac->fail = ac->term = 0;
+  /* 文字クラス */
+  memset(ac->cls, 0, sizeof(ac->cls));
+  size_t nc = 1;
+  size_t total_len = 0;
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < query_lens[i]; j++) {
+      unsigned char c = queries[i][j];
+      if (!ac->cls[c]) ac->cls[c] = nc++;
+    }
+    total_len += query_lens[i];
+  }
+  ac->n_classes = nc;
+  size_t max_states = total_len + 1;
+  unsigned int * g = malloc_or_err(sizeof(unsigned int) * max_states * nc);
+  unsigned int * fail = malloc_or_err(sizeof(unsigned int) * max_states);
+  unsigned int * order = malloc_or_err(sizeof(unsigned int) * max_states);
+  unsigned int * rank = malloc_or_err(sizeof(unsigned int) * max_states);
+  ac->term = malloc_or_err(sizeof(unsigned int) * (n ? n : 1));
+  if (!g || !fail || !order || !rank || !ac->term) {
+    if (g) my_free(g);
+    if (fail) my_free(fail);
+    if (order) my_free(order);
+    if (rank) my_free(rank);
+    ac_automaton_destroy(ac);
+    return -1;
+  }
+  /* トライ(状態番号は挿入順) */
+  for (size_t k = 0; k < nc; k++) g[k] = ac_none;
+  size_t ns = 1;
+  for (size_t i = 0; i < n; i++) {
+    size_t s = 0;
+    for (size_t j = 0; j < query_lens[i]; j++) {
+      size_t c = ac->cls[(unsigned char)queries[i][j]];
+      if (g[s * nc + c] == ac_none) {
+        for (size_t k = 0; k < nc; k++) g[ns * nc + k] = ac_none;
+        g[s * nc + c] = ns++;
+      }
+      s = g[s * nc + c];
+    }
+    ac->term[i] = s;
+  }
+  /* 幅優先探索で失敗遷移を求め, 未定義の遷移を埋める.
+     goto(s, c) が未定義なら goto(fail(s), c) (根では根へ戻る) */
+  size_t head = 0, tail = 0;
+  order[tail++] = 0;
+  fail[0] = 0;
+  while (head < tail) {
+    size_t s = order[head++];
+    for (size_t c = 0; c < nc; c++) {
+      unsigned int t = g[s * nc + c];
+      if (t == ac_none) {
+        g[s * nc + c] = (s == 0 ? 0 : g[fail[s] * nc + c]);
+      } else {
+        fail[t] = (s == 0 ? 0 : g[fail[s] * nc + c]);
+        order[tail++] = t;
+      }
+    }
+  }
+  assert(tail == ns);
+  /* 幅優先順に番号を振り直した表を作る */
+  for (size_t r = 0; r < ns; r++) rank[order[r]] = r;
+  ac->next = malloc_or_err(sizeof(unsigned int) * ns * nc);
+  ac->fail = malloc_or_err(sizeof(unsigned int) * ns);
+  if (ac->next && ac->fail) {
+    for (size_t r = 0; r < ns; r++) {
+      size_t s = order[r];
+      for (size_t c = 0; c < nc; c++) {
+        ac->next[r * nc + c] = rank[g[s * nc + c]];
+      }
+      ac->fail[r] = rank[fail[s]];
+    }
+    for (size_t i = 0; i < n; i++) ac->term[i] = rank[ac->term[i]];
+    ac->n_states = ns;
+  }
+  my_free(g);
+  my_free(fail);
+  my_free(order);
+  my_free(rank);
+  if (!ac->next || !ac->fail) {
+    ac_automaton_destroy(ac);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+   @brief ドキュメントレポジトリから複数の検索文字列を一度に検索しそれぞれの出現回数
+   (のみ)を返す
+   @return 成功したら0, 失敗(メモリ割り当て失敗)したら-1
+   @sa document_repo_queryc
+
+   @details n 個の検索文字列 queries[0], ..., queries[n-1] の出現回数
+   を counts[0], ..., counts[n-1] に格納する. 各 counts[i] は
+   document_repo_queryc(repo, queries[i], query_lens[i]) と同じ値
+   (重なった出現も数える. 空文字列は 0). ただし全検索文字列を1つの
+   Aho-Corasick オートマトン(ac_automaton_t)にまとめるので, ドキュメン
+   トの走査は n によらず1回で済む.
+
+   走査中は各状態を訪れた回数だけを数え, 走査後に幅優先の逆順に失敗遷移
+   に沿って足し込む. 状態 s を訪れたときには s の接尾辞に対応するすべて
+   の状態の文字列も出現しているので, 検索文字列iの出現回数はそれを読み終
+   えた状態の(足し込み後の)回数になる.
+  */
+int document_repo_querycm(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                          char ** queries,        /**< 検索文字列の配列 */
+                          size_t * query_lens,    /**< 各検索文字列の長さ(バイト数) */
+                          size_t n,               /**< 検索文字列の数 */
+                          size_t * counts         /**< 各検索文字列の出現回数(出力) */
+                          ) {
+  ac_automaton_t ac[1];
+  if (ac_automaton_build(ac, queries, query_lens, n) == -1) return -1;
+  size_t ns = ac->n_states;
+  size_t nc = ac->n_classes;
+  size_t * visits = malloc_or_err(sizeof(size_t) * ns);
+  if (!visits) {
+    ac_automaton_destroy(ac);
+    return -1;
+  }
+  memset(visits, 0, sizeof(size_t) * ns);
+  const unsigned char * cls = ac->cls;
+  const unsigned int * next = ac->next;
+  document_array_t * da = repo->da;
+  size_t n_docs = da->n;
+  document_t * a = da->a;
+  for (size_t i = 0; i < n_docs; i++) {
+    /* strstr と同じく, ドキュメントは最初の0で終わるとみなす */
+    const unsigned char * p = (const unsigned char *)a[i].data;
+    size_t s = 0;
+    for (; *p; p++) {
+      s = next[s * nc + cls[*p]];
+      visits[s]++;
+    }
+  }
+  /* 失敗遷移に沿って足し込む(fail[s] < s) */
+  for (size_t s = ns - 1; s > 0; s--) {
+    visits[ac->fail[s]] += visits[s];
+  }
+  for (size_t i = 0; i < n; i++) {
+    counts[i] = (query_lens[i] ? visits[ac->term[i]] : 0);
+  }
+  my_free(visits);
+  ac_automaton_destroy(ac);
+  return 0;
+}
+
 /**
    @brief 全ドキュメントのダンプを表すデータ構造
 
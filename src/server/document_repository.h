@@ -23,6 +23,25 @@ typedef struct {
   size_t data_len;              /**< データの長さ(バイト数) */
 } document_t;
 
+/**
+   @brief ドキュメントに現れるバイト3-gram(trigram)の集合を表すBloomフィルタ
+
+   @sa document_repo_add
+   @sa query_result_next
+   @sa document_repo_queryc
+
+   @details 検索文字列のtrigramがひとつでもフィルタに無ければ, その
+   ドキュメントに検索文字列は出現しない(逆は成り立たない). 走査の前に
+   これを調べ, 明らかに出現しないドキュメントを読まずに済ませる.
+   ビット数 mask + 1 は2のべきで, ドキュメントに現れる異なるtrigram
+   の数に応じて小さくする. bits == 0 (割り当て失敗など)のときは
+   何も除外しない.
+  */
+typedef struct {
+  unsigned long * bits;         /**< ビット列 */
+  size_t mask;                  /**< ビット数 - 1 */
+} trigram_filter_t;
+
 /**
    @brief ドキュメントの可変長配列
 
@@ -44,6 +63,7 @@ typedef struct {
   size_t sz;                    /**< 配列aのサイズ */
   size_t n;                     /**< 現在埋まっている要素数(n <= sz)  */
   document_t * a;               /**< ドキュメントの配列 */
+  trigram_filter_t * f;         /**< f[i] は a[i] のtrigramフィルタ */
 } document_array_t;
 
 
@@ -151,6 +171,8 @@ occurrence_t query_result_next(query_result_t * qr);
 
 size_t
 document_repo_queryc(document_repo_t * repo, char * query, size_t query_len);
+int document_repo_querycm(document_repo_t * repo, char ** queries,
+                          size_t * query_lens, size_t n, size_t * counts);
 
 dump_result_t document_repo_dump(document_repo_t * repo);
 size_t document_repo_n_docs(document_repo_t * repo);
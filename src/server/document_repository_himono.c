@@ -100,9 +100,9 @@ static long document_array_pushback(document_array_t * da, document_t d) {
 }
 
 /**
-   @brief ドキュメントの配列からidx番目の文字を含むドキュメントを返す
+   @brief ドキュメントの配列からidx番目の文字を含むドキュメントの番号(添字)を返す
 */
-document_t document_array_find_doc(document_array_t * da, long idx) {
+long document_array_find_doc_idx(document_array_t * da, long idx) {
   document_t * a = da->a;
   long n = da->n;
   assert(n > 0);
@@ -111,7 +111,7 @@ document_t document_array_find_doc(document_array_t * da, long idx) {
   long q = n - 1;
   assert(idx < a[q].data_o + a[q].data_len);
   if (a[q].data_o <= idx) {
-    return a[q];
+    return q;
   } else {
     assert(a[p].data_o <= idx);
     assert(idx < a[q].data_o);
@@ -129,10 +129,17 @@ document_t document_array_find_doc(document_array_t * da, long idx) {
     assert(a[p].data_o <= idx);
     assert(idx < a[q].data_o);
     assert(a[p].data_o + a[p].data_len == a[q].data_o);
-    return a[p];
+    return p;
   }
 }
 
+/**
+   @brief ドキュメントの配列からidx番目の文字を含むドキュメントを返す
+*/
+document_t document_array_find_doc(document_array_t * da, long idx) {
+  return da->a[document_array_find_doc_idx(da, idx)];
+}
+
 /**
    @brief dataのchar_bufで idx 番目の文字から始まる
    文字列の長さ(バイト数)を返す.
@@ -146,6 +153,39 @@ long document_array_data_len(document_array_t * da, long idx) {
   return d.data_o + d.data_len - idx;
 }
 
+/**
+   @brief labelsのchar_bufで idx 番目の文字を含むラベルを持つドキュメントの番号を返す
+   @details 長さ0のラベルがあるため label_o は等しいものが並びうる.
+   label_o <= idx である最後のドキュメントを返す.
+*/
+static long document_array_find_label_doc(document_array_t * da, long idx) {
+  document_t * a = da->a;
+  long p = 0;
+  long q = da->n;
+  assert(q > 0);
+  assert(a[0].label_o <= idx);
+  /* a[p].label_o <= idx < a[q].label_o */
+  while (q - p > 1) {
+    long c = (p + q) / 2;
+    if (a[c].label_o <= idx) {
+      p = c;
+    } else {
+      q = c;
+    }
+  }
+  assert(idx < a[p].label_o + a[p].label_len);
+  return p;
+}
+
+/**
+   @brief labelsのchar_bufで idx 番目の文字から始まり,
+   それを含むラベルの終わりまでの長さ(バイト数)を返す.
+ */
+static long document_array_label_len(document_array_t * da, long idx) {
+  document_t d = da->a[document_array_find_label_doc(da, idx)];
+  return d.label_o + d.label_len - idx;
+}
+
 /* char_buf関連  */
 
 /**
@@ -219,6 +259,21 @@ static long char_buf_pushback(char_buf_t * cb, char * s, long len) {
  */
 const int sa_dbg = 0;
 
+/**
+   @brief 文字列 s (長さ len) の先頭8バイトをbig endianの整数にしたもの
+   @details 長さが8未満の場合, 足りないバイトは0とみなす.
+   text_key(a) < text_key(b) ならば a < b (辞書順).
+   等しい場合はどちらもありうる.
+ */
+static uint64_t text_key(char * s, long len) {
+  uint64_t x = 0;
+  for (long i = 0; i < 8; i++) {
+    x <<= 8;
+    if (i < len) x |= (unsigned char)s[i];
+  }
+  return x;
+}
+
 /**
    @brief suffix array初期化
  */
@@ -226,6 +281,7 @@ static void suffix_array_init(suffix_array_t * sa) {
   sa->sz = 0;      /* ptrsの容量(格納可能要素数) */
   sa->n = 0;       /* ユニークな要素数 */
   sa->ptrs = 0;    /* 文字列開始位置の配列 */
+  sa->keys = 0;    /* 各要素の先頭8バイト(使わない) */
   sa->f = 2;
 }
 
@@ -234,7 +290,9 @@ static void suffix_array_init(suffix_array_t * sa) {
  */
 static void suffix_array_destroy(suffix_array_t * sa) {
   my_free(sa->ptrs);
+  my_free(sa->keys);
   sa->ptrs = 0;
+  sa->keys = 0;
   sa->n = 0;
   sa->sz = 0;
   sa->f = 0;
@@ -257,6 +315,8 @@ static int suffix_array_ensure_sz(suffix_array_t * sa, long req_sz) {
     assert(sz < new_sz);
     sa_idx_t * ptrs = sa->ptrs;
     sa_idx_t * new_ptrs = malloc_or_err(new_sz * sizeof(sa_idx_t));
+    uint64_t * keys = sa->keys;
+    uint64_t * new_keys = (keys ? malloc_or_err(new_sz * sizeof(uint64_t)) : 0);
     if (sa_dbg>=2) {
       printf("suffix_array_ensure_sz -> %ld elems\n", (long)new_sz);
     }
@@ -269,14 +329,24 @@ static int suffix_array_ensure_sz(suffix_array_t * sa, long req_sz) {
           new_ptrs[i * f + j] = ptrs[i];
         }
       }
+      if (keys) {
+        for (long i = 0; i < sz; i++) {
+          for (long j = 0; j < f; j++) {
+            new_keys[i * f + j] = keys[i];
+          }
+        }
+      }
       my_free(ptrs);
     } else {
       assert(sz == 0);
       for (long i = 0; i < new_sz; i++) {
         new_ptrs[i] = 0;
+        if (new_keys) new_keys[i] = 0;
       }
     }
+    my_free(keys);
     sa->ptrs = new_ptrs;
+    sa->keys = new_keys;
     sa->sz = new_sz;
     return 1;
   } else {
@@ -290,6 +360,7 @@ static int suffix_array_ensure_sz(suffix_array_t * sa, long req_sz) {
 */
 static void suffix_array_shift_ptrs(suffix_array_t * sa, long i, long j, long s) {
   sa_idx_t * ptrs = sa->ptrs;
+  uint64_t * keys = sa->keys;
   long     sz = sa->sz;
   if (sa_dbg>=2) {
     printf("suffix_array_shift_ptrs [%ld:%ld] -> [%ld:%ld]\n",
@@ -306,6 +377,7 @@ static void suffix_array_shift_ptrs(suffix_array_t * sa, long i, long j, long s)
       assert(0 <= k + s);
       assert(k + s < sz);
       ptrs[k + s] = sa->ptrs[k];
+      if (keys) keys[k + s] = keys[k];
     }
   } else {
     /* 右にずらす場合(左端の要素からずらす) */
@@ -317,26 +389,29 @@ static void suffix_array_shift_ptrs(suffix_array_t * sa, long i, long j, long s)
       assert(0 <= k + s);       /* 0 <= i + s */
       assert(k + s < sz);       /* j + s <= sz */
       ptrs[k + s] = sa->ptrs[k];
+      if (keys) keys[k + s] = keys[k];
     }
   }
 }
 
 /**
-   @brief suffix arrayの全要素をxにする
+   @brief suffix arrayの全要素をx (その先頭8バイトはkey)にする
 */
-static void suffix_array_set_ptrs(suffix_array_t * sa, long x) {
+static void suffix_array_set_ptrs(suffix_array_t * sa, long x, uint64_t key) {
   sa_idx_t * ptrs = sa->ptrs;
+  uint64_t * keys = sa->keys;
   long sz = sa->sz;
   assert(sa->n == 0);
   for (long i = 0; i < sz; i++) {
     ptrs[i] = x;
+    if (keys) keys[i] = key;
   }
   sa->n = 1;
 }
 
 /* 
    @brief suffix arrayのi-1 と i の間にxを挿入.
-   @details 最終的に ptrs[i] = x とする. それにともない,
+   @details 最終的に ptrs[i] = x (keysがあれば keys[i] = key) とする. それにともない,
    前後の値をずらす必要があればずらす.
    例えばこのようになっていたとする. aaa, gg は
    それらの場所に同じ要素が入っていることを示す.
@@ -349,9 +424,11 @@ static void suffix_array_set_ptrs(suffix_array_t * sa, long x) {
     ...aaaabcxdefgg...
 
  */
-static long suffix_array_insert_ptr_before(suffix_array_t * sa, long i, long x) {
+static long suffix_array_insert_ptr_before(suffix_array_t * sa, long i,
+                                          long x, uint64_t key) {
   assert((sa->n + 1) * sa->f <= sa->sz);
   sa_idx_t * ptrs = sa->ptrs;
+  uint64_t * keys = sa->keys;
   long sz = sa->sz;
   /* ... i-2 i-1 | i i+1 i+2 ... */
   assert(i == 0 || i == sz || ptrs[i - 1] != ptrs[i]);
@@ -368,6 +445,7 @@ static long suffix_array_insert_ptr_before(suffix_array_t * sa, long i, long x)
           printf("[%ld] <- %ld\n", (long)i, (long)x);
         }
         ptrs[i] = x;
+        if (keys) keys[i] = key;
         sa->n++;
         return j;
       }
@@ -382,6 +460,7 @@ static long suffix_array_insert_ptr_before(suffix_array_t * sa, long i, long x)
           printf("[%ld] <- %ld\n", (long)(i - 1), (long)x);
         }
         ptrs[i - 1] = x;
+        if (keys) keys[i - 1] = key;
         sa->n++;
         return -j;
       }
@@ -392,6 +471,214 @@ static long suffix_array_insert_ptr_before(suffix_array_t * sa, long i, long x)
   return 0;
 }
 
+/* バケット表関連 */
+
+/**
+   @brief バケット表の初期化
+ */
+static void sa_bucket_init(sa_bucket_t * bt) {
+  bt->begin = malloc_or_err(sizeof(long) * (sa_n_buckets + 1));
+  bt->cnt2 = malloc_or_err(sizeof(long) * sa_n_buckets);
+  /* 空のsuffix array(sz = 0)に対応する表 */
+  memset(bt->begin, 0, sizeof(long) * (sa_n_buckets + 1));
+  memset(bt->cnt2, 0, sizeof(long) * sa_n_buckets);
+  memset(bt->cnt1, 0, sizeof(bt->cnt1));
+}
+
+/**
+   @brief バケット表の破壊
+ */
+static void sa_bucket_destroy(sa_bucket_t * bt) {
+  my_free(bt->begin);
+  my_free(bt->cnt2);
+  bt->begin = 0;
+  bt->cnt2 = 0;
+}
+
+/**
+   @brief 文字列 s (長さ len) が属するバケット(先頭2バイト)
+   @details 長さが2未満の場合, 足りないバイトは0とみなす.
+   text_bucket(a) < text_bucket(b) ならば a < b (辞書順)
+ */
+static long text_bucket(char * s, long len) {
+  long p = 0;
+  if (len >= 1) p |= ((unsigned char)s[0]) << 8;
+  if (len >= 2) p |= (unsigned char)s[1];
+  return p;
+}
+
+/**
+   @brief suffix arrayのk番目の要素が属するバケット.
+   k < 0 なら -1, k >= sz なら sa_n_buckets
+ */
+static long sa_bucket_of(document_repo_t * repo, long k) {
+  if (k < 0) return -1;
+  if (k >= repo->sa->sz) return sa_n_buckets;
+  if (repo->sa->keys) return repo->sa->keys[k] >> 48;
+  long idx = repo->sa->ptrs[k];
+  long len = document_array_data_len(repo->da, idx);
+  return text_bucket(&repo->data->a[idx], len);
+}
+
+/**
+   @brief suffix arrayの ptrs[lo:hi+1] が書き換わった後にバケット表を更新
+
+   @details それ以外の要素は変化していないので, begin[p] が変化しうるのは
+   ptrs[lo-1] のバケットより大きく, ptrs[hi+1] のバケット以下の p だけ.
+ */
+static void sa_bucket_update(document_repo_t * repo, long lo, long hi) {
+  long * begin = repo->bt->begin;
+  sa_idx_t * ptrs = repo->sa->ptrs;
+  long sz = repo->sa->sz;
+  long p = sa_bucket_of(repo, lo - 1) + 1;
+  long last_k = -1;
+  long last_q = -1;
+  for (long k = lo; k <= hi + 1; k++) {
+    /* 同じ要素が並んでいる場合は計算を省略 */
+    long q = ((last_k >= 0 && k < sz && ptrs[k] == ptrs[last_k]) ?
+              last_q : sa_bucket_of(repo, k));
+    for (; p <= q; p++) {
+      begin[p] = k;
+    }
+    last_k = k;
+    last_q = q;
+  }
+  if (sa_dbg>=1) {
+    for (long k = 0; k < sz; k++) {
+      long q = sa_bucket_of(repo, k);
+      assert(begin[q] <= k);
+      assert(k < begin[q + 1]);
+    }
+  }
+}
+
+/**
+   @brief suffix arrayを拡大(各要素をf個に複製)した後にバケット表を更新
+ */
+static void sa_bucket_scale(sa_bucket_t * bt, long f) {
+  long * begin = bt->begin;
+  for (long p = 0; p <= sa_n_buckets; p++) {
+    begin[p] *= f;
+  }
+}
+
+/**
+   @brief 長さlenのsuffix sをバケット表の要素数に数える
+ */
+static void sa_bucket_count(sa_bucket_t * bt, char * s, long len) {
+  assert(len > 0);
+  if (len >= 2) {
+    bt->cnt2[text_bucket(s, len)]++;
+  } else {
+    bt->cnt1[(unsigned char)s[0]]++;
+  }
+}
+
+/**
+   @brief 長さ2以下の文字列の出現数をバケット表から求める
+ */
+static long sa_bucket_queryc(sa_bucket_t * bt, char * query, long query_len) {
+  assert(query_len <= 2);
+  if (query_len == 2) {
+    return bt->cnt2[text_bucket(query, query_len)];
+  } else {
+    /* 長さ1: 先頭バイトが一致する全てのsuffix */
+    long c0 = (unsigned char)query[0];
+    long c = bt->cnt1[c0];
+    for (long p = c0 << 8; p < (c0 + 1) << 8; p++) {
+      c += bt->cnt2[p];
+    }
+    return c;
+  }
+}
+
+/* 静的探索木関連 */
+
+/**
+   @brief 静的探索木の標本間隔(suffix arrayの要素数)
+ */
+static const long sa_tree_step = 32;
+
+/**
+   @brief 静的探索木の初期化(木が無い状態)
+ */
+static void sa_tree_init(sa_tree_t * t) {
+  t->n = 0;
+  t->nodes = 0;
+}
+
+/**
+   @brief 静的探索木の破壊
+ */
+static void sa_tree_destroy(sa_tree_t * t) {
+  my_free(t->nodes);
+  t->nodes = 0;
+  t->n = 0;
+}
+
+/**
+   @brief nodes[i] を根とする部分木に, r番目以降の標本を中間順に格納
+   @return 次に格納する標本の番号
+ */
+static long sa_tree_fill(document_repo_t * repo, long i, long r) {
+  sa_tree_t * t = repo->tree;
+  if (i <= t->n) {
+    r = sa_tree_fill(repo, 2 * i, r);
+    long k = r * sa_tree_step;
+    uint64_t key;
+    if (repo->sa->keys) {
+      key = repo->sa->keys[k];
+    } else {
+      long idx = repo->sa->ptrs[k];
+      long len = document_array_data_len(repo->da, idx);
+      key = text_key(&repo->data->a[idx], len);
+    }
+    sa_tree_node_t node = { key, k };
+    t->nodes[i] = node;
+    r = sa_tree_fill(repo, 2 * i + 1, r + 1);
+  }
+  return r;
+}
+
+/**
+   @brief keyが x 以上(strict = 1), または x より大きい(strict = 0)
+   最初の標本を探す
+   @return その標本の nodes 中の添字. 無ければ0
+ */
+static long sa_tree_lower_bound(sa_tree_t * t, uint64_t x, int strict) {
+  sa_tree_node_t * nodes = t->nodes;
+  long n = t->n;
+  long i = 1;
+  while (i <= n) {
+    if (16 * i <= n) __builtin_prefetch(&nodes[16 * i]);
+    i = 2 * i + (strict ? nodes[i].key < x : nodes[i].key <= x);
+  }
+  /* 最後に左へ進んだ節点まで戻る */
+  return i >> __builtin_ffsl(~i);
+}
+
+/**
+   @brief 静的探索木を使い, queryの挿入位置の範囲 [*a, *b] を狭める
+
+   @details keyが query のkeyより小さい標本は query より小さく,
+   大きい標本は query より大きい. 標本は sa_tree_step おきなので,
+   ある標本の直前の標本の添字はその添字 - sa_tree_step.
+ */
+static void sa_tree_narrow(document_repo_t * repo, char * query, long qlen,
+                           long * a, long * b) {
+  sa_tree_t * t = repo->tree;
+  uint64_t x = text_key(query, qlen);
+  /* x以上の最初の標本の, 一つ前の標本より後 */
+  long i = sa_tree_lower_bound(t, x, 1);
+  long lo = (i ? t->nodes[i].k : t->n * sa_tree_step) - sa_tree_step + 1;
+  if (*a < lo) *a = lo;
+  /* xより大きい最初の標本以前 */
+  long j = sa_tree_lower_bound(t, x, 0);
+  long hi = (j ? t->nodes[j].k : repo->sa->sz);
+  if (hi < *b) *b = hi;
+  assert(*a <= *b);
+}
+
 /* document repository関連 */
 
 /**
@@ -416,12 +703,66 @@ int textcmp(char * a, long alen, char * b, long blen) {
   }
 }
 
+/**
+   @brief suffix arrayの要素 ptrs[a:b] の中から, query以上である最初の要素の添字を返す
+
+   @details ptrs[a-1] のsuffix < query <= ptrs[b] のsuffix が成り立って
+   いなければならない. suffixは chars 中の文字列で, その長さ(バイト数)は
+   suffix_len(da, ptrs[i]) で求める. 各要素の先頭8バイト(keys)が
+   あれば, それがqueryと異なる限りtextを参照せずに比較する.
+ */
+static long suffix_array_lower_bound(suffix_array_t * sa, char * chars,
+                                     document_array_t * da,
+                                     long (*suffix_len)(document_array_t *, long),
+                                     long a, long b,
+                                     char * query, long qlen) {
+  sa_idx_t * ptrs = sa->ptrs;
+  uint64_t * keys = sa->keys;
+  uint64_t x = (keys ? text_key(query, qlen) : 0);
+  assert(0 <= a);
+  assert(a <= b);
+  assert(b <= sa->sz);
+  /* &chars[sa[a-1]] < query <= &chars[sa[b]] */
+  while (a < b) {
+    long c = (a + b) / 2;
+    int lt;
+    if (keys && keys[c] != x) {
+      /* 先頭8バイトで決まる(textを見ない) */
+      lt = (keys[c] < x);
+    } else {
+      long clen = suffix_len(da, ptrs[c]);
+      lt = (textcmp(&chars[ptrs[c]], clen, query, qlen) < 0);
+    }
+    if (lt) {
+      a = c + 1;
+    } else {
+      b = c;
+    }
+  }
+  assert(a == b);
+  if (sa_dbg>=1) {
+    if (b > 0) {
+      long alen = suffix_len(da, ptrs[b - 1]);
+      assert(textcmp(&chars[ptrs[b - 1]], alen, query, qlen) < 0);
+    }
+    if (b < sa->sz) {
+      long blen = suffix_len(da, ptrs[b]);
+      assert(textcmp(query, qlen, &chars[ptrs[b]], blen) <= 0);
+    }
+  }
+  return b;
+}
+
 /**
    @brief
    以下を満たすindexを返す (< は, qlen文字まで比べる辞書順順序)
    &text[sa[index-1]] < query <= &text[sa[index]]
    &text[sa[index]] が query をprefixに含んでいなければ,
    queryはtext中に現れない.
+
+   @details 先頭2バイトが等しい要素の範囲をバケット表で求め,
+   静的探索木があればそれでさらに範囲を狭め,
+   その範囲内だけを2分探索する.
  */
 
 static long document_repo_search(document_repo_t * repo,
@@ -431,42 +772,15 @@ static long document_repo_search(document_repo_t * repo,
   if (sz == 0) {
     return -1;
   } else {
-    sa_idx_t * ptrs = repo->sa->ptrs;
-    char * chars = repo->data->a;
-    document_array_t * da = repo->da;
-    long a = 0, b = sz - 1;
-    long alen = document_array_data_len(da, ptrs[a]);
-    long blen = document_array_data_len(da, ptrs[b]);
-
-    if (textcmp(query, qlen, &chars[ptrs[a]], alen) <= 0) return 0;
-    if (textcmp(&chars[ptrs[b]], blen, query, qlen) <  0) return sz;
-    /* &chars[sa[a]] < query <= &chars[sa[b]] */
-    while (b - a > 1) {
-      if (sa_dbg>=1) {
-        assert(textcmp(&chars[ptrs[a]], alen, query, qlen) < 0);
-        assert(textcmp(query, qlen, &chars[ptrs[b]], blen) <= 0);
-      }
-      long c = (a + b) / 2;
-      long clen = document_array_data_len(da, ptrs[c]);
-      if (textcmp(&chars[ptrs[c]], clen, query, qlen) < 0) {
-        a = c;
-        alen = clen;
-      } else {
-        if (sa_dbg>=1) {
-          assert(textcmp(query, qlen, &chars[ptrs[c]], clen) <= 0);
-        }
-        b = c;
-        blen = clen;
-      }
-    }
-    assert(a == b - 1);
-    assert(0 < b);
-    assert(b < sz);
-    if (sa_dbg>=1) {
-      assert(textcmp(&chars[ptrs[a]], alen, query, qlen) < 0);
-      assert(textcmp(query, qlen, &chars[ptrs[b]], blen) <= 0);
+    long p = text_bucket(query, qlen);
+    long a = repo->bt->begin[p];
+    long b = repo->bt->begin[p + 1];
+    if (repo->tree->n) {
+      sa_tree_narrow(repo, query, qlen, &a, &b);
     }
-    return b;
+    return suffix_array_lower_bound(repo->sa, repo->data->a, repo->da,
+                                    document_array_data_len,
+                                    a, b, query, qlen);
   }
 }
 
@@ -534,12 +848,18 @@ static void document_repo_print(document_repo_t * repo) {
 
 static void document_repo_add_str(document_repo_t * repo, long idx, long len) {
   suffix_array_t * sa = repo->sa;
-  suffix_array_ensure_sz(sa, (sa->n + 1) * sa->f);
+  long old_sz = sa->sz;
+  if (suffix_array_ensure_sz(sa, (sa->n + 1) * sa->f) && old_sz) {
+    sa_bucket_scale(repo->bt, sa->sz / old_sz);
+  }
   document_array_t * da = repo->da;
   char * chars = repo->data->a;
   char * s = &chars[idx];
+  uint64_t key = text_key(s, len);
+  sa_bucket_count(repo->bt, s, len);
   if (sa->n == 0) {
-    suffix_array_set_ptrs(sa, idx);
+    suffix_array_set_ptrs(sa, idx, key);
+    sa_bucket_update(repo, 0, sa->sz - 1);
   } else {
     long i = document_repo_search(repo, s, len);
     sa_idx_t * ptrs = sa->ptrs;
@@ -564,13 +884,31 @@ static void document_repo_add_str(document_repo_t * repo, long idx, long len) {
         assert(textcmp(&chars[q], qlen, s, len) < 0);
       }
     }
-    suffix_array_insert_ptr_before(sa, i, idx);
+    long j = suffix_array_insert_ptr_before(sa, i, idx, key);
+    /* 書き換わった範囲のバケット表を更新 */
+    if (j > 0) {
+      sa_bucket_update(repo, i, i + j);
+    } else {
+      sa_bucket_update(repo, i + j - 1, i - 1);
+    }
     if (sa_dbg>=2) {
       document_repo_check_ascending(repo, 0, repo->sa->sz, 0);
     }
   }
 }
 
+/**
+   @brief data_o から始まるドキュメント中の位置 chars[o] をsuffix arrayに
+   登録するか(ドキュメントの先頭, UTF-8の先頭バイト, 空白の後のASCII文字)
+
+   @details 全スキャンで見つけた出現もこの位置のものだけを返し,
+   suffix arrayによる検索と結果を揃える
+ */
+static int document_repo_indexed_pos(char * chars, long data_o, long o) {
+  unsigned char c = chars[o];
+  return (o == data_o || (c >> 6) == 3 || ((c >> 7) == 0 && isspace(chars[o - 1])));
+}
+
 /**
    @brief
    (base+begin_idx)   から始まり (base+end_idx-1) で終わる文字列をsaに追加
@@ -586,8 +924,7 @@ static void document_repo_add_strs(document_repo_t * repo,
       document_repo_print(repo);
     }
     long o = begin_idx + i;
-    if (i == 0 || (((unsigned char)chars[o]) >> 6) == 3  ||
-        ((((unsigned char)chars[o]) >> 7) == 0 && isspace(chars[o-1]))) {
+    if (document_repo_indexed_pos(chars, begin_idx, o)) {
       document_repo_add_str(repo, o, len - i);
     }
   }
@@ -596,6 +933,168 @@ static void document_repo_add_strs(document_repo_t * repo,
   }
 }
 
+/**
+   @brief
+   ラベル labels[idx:idx+len] をラベルのsuffix arrayに追加
+ */
+static void document_repo_add_label_str(document_repo_t * repo,
+                                        long idx, long len) {
+  suffix_array_t * sa = repo->lsa;
+  suffix_array_ensure_sz(sa, (sa->n + 1) * sa->f);
+  char * chars = repo->labels->a;
+  if (sa->n == 0) {
+    suffix_array_set_ptrs(sa, idx, 0);
+  } else {
+    long i = suffix_array_lower_bound(sa, chars, repo->da,
+                                      document_array_label_len,
+                                      0, sa->sz, &chars[idx], len);
+    suffix_array_insert_ptr_before(sa, i, idx, 0);
+  }
+}
+
+/**
+   @brief
+   ラベル labels[begin_idx:begin_idx+len] の全てのsuffixを
+   ラベルのsuffix arrayに追加. ラベルは短いので全ての位置を登録する
+ */
+static void document_repo_add_label_strs(document_repo_t * repo,
+                                         long begin_idx, long len) {
+  for (long i = 0; i < len; i++) {
+    document_repo_add_label_str(repo, begin_idx + i, len - i);
+  }
+}
+
+/* ラベルのハッシュ表(label_index)関連 */
+
+/**
+   @brief ラベルのハッシュ表の初期化(空にする)
+ */
+static void label_index_init(label_index_t * lix) {
+  lix->sz = 0;
+  lix->n = 0;
+  lix->slots = 0;
+}
+
+/**
+   @brief ラベルのハッシュ表を破壊. メモリを開放
+ */
+static void label_index_destroy(label_index_t * lix) {
+  if (lix->slots) my_free(lix->slots);
+  label_index_init(lix);
+}
+
+/**
+   @brief ラベルのハッシュ値(FNV-1a)
+ */
+static uint64_t label_hash(char * s, long len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (long i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+   @brief ハッシュ表にドキュメント doc を登録する(表に空きがあること)
+ */
+static void label_index_put(label_index_t * lix, document_repo_t * repo, long doc) {
+  document_t d = repo->da->a[doc];
+  long mask = lix->sz - 1;
+  long i = label_hash(repo->labels->a + d.label_o, d.label_len) & mask;
+  while (lix->slots[i] != -1) i = (i + 1) & mask;
+  lix->slots[i] = doc;
+  lix->n++;
+}
+
+/**
+   @brief ドキュメント doc (最後に追加されたドキュメント)をハッシュ表に登録する
+   @return 成功したら1, 失敗(メモリ割り当て失敗)したら0
+
+   @details 表が半分を超えて埋まるなら, 2倍の大きさの表に全ドキュメント
+   を番号順に登録し直す(同じラベルのドキュメントが探査列上で番号順に
+   並ぶように). 失敗したら表を空にし, document_repo_find_label は全ド
+   キュメントを調べる. 次の追加時に作り直しを試みる.
+ */
+static int label_index_add(label_index_t * lix, document_repo_t * repo, long doc) {
+  if (2 * (lix->n + 1) > lix->sz || lix->n != doc) {
+    long sz = max_long(lix->sz, 16);
+    while (2 * (doc + 1) > sz) sz *= 2;
+    long * slots = malloc_or_err(sizeof(long) * sz);
+    label_index_destroy(lix);
+    if (!slots) return 0;
+    for (long i = 0; i < sz; i++) slots[i] = -1;
+    lix->sz = sz;
+    lix->slots = slots;
+    for (long d = 0; d < doc; d++) label_index_put(lix, repo, d);
+  }
+  label_index_put(lix, repo, doc);
+  return 1;
+}
+
+/**
+   @brief ラベルが label (長さ label_len) のドキュメントを番号順に docs に
+   格納する(docs が0なら数えるだけ)
+   @return 一致したドキュメントの数
+
+   @details 表が無ければ(割り当て失敗時)全ドキュメントを順に調べる
+ */
+static long label_index_scan(document_repo_t * repo, char * label, long label_len,
+                             long * docs) {
+  document_array_t * da = repo->da;
+  label_index_t * lix = repo->lix;
+  char * labels = repo->labels->a;
+  long n = 0;
+  if (lix->slots) {
+    long mask = lix->sz - 1;
+    for (long i = label_hash(label, label_len) & mask;
+         lix->slots[i] != -1; i = (i + 1) & mask) {
+      document_t doc = da->a[lix->slots[i]];
+      if (doc.label_len == label_len
+          && memcmp(labels + doc.label_o, label, label_len) == 0) {
+        if (docs) docs[n] = lix->slots[i];
+        n++;
+      }
+    }
+  } else {
+    for (long d = 0; d < da->n; d++) {
+      document_t doc = da->a[d];
+      if (doc.label_len == label_len
+          && memcmp(labels + doc.label_o, label, label_len) == 0) {
+        if (docs) docs[n] = d;
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+/**
+   @brief ラベルが label (長さ label_len) に一致するドキュメントを得る
+   @return 一致したドキュメントの数. 失敗(メモリ割り当て失敗)したら-1
+
+   @sa document_repo_query_label
+
+   @details 一致したドキュメント番号を番号順に *result に格納する
+   (呼び出し側がmy_freeする). document_repo_query_label の
+   label_match_exact と同じ結果だが, ハッシュ表を引くので時間は
+   ドキュメント数によらない.
+  */
+long document_repo_find_label(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                              char * label,           /**< ラベル */
+                              long label_len,         /**< labelの長さ(バイト数) */
+                              long ** result          /**< 結果を格納する場所 */
+                              ) {
+  long n = label_index_scan(repo, label, label_len, 0);
+  long * docs = malloc_or_err(sizeof(long) * max_long(n, 1));
+  if (!docs) return -1;
+  long m = label_index_scan(repo, label, label_len, docs);
+  assert(m == n);
+  (void)m;
+  *result = docs;
+  return n;
+}
+
 /**
    @brief ドキュメントレポジトリ(document_repo_t)の初期化(空にする)
 
@@ -610,6 +1109,11 @@ void document_repo_init(document_repo_t * repo) {
   char_buf_init(repo->data);
   repo->use_sa = 1;
   suffix_array_init(repo->sa);
+  suffix_array_init(repo->lsa);
+  sa_bucket_init(repo->bt);
+  sa_tree_init(repo->tree);
+  label_index_init(repo->lix);
+  repo->version = 0;
 }
 
 /**
@@ -624,6 +1128,10 @@ void document_repo_destroy(document_repo_t * repo) {
   char_buf_destroy(repo->labels);
   char_buf_destroy(repo->data);
   suffix_array_destroy(repo->sa);
+  suffix_array_destroy(repo->lsa);
+  sa_bucket_destroy(repo->bt);
+  sa_tree_destroy(repo->tree);
+  label_index_destroy(repo->lix);
 }
 
 /**
@@ -642,8 +1150,13 @@ long document_repo_add(document_repo_t * repo, document_t d) {
   d.label = 0;
   d.data = 0;
   long r = document_array_pushback(repo->da, d);
+  if (r != -1) label_index_add(repo->lix, repo, r);
+  /* suffix arrayの添字がずれるので静的探索木やセッションの範囲は使えなくなる */
+  sa_tree_destroy(repo->tree);
+  repo->version++;
   if (repo->use_sa) {
     document_repo_add_strs(repo, d.data_o, d.data_len);
+    document_repo_add_label_strs(repo, d.label_o, d.label_len);
   }
   return r;
 }
@@ -669,91 +1182,452 @@ char * make_next_string(char * s, long n) {
   }
 }
 
+/**
+   @brief 検索のセッションを初期化する
+
+   @sa query_session_t
+  */
+void query_session_init(query_session_t * qs) {
+  qs->version = -1;
+  qs->n = 0;
+  qs->query = 0;
+  qs->query_len = 0;
+  qs->query_sz = 0;
+  qs->budget = 0;
+  qs->filter = 0;
+}
 
 /**
-   @brief ドキュメントレポジトリから指定文字列(query)を検索.
-   @return 検索結果(query_result_t)
-   @sa query_result_t
-   @sa query_result_next
-   @sa document_repo_add
+   @brief 検索のセッションを破壊する. メモリを開放する
+  */
+void query_session_destroy(query_session_t * qs) {
+  my_free(qs->query);
+  query_session_init(qs);
+}
 
-   @details ドキュメントレポジトリ内の全ドキュメント(これまでに
-   document_repo_add されたすべてのドキュメント)から検索文字列 query
-   の出現を検索する. query_result_next は, そこから全ての出現位置を取
-   得することができるようなデータである. 詳しくは, query_result_t のド
-   キュメントを参照
+/**
+   @brief セッションに検索文字列 query と, そこから始まるsuffixの範囲
+   ptrs[begin:end] を記録する
+
+   @details 覚えている範囲は query の接頭辞のものだけになっているはず
+   なので, 一番上に積む. 一杯なら一番短いものを捨てる.
+   query を覚えるためのメモリが割り当てられなければセッションを空にする.
   */
-query_result_t
-document_repo_query(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
-                    char * query,           /**< 検索文字列 */
-                    long query_len        /**< queryの長さ(バイト数) */
-                    ) {
-  if (repo->use_sa) {
-    char * next_query = make_next_string(query, query_len);
-    long begin = document_repo_search(repo, query,      query_len);
-    long   end = (next_query ?
-                  document_repo_search(repo, next_query, query_len) :
-                  repo->sa->sz);
-    assert(begin <= end);
-    long n = end - begin;
-    sa_idx_t * occurrences = &repo->sa->ptrs[begin];
-    my_free(next_query);
-    query_result_t qr = {
-      repo,
-      query,
-      query_len,
-      occurrences,              /* occurrences */
-      n,                        /* n_occs */
-      0,                        /* next_occ */
-      -1,
-      0
-    };
-    return qr;
-  } else {
-    query_result_t qr = {
-      repo,
-      query,
-      query_len,
-      0,                        /* occurrences */
-      -1,                       /* n_occs */
-      -1,                       /* next_occ */
-      0,                        /* next_doc */
-      0                         /* next_pos */
-    };
-    return qr;
+static void query_session_push(query_session_t * qs, long version,
+                               char * query, long query_len,
+                               long begin, long end) {
+  if (qs->query_sz < query_len) {
+    long sz = max_long(query_len, 2 * qs->query_sz);
+    char * q = malloc_or_err(sz);
+    if (!q) {
+      my_free(qs->query);
+      qs->query = 0;
+      qs->query_len = 0;
+      qs->query_sz = 0;
+      qs->n = 0;
+      return;
+    }
+    my_free(qs->query);
+    qs->query = q;
+    qs->query_sz = sz;
   }
+  memcpy(qs->query, query, query_len);
+  qs->query_len = query_len;
+  qs->version = version;
+  if (qs->n > 0 && qs->r[qs->n - 1].len == query_len) return;
+  if (qs->n == query_session_depth) {
+    memmove(&qs->r[0], &qs->r[1], sizeof(query_session_range_t) * (qs->n - 1));
+    qs->n--;
+  }
+  query_session_range_t r = { query_len, begin, end };
+  qs->r[qs->n++] = r;
 }
 
 /**
-   @brief document_repo_query で得られた検索結果から, 次の出現位置を得る
-   @return 検索文字列の次の出現位置(occurrence_t)
+   @brief セッションが覚えている範囲のうち, query の接頭辞で検索したものの数
 
-   @sa document_repo_query
-   @sa query_result_t
+   @details 範囲は短い順に並んでいるので, 先頭からその数だけが使える.
+   直前の検索文字列との共通接頭辞より長い範囲は使えない.
+   ドキュメントが追加された後(version が違う)なら0
+  */
+static long query_session_n_prefixes(query_session_t * qs, long version,
+                                     char * query, long query_len) {
+  if (qs->version != version) return 0;
+  long l = 0;
+  long m = min_long(qs->query_len, query_len);
+  while (l < m && qs->query[l] == query[l]) l++;
+  long n = qs->n;
+  while (n > 0 && qs->r[n - 1].len > l) n--;
+  return n;
+}
 
-   @details document_repo_query が返した「検索結果(query_result_t 型の
-   データ)」から, 検索文字列の「次の」出現位置を得る. 検索結果に対して
-   この関数を次々と呼び出すことで, すべての出現位置を得ることができる.
-   document_repo_query 現在の検索アルゴリズムは非常に単純(非効率)なも
+/**
+   @brief suffix array中で query から始まるsuffixの範囲 ptrs[*begin:*end] を求める
+
+   @details query が空文字列なら全体を返す.
+   セッション qs (0でもよい)が query の接頭辞の範囲を覚えていれば,
+   その中だけを探索する.
+  */
+static void document_repo_range(document_repo_t * repo, query_session_t * qs,
+                                char * query, long query_len,
+                                long * begin_, long * end_) {
+  suffix_array_t * sa = repo->sa;
+  long begin = 0;
+  long end = sa->sz;
+  if (query_len > 0 && sa->sz > 0) {
+    query_session_range_t * r = 0;
+    if (qs) {
+      qs->n = query_session_n_prefixes(qs, repo->version, query, query_len);
+      if (qs->n > 0) r = &qs->r[qs->n - 1];
+    }
+    if (r && r->len == query_len) {
+      /* 同じ検索文字列 */
+      begin = r->begin;
+      end = r->end;
+    } else if (r) {
+      /* ptrs[r->begin:r->end] は query の接頭辞から始まるsuffixの範囲 */
+      char * chars = repo->data->a;
+      document_array_t * da = repo->da;
+      char * next_query = make_next_string(query, query_len);
+      begin = suffix_array_lower_bound(sa, chars, da, document_array_data_len,
+                                       r->begin, r->end, query, query_len);
+      if (next_query && memcmp(next_query, query, r->len) == 0) {
+        end = suffix_array_lower_bound(sa, chars, da, document_array_data_len,
+                                       begin, r->end, next_query, query_len);
+      } else {
+        /* 接頭辞より後ろが全て0xff. 範囲の終わりまで */
+        end = r->end;
+      }
+      my_free(next_query);
+    } else {
+      char * next_query = make_next_string(query, query_len);
+      begin = document_repo_search(repo, query, query_len);
+      end = (next_query ?
+             document_repo_search(repo, next_query, query_len) :
+             sa->sz);
+      my_free(next_query);
+    }
+    if (qs) query_session_push(qs, repo->version, query, query_len, begin, end);
+  }
+  assert(begin <= end);
+  *begin_ = begin;
+  *end_ = end;
+}
+
+/** @brief 検索の予算で何ステップごとに期限と取り消しを調べるか */
+static const long query_budget_check_interval = 4096;
+
+/**
+   @brief 検索の予算(0なら無制限)から steps ステップ分の手間を使う
+   @return 打ち切るべきなら1
+
+   @details query_budget_check_interval ステップごとに期限と
+   取り消しを調べ, どちらかなら打ち切る(以降ずっと1を返す).
+ */
+int query_budget_step(query_budget_t * b, long steps) {
+  if (!b) return 0;
+  if (b->truncated) return 1;
+  long before = b->n_steps;
+  b->n_steps += steps;
+  if (before / query_budget_check_interval
+      != b->n_steps / query_budget_check_interval) {
+    if ((b->deadline_us && cur_time_us() >= b->deadline_us)
+        || (b->cancelled && b->cancelled(b->cancelled_arg))) {
+      b->truncated = 1;
+    }
+  }
+  return b->truncated;
+}
+
+/* 検索の方法の選択(document_repo_plan)で見積もる手間の単位は,
+   suffix arrayの要素を順に1つ辿る手間(およそ10ns) */
+/** @brief memmemが1単位の手間でスキャンするバイト数 */
+static const long query_plan_scan_bytes = 16;
+/** @brief 2バイト以上の検索文字列を見つけるごとにmemmemを呼び直す手間
+    (1バイトならmemchr程度で1とする) */
+static const long query_plan_scan_hit = 4;
+/** @brief キャッシュに無いメモリ(textなど)を参照する手間 */
+static const long query_plan_miss = 8;
+
+/**
+   @brief ceil(log2(x + 1)). 大きさxの範囲の2分探索の段数
+ */
+static long query_plan_log2(long x) {
+  long l = 0;
+  while (x > 0) {
+    l++;
+    x >>= 1;
+  }
+  return l;
+}
+
+/**
+   @brief 検索の方法の名前(explainの表示用)
+ */
+const char * query_plan_kind_name(query_plan_kind_t kind) {
+  switch (kind) {
+  case query_plan_sa:        return "sa";
+  case query_plan_sa_verify: return "sa_verify";
+  case query_plan_scan:      return "scan";
+  default:                   return "unknown";
+  }
+}
+
+/**
+   @brief 検索の条件 f (0なら全て)のドキュメント番号の範囲を [*d0, *d1) に,
+   それらのドキュメントが data 上で占める範囲を [*lo, *hi) に求める
+ */
+static void query_filter_slice(document_repo_t * repo, query_filter_t * f,
+                               long * d0, long * d1, long * lo, long * hi) {
+  document_array_t * da = repo->da;
+  long n = da->n;
+  long b = (f ? min_long(max_long(f->doc_begin, 0), n) : 0);
+  long e = (f && f->doc_end ? min_long(max_long(f->doc_end, b), n) : n);
+  *d0 = b;
+  *d1 = e;
+  *lo = (b < n ? da->a[b].data_o : repo->data->n);
+  *hi = (e < n ? da->a[e].data_o : repo->data->n);
+}
+
+/**
+   @brief ドキュメント doc のラベルが検索の条件 f の接頭辞で始まるか
+   (f が0または接頭辞の条件が無ければ1)
+ */
+static int query_filter_label(document_repo_t * repo, query_filter_t * f,
+                              document_t doc) {
+  if (!f || !f->label_prefix) return 1;
+  return (doc.label_len >= f->label_prefix_len
+          && memcmp(repo->labels->a + doc.label_o,
+                    f->label_prefix, f->label_prefix_len) == 0);
+}
+
+/**
+   @brief 検索文字列(query)の出現を列挙する方法を選ぶ
+   @return 選んだ方法, 使う範囲と見積もった手間(query_plan_t)
+
+   @details 候補の範囲を, セッションが query の接頭辞の範囲を覚えて
+   いればそれ, なければバケット表の先頭2バイト(1バイトの query なら
+   1バイト)が一致する範囲とし, 以下の手間を見積もって最も小さいものを
+   選ぶ.
+
+   - query_plan_sa: 候補の範囲を2分探索し, 求めた範囲の各要素を辿り,
+     それを含むドキュメントを探す手間.
+   - query_plan_sa_verify: 2分探索をせず, 候補の範囲の全要素を query と
+     照合する手間. 範囲がごく小さい時に得.
+   - query_plan_scan: 全ドキュメントをmemmemでスキャンし, 出現ごとに
+     呼び直す手間. 範囲が全体に比べて大きく, 出現ごとにドキュメントを
+     探すより先頭から読む方が速い時に得.
+
+   2バイト以下の query はバケット表の範囲がそのまま求める範囲なので
+   探索も照合もいらない(セッションが覚えているのがより短い接頭辞の
+   範囲なら, それではなくバケット表の範囲を使う). 照合の方が明らかに安い場合以外は実際に
+   2分探索して範囲の大きさを求め(セッションにも記録する), それで比べる.
+   suffix arrayを使わない(use_sa == 0)なら常にスキャン.
+ */
+query_plan_t document_repo_plan(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                                query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                                char * query,           /**< 検索文字列 */
+                                long query_len          /**< queryの長さ(バイト数) */
+                                ) {
+  suffix_array_t * sa = repo->sa;
+  query_plan_t plan;
+  plan.kind = query_plan_sa;
+  plan.data_len = repo->data->n;
+  plan.n_docs = repo->da->n;
+  plan.query_len = query_len;
+  plan.session_len = 0;
+  plan.range_begin = 0;
+  plan.range_end = sa->sz;
+  plan.cost_sa = -1;
+  plan.cost_sa_verify = -1;
+  /* スキャンは検索の条件のドキュメント番号の範囲だけを読む */
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, (qs ? qs->filter : 0), &d0, &d1, &lo, &hi);
+  plan.cost_scan = (hi - lo) / query_plan_scan_bytes + (d1 - d0);
+  if (!repo->use_sa) {
+    plan.kind = query_plan_scan;
+    return plan;
+  }
+  if (query_len == 0 || sa->sz == 0) {
+    /* 全体(または空)の範囲をそのまま返せばよい */
+    plan.cost_sa = sa->sz;
+    plan.cost_scan = -1;
+    return plan;
+  }
+  /* 候補の範囲 */
+  long * bucket = repo->bt->begin;
+  long p = text_bucket(query, query_len);
+  long cand_begin = bucket[p];
+  long cand_end = (query_len == 1 ? bucket[p + (1 << 8)] : bucket[p + 1]);
+  long n_prefixes = (qs ? query_session_n_prefixes(qs, repo->version, query, query_len) : 0);
+  /* 2バイト以下の query ではバケット表の範囲がそのまま求める範囲
+     なので, セッションの範囲はそれが query 自身の範囲の時だけ使う
+     (より短い接頭辞の範囲は求める範囲より広い) */
+  if (n_prefixes > 0
+      && (query_len > 2 || qs->r[n_prefixes - 1].len == query_len)) {
+    query_session_range_t * r = &qs->r[n_prefixes - 1];
+    plan.session_len = r->len;
+    cand_begin = r->begin;
+    cand_end = r->end;
+  }
+  long w = cand_end - cand_begin;
+  long cmp = (1 + query_len / 64) * query_plan_miss; /* 1回の照合 */
+  long search = 0;
+  long verify = -1;
+  if (query_len <= 2 || plan.session_len == query_len) {
+    /* 候補の範囲がそのまま求める範囲 */
+    plan.range_begin = cand_begin;
+    plan.range_end = cand_end;
+  } else {
+    search = 2 * query_plan_log2(w) * cmp;
+    verify = w * cmp;
+    if (verify <= search) {
+      /* 照合の方が2分探索より安い. 範囲の大きさは候補の範囲で見積もる */
+      plan.range_begin = cand_begin;
+      plan.range_end = cand_end;
+    } else {
+      document_repo_range(repo, qs, query, query_len,
+                          &plan.range_begin, &plan.range_end);
+    }
+  }
+  long n = plan.range_end - plan.range_begin;
+  /* 範囲の要素を1つずつ辿り, 重複でなければ(およそ1/f)それを含む
+     ドキュメントを2分探索で探す. ドキュメントの表は小さくキャッシュに
+     載るので1段を1/4とする */
+  long n_distinct = n / sa->f;
+  long docs = n_distinct * query_plan_log2(plan.n_docs) / 4;
+  plan.cost_sa = search + n + docs;
+  if (verify >= 0) plan.cost_sa_verify = verify + docs;
+  plan.cost_scan += (long)((double)n_distinct * (query_len > 1 ? query_plan_scan_hit : 1)
+                           * (hi - lo) / max_long(plan.data_len, 1));
+  /* 最も安いもの(同じなら sa, sa_verify, scan の順に優先) */
+  long best = plan.cost_sa;
+  if (plan.cost_sa_verify >= 0 && plan.cost_sa_verify < best) {
+    plan.kind = query_plan_sa_verify;
+    plan.range_begin = cand_begin;
+    plan.range_end = cand_end;
+    best = plan.cost_sa_verify;
+  }
+  if (plan.cost_scan < best) {
+    plan.kind = query_plan_scan;
+  }
+  return plan;
+}
+
+/**
+   @brief data[idx:] が query で始まるか(query_plan_sa_verify での照合)
+ */
+static int query_verify_at(document_repo_t * repo, long idx,
+                           char * query, long query_len) {
+  return (idx + query_len <= repo->data->n
+          && memcmp(repo->data->a + idx, query, query_len) == 0);
+}
+
+/**
+   @brief ドキュメントレポジトリから指定文字列(query)を検索.
+   @return 検索結果(query_result_t)
+   @sa query_result_t
+   @sa query_result_next
+   @sa document_repo_add
+
+   @details ドキュメントレポジトリ内の全ドキュメント(これまでに
+   document_repo_add されたすべてのドキュメント)から検索文字列 query
+   の出現を検索する. query_result_next は, そこから全ての出現位置を取
+   得することができるようなデータである. 詳しくは, query_result_t のド
+   キュメントを参照. 検索の方法は document_repo_plan で選ぶ.
+  */
+query_result_t
+document_repo_query(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                    query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                    char * query,           /**< 検索文字列 */
+                    long query_len        /**< queryの長さ(バイト数) */
+                    ) {
+  query_plan_t plan = document_repo_plan(repo, qs, query, query_len);
+  if (plan.kind != query_plan_scan) {
+    long begin = plan.range_begin;
+    long end = plan.range_end;
+    long n = end - begin;
+    sa_idx_t * occurrences = &repo->sa->ptrs[begin];
+    query_result_t qr = {
+      repo,
+      query,
+      query_len,
+      occurrences,              /* occurrences */
+      n,                        /* n_occs */
+      0,                        /* next_occ */
+      -1,
+      0,
+      0,                        /* buf */
+      (qs ? qs->budget : 0),    /* budget */
+      (plan.kind == query_plan_sa_verify), /* verify */
+      (qs ? qs->filter : 0)     /* filter */
+    };
+    return qr;
+  } else {
+    query_result_t qr = {
+      repo,
+      query,
+      query_len,
+      0,                        /* occurrences */
+      -1,                       /* n_occs */
+      -1,                       /* next_occ */
+      0,                        /* next_doc */
+      0,                        /* next_pos */
+      0,                        /* buf */
+      (qs ? qs->budget : 0),    /* budget */
+      (plan.kind == query_plan_sa_verify), /* verify */
+      (qs ? qs->filter : 0)     /* filter */
+    };
+    return qr;
+  }
+}
+
+/**
+   @brief query_result_next の本体(予算による結果数の上限は見ない)
+
+   @details document_repo_query 現在の検索アルゴリズムは非常に単純(非効率)なも
    ので, (putで)蓄えられたドキュメントを順に, スキャンしていくだけのも
    の. ひとつのドキュメントから文字列を検索するにはCのstrstr 関数を
    呼ぶ(man strstr して調べよ).
-
  */
-
-occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが返した検索結果 */) {
+static occurrence_t query_result_next_1(query_result_t * qr) {
   document_repo_t * repo = qr->repo;
   document_array_t * da = repo->da;
-
-  if (qr->occurrences) {
+  query_budget_t * b = qr->budget;
+
+  if (qr->buf) {
+    /* document_repo_query_sorted が並べた(有効な)出現.
+       ドキュメントも順に現れるので前から辿る */
+    if (qr->next_occ < qr->n_occs) {
+      long idx = qr->occurrences[qr->next_occ++];
+      long i = qr->next_doc;
+      while (da->a[i].data_o + da->a[i].data_len <= idx) i++;
+      qr->next_doc = i;
+      occurrence_t o = { da->a[i], idx - da->a[i].data_o };
+      return o;
+    }
+    occurrence_t o = { { 0, 0, 0, 0, 0, 0 }, -1 };
+    return o;
+  } else if (qr->occurrences) {
     long n = qr->n_occs;
     long query_len = qr->query_len;
     sa_idx_t * occurrences = qr->occurrences;
+    query_filter_t * f = qr->filter;
+    long d0, d1, lo, hi;
+    query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
     for (long i = qr->next_occ; i < n; i++) {
+      if (query_budget_step(b, 1)) {
+        qr->next_occ = i;
+        occurrence_t o = { { 0, 0, 0, 0, 0, 0 }, -1 };
+        return o;
+      }
       long idx = occurrences[i];
+      if (idx < lo || hi <= idx) continue;
+      if (qr->verify && !query_verify_at(repo, idx, qr->query, query_len)) continue;
       if (i == 0 || idx != occurrences[i - 1]) {
         document_t doc = document_array_find_doc(da, idx);
-        if (idx + query_len <= doc.data_o + doc.data_len) {
+        if (idx + query_len <= doc.data_o + doc.data_len
+            && query_filter_label(repo, f, doc)) {
           qr->next_occ = i + 1;
           occurrence_t o = { doc, idx - doc.data_o };
           return o;
@@ -768,19 +1642,34 @@ occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが
     long n_docs = da->n;
     document_t * a = da->a;
     long start_i = qr->next_doc;
-    /* qr->i 番目のドキュメントから検索 */
-    for (long i = start_i; i < n_docs; i++) {
-      char * data = a[i].data;
+    query_filter_t * f = qr->filter;
+    long d0, d1, lo, hi;
+    query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+    /* qr->i 番目のドキュメントから検索. 検索の条件の範囲外, ラベルが
+       合わないドキュメントは読まない */
+    for (long i = max_long(start_i, d0); i < d1; i++) {
+      if (!query_filter_label(repo, f, a[i])) continue;
+      char * data = repo->data->a + a[i].data_o;
       char * data_end = data + a[i].data_len;
       long query_len = qr->query_len;
       /* ドキュメント先頭もしくは最後に見つかった場所 + 1から検索 */
       char * p = ((i == start_i && qr->next_pos) ? qr->next_pos : data);
+      if (query_budget_step(b, data_end - p + 1)) {
+        qr->next_doc = i;
+        qr->next_pos = p;
+        occurrence_t o = { { 0, 0, 0, 0, 0, 0 }, -1 };
+        return o;
+      }
       while (p) {
         /* pから始まる文字列中から, queryの出現を検索 */
         // char * q = strstr(p, query);
         assert(data_end - p >= 0);
         char * q = memmem(p, data_end - p, query, query_len);
-        if (q) {
+        if (q && !document_repo_indexed_pos(repo->data->a, a[i].data_o,
+                                            q - repo->data->a)) {
+          /* 単語の途中. suffix arrayに無い位置なので飛ばす */
+          p = q + 1;
+        } else if (q) {
           /* 見つかったのでそれを返す */
           occurrence_t o = { a[i], q - data };
           qr->next_doc = i;
@@ -800,6 +1689,455 @@ occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが
   }
 }
 
+/**
+   @brief document_repo_query で得られた検索結果から, 次の出現位置を得る
+   @return 検索文字列の次の出現位置(occurrence_t)
+
+   @sa document_repo_query
+   @sa query_result_t
+
+   @details document_repo_query が返した「検索結果(query_result_t 型の
+   データ)」から, 検索文字列の「次の」出現位置を得る. 検索結果に対して
+   この関数を次々と呼び出すことで, すべての出現位置を得ることができる.
+   検索の予算(query_budget_t)があれば, 期限を過ぎたり取り消されたり,
+   max_results 個を返した後にまだ出現があれば, 打ち切って終わりを返す.
+ */
+occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが返した検索結果 */) {
+  query_budget_t * b = qr->budget;
+  if (b && b->truncated) {
+    occurrence_t o = { { 0, 0, 0, 0, 0, 0 }, -1 };
+    return o;
+  }
+  occurrence_t o = query_result_next_1(qr);
+  if (b && o.offset != -1) {
+    if (b->max_results && b->n_results >= b->max_results) {
+      b->truncated = 1;
+      occurrence_t e = { { 0, 0, 0, 0, 0, 0 }, -1 };
+      return e;
+    }
+    b->n_results++;
+  }
+  return o;
+}
+
+/**
+   @brief suffix arrayを使う検索結果 qr (qr->occurrences != 0)の,
+   occurrences[begin:end] の部分だけを返す検索結果
+   @sa query_result_next
+
+   @details 部分ごとに別のスレッドで query_result_next を呼べるように
+   するためのもの(部分は予算を持たない). 順に並べた部分の出現を
+   つなげると qr の出現と同じになる(重複は部分の境界をまたいでも
+   前の要素と比べて除く). 部分は query_result_destroy しない.
+   qr を破壊するまで使える.
+  */
+query_result_t query_result_part(query_result_t * qr, long begin, long end) {
+  assert(qr->occurrences);
+  assert(0 <= begin && begin <= end && end <= qr->n_occs);
+  query_result_t part = *qr;
+  part.next_occ = begin;
+  part.n_occs = end;
+  part.budget = 0;
+  if (part.buf && begin < end) {
+    /* 整列済みなら begin 番目の出現を含むドキュメントから辿る */
+    part.next_doc = document_array_find_doc_idx(qr->repo->da,
+                                                 qr->occurrences[begin]);
+  }
+  return part;
+}
+
+/**
+   @brief 検索結果(query_result_t)を破壊する. document_repo_query_sorted
+   が割り当てたメモリを開放する
+  */
+void query_result_destroy(query_result_t * qr) {
+  my_free(qr->buf);
+  qr->buf = 0;
+  qr->occurrences = 0;
+  qr->n_occs = 0;
+  qr->next_occ = 0;
+}
+
+/** @brief 基数ソートの1桁のビット数 */
+#define radix_sort_bits 8
+/** @brief 基数ソートの1桁の種類数 */
+#define radix_sort_n_buckets (1 << radix_sort_bits)
+/** @brief 基数ソートでスレッドひとつあたりが受け持つ最小の要素数 */
+static const long radix_sort_chunk = 1 << 16;
+/** @brief 基数ソートに使う最大のスレッド数 */
+static const long radix_sort_max_threads = 8;
+
+/**
+   @brief radix_sort_idx の全スレッドが共有するデータ
+  */
+typedef struct {
+  long n_threads;               /**< スレッド数 */
+  sa_idx_t * a;                 /**< 整列する配列 */
+  sa_idx_t * b;                 /**< aと同じ大きさの作業領域 */
+  long n;                       /**< 要素数 */
+  long (*cnt)[radix_sort_n_buckets]; /**< cnt[t][d] : スレッドtの担当部分で桁がdの要素数 */
+  pthread_barrier_t bar[1];     /**< 全スレッドの同期 */
+  pthread_mutex_t mu[1];        /**< started を守る */
+  pthread_cond_t cv[1];         /**< started が1になったことの通知 */
+  int started;                  /**< スレッドを作り終え n_threads が決まったら1 */
+} radix_sort_ctx_t;
+
+/**
+   @brief radix_sort_idx_thread の引数
+  */
+typedef struct {
+  long id;                      /**< スレッド番号 */
+  radix_sort_ctx_t * ctx;       /**< 共有データ */
+  sa_idx_t * result;            /**< 整列結果がある方(a または b) */
+} radix_sort_arg_t;
+
+/**
+   @brief LSD基数ソートの各スレッドが実行する関数
+
+   @details スレッドが作り終わるのを待ってから, 下の桁から順に,
+   (1) 担当部分(a[n*id/T:n*(id+1)/T])の各桁の頻度を数え,
+   (2) 全スレッドの頻度から担当部分の各桁の書き込み先を求め,
+   (3) 書き込む(安定). 全ての要素のその桁が等しければ(3)を省く.
+   各段階の間で全スレッドが同期する.
+ */
+static void * radix_sort_idx_thread(void * arg_) {
+  radix_sort_arg_t * arg = arg_;
+  radix_sort_ctx_t * ctx = arg->ctx;
+  pthread_mutex_lock(ctx->mu);
+  while (!ctx->started) pthread_cond_wait(ctx->cv, ctx->mu);
+  pthread_mutex_unlock(ctx->mu);
+  long id = arg->id;
+  long T = ctx->n_threads;
+  long n = ctx->n;
+  long (*cnt)[radix_sort_n_buckets] = ctx->cnt;
+  sa_idx_t * src = ctx->a;
+  sa_idx_t * dst = ctx->b;
+  long lo = n * id / T;
+  long hi = n * (id + 1) / T;
+  for (long shift = 0; shift < (long)(8 * sizeof(sa_idx_t)); shift += radix_sort_bits) {
+    long * c = cnt[id];
+    memset(c, 0, sizeof(long) * radix_sort_n_buckets);
+    for (long i = lo; i < hi; i++) {
+      c[(src[i] >> shift) & (radix_sort_n_buckets - 1)]++;
+    }
+    pthread_barrier_wait(ctx->bar);
+    /* 桁dの要素の, このスレッドの書き込み先 */
+    long pos[radix_sort_n_buckets];
+    long s = 0;
+    int skip = 0;
+    for (long d = 0; d < radix_sort_n_buckets; d++) {
+      long total = 0;
+      for (long t = 0; t < T; t++) {
+        if (t == id) pos[d] = s + total;
+        total += cnt[t][d];
+      }
+      if (total == n) skip = 1;
+      s += total;
+    }
+    if (!skip) {
+      for (long i = lo; i < hi; i++) {
+        dst[pos[(src[i] >> shift) & (radix_sort_n_buckets - 1)]++] = src[i];
+      }
+    }
+    /* 次の桁の頻度を数える前に全員がcntを読み終え, 書き込み終える */
+    pthread_barrier_wait(ctx->bar);
+    if (!skip) {
+      sa_idx_t * t = src;
+      src = dst;
+      dst = t;
+    }
+  }
+  arg->result = src;
+  return 0;
+}
+
+/**
+   @brief sa_idx_t の配列 a[0:n] を昇順に整列する(LSD基数ソート)
+   @return 整列結果がある方(a または b). 失敗(メモリ割り当て失敗)したら0
+
+   @details b は作業領域(aと同じ大きさ). 要素数が大きければ
+   複数のスレッドで並列に行う. スレッドが作れなければ作れた数で行う.
+ */
+static sa_idx_t * radix_sort_idx(sa_idx_t * a, sa_idx_t * b, long n) {
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long T = max_long(1, min_long(min_long(radix_sort_max_threads, n_cpus),
+                                n / radix_sort_chunk));
+  radix_sort_ctx_t ctx[1];
+  ctx->cnt = malloc_or_err(sizeof(long) * radix_sort_n_buckets * T);
+  radix_sort_arg_t * args = malloc_or_err(sizeof(radix_sort_arg_t) * T);
+  pthread_t * tids = malloc_or_err(sizeof(pthread_t) * T);
+  if (!ctx->cnt || !args || !tids) {
+    my_free(ctx->cnt);
+    my_free(args);
+    my_free(tids);
+    return 0;
+  }
+  ctx->a = a;
+  ctx->b = b;
+  ctx->n = n;
+  ctx->started = 0;
+  pthread_mutex_init(ctx->mu, 0);
+  pthread_cond_init(ctx->cv, 0);
+  long t;
+  for (t = 0; t < T; t++) {
+    radix_sort_arg_t arg = { t, ctx, 0 };
+    args[t] = arg;
+  }
+  /* スレッド0は自分で実行する */
+  for (t = 1; t < T; t++) {
+    if (pthread_create(&tids[t], 0, radix_sort_idx_thread, &args[t])) {
+      api_err("pthread_create");
+      break;
+    }
+  }
+  ctx->n_threads = t;
+  pthread_barrier_init(ctx->bar, 0, t);
+  pthread_mutex_lock(ctx->mu);
+  ctx->started = 1;
+  pthread_cond_broadcast(ctx->cv);
+  pthread_mutex_unlock(ctx->mu);
+  radix_sort_idx_thread(&args[0]);
+  for (long u = 1; u < t; u++) {
+    pthread_join(tids[u], 0);
+  }
+  sa_idx_t * r = args[0].result;
+  pthread_barrier_destroy(ctx->bar);
+  pthread_cond_destroy(ctx->cv);
+  pthread_mutex_destroy(ctx->mu);
+  my_free(ctx->cnt);
+  my_free(args);
+  my_free(tids);
+  return r;
+}
+
+/**
+   @brief document_repo_query と同じだが, 出現をドキュメント, 位置の
+   順に返す検索結果を作る
+   @return 成功したら0, 失敗(メモリ割り当て失敗)したら-1
+   @sa document_repo_query
+   @sa query_result_destroy
+
+   @details suffix arrayの範囲(辞書順)をコピーして(data中の)
+   オフセットで整列(radix_sort_idx)し, 重複と無効な要素を前から
+   ドキュメントを辿りながら除く. 全スキャンの場合は元々その順に
+   なっている. 使い終わったら query_result_destroy で開放する.
+  */
+int document_repo_query_sorted(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                               query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                               char * query,           /**< 検索文字列 */
+                               long query_len,         /**< queryの長さ(バイト数) */
+                               query_result_t * qr     /**< 結果を格納する場所 */
+                               ) {
+  *qr = document_repo_query(repo, qs, query, query_len);
+  if (!qr->occurrences) return 0;
+  long n = qr->n_occs;
+  sa_idx_t * a = malloc_or_err(sizeof(sa_idx_t) * max_long(n, 1));
+  sa_idx_t * b = malloc_or_err(sizeof(sa_idx_t) * max_long(n, 1));
+  if (!a || !b) {
+    my_free(a);
+    my_free(b);
+    return -1;
+  }
+  memcpy(a, qr->occurrences, sizeof(sa_idx_t) * n);
+  sa_idx_t * s = radix_sort_idx(a, b, n);
+  if (!s) {
+    my_free(a);
+    my_free(b);
+    return -1;
+  }
+  my_free(s == a ? b : a);
+  document_t * docs = repo->da->a;
+  query_filter_t * f = qr->filter;
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+  long m = 0;
+  long d = 0;
+  for (long i = 0; i < n; i++) {
+    long idx = s[i];
+    if (m > 0 && s[m - 1] == idx) continue;
+    if (idx < lo || hi <= idx) continue;
+    while (docs[d].data_o + docs[d].data_len <= idx) d++;
+    if (idx + query_len <= docs[d].data_o + docs[d].data_len
+        && query_filter_label(repo, f, docs[d])
+        && (!qr->verify || query_verify_at(repo, idx, query, query_len))) {
+      s[m++] = idx;
+    }
+  }
+  qr->occurrences = s;
+  qr->n_occs = m;
+  qr->next_occ = 0;
+  qr->next_doc = 0;
+  qr->buf = s;
+  return 0;
+}
+
+/** @brief 無作為抽出で, 抽出数の何倍(+定数)まで試して足りなければ全列挙に切り替えるか */
+static const long query_sample_max_tries_per_sample = 16;
+/** @brief 無作為抽出で, 範囲の大きさが抽出数の何倍以下なら初めから全列挙するか */
+static const long query_sample_enumerate_ratio = 4;
+
+/**
+   @brief 無作為抽出に使う乱数(xorshift64*)
+ */
+static uint64_t query_sample_rand(uint64_t * x) {
+  *x ^= *x >> 12;
+  *x ^= *x << 25;
+  *x ^= *x >> 27;
+  return *x * 2685821657736338717ULL;
+}
+
+/**
+   @brief sa_idx_t の比較
+ */
+static int sa_idx_cmp(const void * a_, const void * b_) {
+  sa_idx_t a = *(const sa_idx_t *)a_;
+  sa_idx_t b = *(const sa_idx_t *)b_;
+  return (a < b ? -1 : (a > b));
+}
+
+/**
+   @brief suffix arrayの要素 ptrs[j] ([begin, end) 内)が有効な出現か
+   (重複の2つ目以降でなく, ドキュメントの境界をまたがず, 検索の条件に合う)
+ */
+static int query_sample_valid(document_repo_t * repo, query_filter_t * f,
+                              long begin, long j, long query_len) {
+  sa_idx_t * ptrs = repo->sa->ptrs;
+  long idx = ptrs[j];
+  if (j > begin && ptrs[j - 1] == idx) return 0;
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+  if (idx < lo || hi <= idx) return 0;
+  document_t doc = document_array_find_doc(repo->da, idx);
+  return (idx + query_len <= doc.data_o + doc.data_len
+          && query_filter_label(repo, f, doc));
+}
+
+/**
+   @brief ドキュメントレポジトリから指定文字列(query)の出現を無作為に
+   k 個(出現がk個未満なら全て)選ぶ
+   @return 成功したら0, 失敗(メモリ割り当て失敗)したら-1
+   @sa document_repo_query_sorted
+
+   @details 選んだ出現を document_repo_query_sorted と同じくドキュメント,
+   位置の順に並べた検索結果を *qr に格納する(query_result_next で
+   取り出し, query_result_destroy で開放する). 各出現は等確率で,
+   重複なく選ばれる.
+
+   suffix arrayの範囲 [begin, end) は添字で引けるので, 一様な乱数で
+   添字を選び, 無効な要素(隙間を埋める重複の2つ目以降, ドキュメントの
+   境界をまたぐもの, 検索の条件に合わないもの)と既に選んだものは捨てて
+   引き直す. 有効な出現はそれぞれちょうど1つの添字を持つので一様になる.
+   手間は出現の総数によらず O(k log n). 範囲が k に比べて小さいか,
+   無効な要素が多く引き直しが続く場合は範囲の有効な要素を全て集めてから
+   選ぶ. suffix arrayを使わない設定では全出現を辿って選ぶ(reservoir sampling).
+  */
+int document_repo_query_sample(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                               query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                               char * query,           /**< 検索文字列 */
+                               long query_len,         /**< queryの長さ(バイト数) */
+                               long k,                 /**< 選ぶ出現の数 */
+                               query_result_t * qr     /**< 結果を格納する場所 */
+                               ) {
+  query_budget_t * b = (qs ? qs->budget : 0);
+  query_filter_t * f = (qs ? qs->filter : 0);
+  query_result_t r = {
+    repo, query, query_len,
+    0, 0, 0,                    /* occurrences, n_occs, next_occ */
+    0, 0,                       /* next_doc, next_pos */
+    0,                          /* buf */
+    b, 0, f                     /* budget, verify, filter */
+  };
+  *qr = r;
+  /* k はクライアントが決めるので, 割り当てや計算の前に出現の数の
+     上限(suffix arrayの範囲の大きさ, または全データの長さ)で抑える */
+  long begin = 0, end = 0;
+  if (repo->use_sa) {
+    document_repo_range(repo, qs, query, query_len, &begin, &end);
+    k = min_long(k, end - begin);
+  } else {
+    k = min_long(k, repo->data->n);
+  }
+  k = max_long(k, 0);
+  sa_idx_t * s = malloc_or_err(sizeof(sa_idx_t) * max_long(k, 1));
+  if (!s) return -1;
+  uint64_t x = (uint64_t)cur_time_us() * 0x9e3779b97f4a7c15ULL + (uint64_t)(uintptr_t)s;
+  if (x == 0) x = 1;
+  long m = 0;
+  if (!repo->use_sa) {
+    /* 全出現を辿り, seen 番目(0から)の出現を確率 k/(seen+1) で入れ替える.
+       結果の数の上限は選んだ後に効くので, ここでは見ない */
+    query_result_t all = document_repo_query(repo, qs, query, query_len);
+    long seen = 0;
+    while (k > 0) {
+      occurrence_t o = query_result_next_1(&all);
+      if (o.offset == -1) break;
+      long idx = o.doc.data_o + o.offset;
+      if (seen < k) {
+        s[m++] = idx;
+      } else {
+        uint64_t j = query_sample_rand(&x) % (uint64_t)(seen + 1);
+        if ((long)j < k) s[j] = idx;
+      }
+      seen++;
+    }
+  } else {
+    long w = end - begin;
+    int enumerate = (w <= query_sample_enumerate_ratio * k);
+    if (!enumerate && k > 0) {
+      /* 選んだ添字の集合(開番地法). 大きさは 2k 以上の2のべき */
+      long sz = 1;
+      while (sz < 2 * k) sz *= 2;
+      long * chosen = malloc_or_err(sizeof(long) * sz);
+      if (!chosen) {
+        my_free(s);
+        return -1;
+      }
+      for (long i = 0; i < sz; i++) chosen[i] = -1;
+      long max_tries = query_sample_max_tries_per_sample * k + 64;
+      for (long t = 0; m < k && t < max_tries; t++) {
+        if (query_budget_step(b, 1)) break;
+        long j = begin + (long)(query_sample_rand(&x) % (uint64_t)w);
+        if (!query_sample_valid(repo, f, begin, j, query_len)) continue;
+        long h = (long)((uint64_t)j * 0x9e3779b97f4a7c15ULL >> 16) & (sz - 1);
+        while (chosen[h] != -1 && chosen[h] != j) h = (h + 1) & (sz - 1);
+        if (chosen[h] == j) continue;
+        chosen[h] = j;
+        s[m++] = repo->sa->ptrs[j];
+      }
+      my_free(chosen);
+      /* 引き直しが続いた(有効な出現が少ない) */
+      if (m < k && !(b && b->truncated)) enumerate = 1;
+    }
+    if (enumerate) {
+      /* 範囲の有効な要素を全て集め, 先頭 k 個を無作為に選ぶ(Fisher-Yates) */
+      long * all = malloc_or_err(sizeof(long) * max_long(w, 1));
+      if (!all) {
+        my_free(s);
+        return -1;
+      }
+      long n = 0;
+      for (long j = begin; j < end; j++) {
+        if (query_budget_step(b, 1)) break;
+        if (query_sample_valid(repo, f, begin, j, query_len)) all[n++] = repo->sa->ptrs[j];
+      }
+      m = min_long(k, n);
+      for (long i = 0; i < m; i++) {
+        long j = i + (long)(query_sample_rand(&x) % (uint64_t)(n - i));
+        long t = all[i];
+        all[i] = all[j];
+        all[j] = t;
+        s[i] = all[i];
+      }
+      my_free(all);
+    }
+  }
+  qsort(s, m, sizeof(sa_idx_t), sa_idx_cmp);
+  qr->occurrences = s;
+  qr->n_occs = m;
+  qr->buf = s;
+  return 0;
+}
+
 /**
    @brief ドキュメントレポジトリから指定文字列(query)を検索しその出現回数
    (のみ)を返す
@@ -816,38 +2154,47 @@ occurrence_t query_result_next(query_result_t * qr /**< document_repo_queryが
    キュメントを参照
   */
 long document_repo_queryc(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                          query_session_t * qs,   /**< 検索のセッション(0でもよい) */
                           char * query,           /**< 検索文字列 */
                           long query_len        /**< queryの長さ(バイト数) */
                           ) {
   document_array_t * da = repo->da;
-  if (repo->use_sa) {
-    char * next_query = make_next_string(query, query_len);
-    long begin = document_repo_search(repo, query, query_len);
-    long   end = (next_query ?
-                  document_repo_search(repo, next_query, query_len) :
-                  repo->sa->sz);
-    my_free(next_query);
-    assert(begin <= end);
-    long n = end - begin;
-    sa_idx_t * occurrences = &repo->sa->ptrs[begin];
+  query_budget_t * b = (qs ? qs->budget : 0);
+  query_filter_t * f = (qs ? qs->filter : 0);
+  if (repo->use_sa && query_len > 0 && query_len <= 2 && !f) {
+    /* 2バイト以下ならバケット表を引くだけ */
+    return sa_bucket_queryc(repo->bt, query, query_len);
+  }
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+  query_plan_t plan = document_repo_plan(repo, qs, query, query_len);
+  if (plan.kind != query_plan_scan) {
+    int verify = (plan.kind == query_plan_sa_verify);
+    long n = plan.range_end - plan.range_begin;
+    sa_idx_t * occurrences = &repo->sa->ptrs[plan.range_begin];
     long c = 0;
     for (long i = 0; i < n; i++) {
+      if (query_budget_step(b, 1)) break;
       long idx = occurrences[i];
+      if (idx < lo || hi <= idx) continue;
+      if (verify && !query_verify_at(repo, idx, query, query_len)) continue;
       if (i == 0 || idx != occurrences[i - 1]) {
         document_t doc = document_array_find_doc(da, idx);
-        if (idx + query_len <= doc.data_o + doc.data_len) {
+        if (idx + query_len <= doc.data_o + doc.data_len
+            && query_filter_label(repo, f, doc)) {
           c++;
         }
       }
     }
     return c;
   } else {
-    long n_docs = da->n;
     document_t * a = da->a;
     /* 以下では文字列の終わりは0と仮定しているので不要 */
     long c = 0;
-    for (long i = 0; i < n_docs; i++) {
-      char * data = a[i].data;
+    for (long i = d0; i < d1; i++) {
+      if (!query_filter_label(repo, f, a[i])) continue;
+      if (query_budget_step(b, a[i].data_len + 1)) break;
+      char * data = repo->data->a + a[i].data_o;
       char * data_end = data + a[i].data_len;
       char * p = data;
       while (p) {
@@ -856,7 +2203,8 @@ long document_repo_queryc(document_repo_t * repo, /**< 検索対象のドキュ
         assert(data_end - p >= 0);
         char * q = memmem(p, data_end - p, query, query_len);
         if (q) {
-          c++;
+          if (document_repo_indexed_pos(repo->data->a, a[i].data_o,
+                                        q - repo->data->a)) c++;
           p = q + 1;
         } else {
           p = q;
@@ -867,6 +2215,904 @@ long document_repo_queryc(document_repo_t * repo, /**< 検索対象のドキュ
   }
 }
 
+/**
+   @brief doc_count_t の比較(出現回数の多い順, 同じならドキュメント番号順)
+ */
+static int doc_count_cmp_count(const void * a_, const void * b_) {
+  const doc_count_t * a = a_;
+  const doc_count_t * b = b_;
+  if (a->count != b->count) return (a->count < b->count ? 1 : -1);
+  return (a->doc < b->doc ? -1 : (a->doc > b->doc));
+}
+
+/**
+   @brief long の比較
+ */
+static int long_cmp(const void * a_, const void * b_) {
+  long a = *(const long *)a_;
+  long b = *(const long *)b_;
+  return (a < b ? -1 : (a > b));
+}
+
+/**
+   @brief ドキュメント番号の列 docs[0:m] (同じ番号が複数回現れうる)
+   から, ドキュメントごとの出現回数の配列を作る
+   @return 結果の要素数(ドキュメント番号順)
+
+   @details m がドキュメント数より小さければ docs を整列して数え,
+   そうでなければドキュメント数の大きさの配列で数える.
+ */
+static long doc_counts_of_docs(long * docs, long m, long n_docs,
+                               doc_count_t ** result) {
+  doc_count_t * r = 0;
+  long n = 0;
+  if (m < n_docs) {
+    qsort(docs, m, sizeof(long), long_cmp);
+    r = malloc_or_err(sizeof(doc_count_t) * max_long(m, 1));
+    if (!r) return -1;
+    for (long i = 0; i < m; i++) {
+      if (n > 0 && r[n - 1].doc == docs[i]) {
+        r[n - 1].count++;
+      } else {
+        doc_count_t dc = { docs[i], 1 };
+        r[n++] = dc;
+      }
+    }
+  } else {
+    long * cnt = calloc(n_docs, sizeof(long));
+    if (!cnt) {
+      api_err("calloc");
+      return -1;
+    }
+    long n_nz = 0;
+    for (long i = 0; i < m; i++) {
+      if (cnt[docs[i]]++ == 0) n_nz++;
+    }
+    r = malloc_or_err(sizeof(doc_count_t) * max_long(n_nz, 1));
+    if (!r) {
+      my_free(cnt);
+      return -1;
+    }
+    for (long d = 0; d < n_docs; d++) {
+      if (cnt[d]) {
+        doc_count_t dc = { d, cnt[d] };
+        r[n++] = dc;
+      }
+    }
+    assert(n == n_nz);
+    my_free(cnt);
+  }
+  *result = r;
+  return n;
+}
+
+/**
+   @brief ドキュメントレポジトリから指定文字列(query)を検索し, それが
+   出現するドキュメントとドキュメントごとの出現回数を返す
+   @return 出現するドキュメントの数(*resultの要素数). 失敗(メモリ割り当て失敗)したら-1
+   @sa document_repo_queryc
+
+   @details 出現位置(スニペット)は作らず, suffix arrayの範囲(または
+   全スキャン)から各出現を含むドキュメントを求めて数えるだけ.
+   結果は *result に割り当てられた配列に格納される(呼び出し側がmy_freeする).
+   top_n > 0 ならば出現回数の多い順に top_n 件まで,
+   top_n == 0 ならば全ドキュメントをドキュメント番号順に返す.
+  */
+long document_repo_queryd(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                          query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                          char * query,           /**< 検索文字列 */
+                          long query_len,         /**< queryの長さ(バイト数) */
+                          long top_n,             /**< 上位何件を返すか(0なら全て) */
+                          doc_count_t ** result   /**< 結果を格納する場所 */
+                          ) {
+  document_array_t * da = repo->da;
+  query_budget_t * b = (qs ? qs->budget : 0);
+  query_filter_t * f = (qs ? qs->filter : 0);
+  long n_docs = da->n;
+  doc_count_t * r = 0;
+  long n = 0;
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+  query_plan_t plan = document_repo_plan(repo, qs, query, query_len);
+  if (plan.kind != query_plan_scan) {
+    int verify = (plan.kind == query_plan_sa_verify);
+    long begin = plan.range_begin;
+    long end = plan.range_end;
+    /* 各出現を含むドキュメントの番号を集める */
+    sa_idx_t * occurrences = &repo->sa->ptrs[begin];
+    long * docs = malloc_or_err(sizeof(long) * max_long(end - begin, 1));
+    if (!docs) return -1;
+    long m = 0;
+    for (long i = 0; i < end - begin; i++) {
+      if (query_budget_step(b, 1)) break;
+      long idx = occurrences[i];
+      if (idx < lo || hi <= idx) continue;
+      if (verify && !query_verify_at(repo, idx, query, query_len)) continue;
+      if (i == 0 || idx != occurrences[i - 1]) {
+        long d = document_array_find_doc_idx(da, idx);
+        if (idx + query_len <= da->a[d].data_o + da->a[d].data_len
+            && query_filter_label(repo, f, da->a[d])) {
+          docs[m++] = d;
+        }
+      }
+    }
+    n = doc_counts_of_docs(docs, m, n_docs, &r);
+    my_free(docs);
+    if (n == -1) return -1;
+  } else {
+    r = malloc_or_err(sizeof(doc_count_t) * max_long(d1 - d0, 1));
+    if (!r) return -1;
+    document_t * a = da->a;
+    for (long i = d0; i < d1; i++) {
+      if (!query_filter_label(repo, f, a[i])) continue;
+      if (query_budget_step(b, a[i].data_len + 1)) break;
+      char * data = repo->data->a + a[i].data_o;
+      char * data_end = data + a[i].data_len;
+      long c = 0;
+      char * p = data;
+      while (p) {
+        char * q = memmem(p, data_end - p, query, query_len);
+        if (q) {
+          if (document_repo_indexed_pos(repo->data->a, a[i].data_o,
+                                        q - repo->data->a)) c++;
+          p = q + 1;
+        } else {
+          p = q;
+        }
+      }
+      if (c) {
+        doc_count_t dc = { i, c };
+        r[n++] = dc;
+      }
+    }
+  }
+  if (top_n > 0) {
+    qsort(r, n, sizeof(doc_count_t), doc_count_cmp_count);
+    if (n > top_n) n = top_n;
+  }
+  *result = r;
+  return n;
+}
+
+/**
+   @brief a の方が b より上位か(密度が高い. 同じならドキュメント番号が小さい)
+ */
+static int doc_score_better(const doc_score_t * a, const doc_score_t * b) {
+  if (a->score != b->score) return a->score > b->score;
+  return a->doc < b->doc;
+}
+
+/**
+   @brief doc_score_t の比較(上位が先)
+ */
+static int doc_score_cmp(const void * a_, const void * b_) {
+  const doc_score_t * a = a_;
+  const doc_score_t * b = b_;
+  if (doc_score_better(a, b)) return -1;
+  if (doc_score_better(b, a)) return 1;
+  return 0;
+}
+
+/**
+   @brief 上位 k 件を保つヒープ(最も下位のものが根)に x を入れる
+
+   @details ヒープが k 件未満なら加え, そうでなければ x が根より上位の
+   場合だけ根と入れ替える. *n はヒープの件数
+ */
+static void doc_score_heap_push(doc_score_t * h, long * n, long k, doc_score_t x) {
+  long i;
+  if (*n < k) {
+    /* 末尾に加えて上へ */
+    i = (*n)++;
+    while (i > 0) {
+      long p = (i - 1) / 2;
+      if (!doc_score_better(&h[p], &x)) break;
+      h[i] = h[p];
+      i = p;
+    }
+    h[i] = x;
+  } else if (k > 0 && doc_score_better(&x, &h[0])) {
+    /* 根を x で置き換えて下へ */
+    i = 0;
+    while (1) {
+      long c = 2 * i + 1;
+      if (c >= k) break;
+      if (c + 1 < k && doc_score_better(&h[c], &h[c + 1])) c++;
+      if (!doc_score_better(&x, &h[c])) break;
+      h[i] = h[c];
+      i = c;
+    }
+    h[i] = x;
+  }
+}
+
+/**
+   @brief ドキュメントレポジトリから指定文字列(query)を検索し, 出現の密度
+   (出現回数 / ドキュメント長)の高い順に上位 top_k 件のドキュメントを返す
+   @return 返すドキュメントの数(*resultの要素数). 失敗(メモリ割り当て失敗)したら-1
+   @sa document_repo_queryd
+
+   @details suffix arrayの範囲を辿る場合は, ドキュメント番号をキーと
+   するハッシュ表(開番地法. 大きさは出現数とドキュメント数の小さい方の
+   2倍程度)にドキュメントごとの出現回数と最初の出現位置を数え, それを
+   大きさ top_k のヒープに通して上位を残す. スキャンする場合はドキュメ
+   ントを1つ数え終えるごとにヒープに通す. いずれも全出現を整列したり
+   返したりはしない. 結果は上位から順に *result に割り当てられた配列に
+   格納される(呼び出し側がmy_freeする).
+  */
+long document_repo_queryr(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                          query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                          char * query,           /**< 検索文字列 */
+                          long query_len,         /**< queryの長さ(バイト数) */
+                          long top_k,             /**< 上位何件を返すか */
+                          doc_score_t ** result   /**< 結果を格納する場所 */
+                          ) {
+  document_array_t * da = repo->da;
+  document_t * a = da->a;
+  query_budget_t * b = (qs ? qs->budget : 0);
+  query_filter_t * f = (qs ? qs->filter : 0);
+  top_k = max_long(top_k, 0);
+  long d0, d1, lo, hi;
+  query_filter_slice(repo, f, &d0, &d1, &lo, &hi);
+  doc_score_t * h = malloc_or_err(sizeof(doc_score_t) * max_long(min_long(top_k, d1 - d0), 1));
+  if (!h) return -1;
+  long k = min_long(top_k, d1 - d0);
+  long n = 0;
+  query_plan_t plan = document_repo_plan(repo, qs, query, query_len);
+  if (plan.kind != query_plan_scan) {
+    int verify = (plan.kind == query_plan_sa_verify);
+    long w = plan.range_end - plan.range_begin;
+    sa_idx_t * occurrences = &repo->sa->ptrs[plan.range_begin];
+    /* ドキュメント番号 -> (出現回数, 最初の出現) のハッシュ表 */
+    long sz = 16;
+    while (sz < 2 * min_long(w, d1 - d0)) sz *= 2;
+    doc_score_t * t = malloc_or_err(sizeof(doc_score_t) * sz);
+    if (!t) {
+      my_free(h);
+      return -1;
+    }
+    for (long j = 0; j < sz; j++) t[j].doc = -1;
+    for (long i = 0; i < w; i++) {
+      if (query_budget_step(b, 1)) break;
+      long idx = occurrences[i];
+      if (idx < lo || hi <= idx) continue;
+      if (verify && !query_verify_at(repo, idx, query, query_len)) continue;
+      if (i > 0 && idx == occurrences[i - 1]) continue;
+      long d = document_array_find_doc_idx(da, idx);
+      if (idx + query_len > a[d].data_o + a[d].data_len
+          || !query_filter_label(repo, f, a[d])) continue;
+      long j = (long)((uint64_t)d * 0x9e3779b97f4a7c15ULL >> 20) & (sz - 1);
+      while (t[j].doc != -1 && t[j].doc != d) j = (j + 1) & (sz - 1);
+      if (t[j].doc == -1) {
+        doc_score_t x = { d, 0, idx, 0.0 };
+        t[j] = x;
+      }
+      t[j].count++;
+      if (idx < t[j].offset) t[j].offset = idx;
+    }
+    for (long j = 0; j < sz; j++) {
+      if (t[j].doc == -1) continue;
+      doc_score_t x = t[j];
+      document_t doc = a[x.doc];
+      x.offset -= doc.data_o;
+      x.score = (double)x.count / max_long(doc.data_len, 1);
+      doc_score_heap_push(h, &n, k, x);
+    }
+    my_free(t);
+  } else {
+    for (long i = d0; i < d1; i++) {
+      if (!query_filter_label(repo, f, a[i])) continue;
+      if (query_budget_step(b, a[i].data_len + 1)) break;
+      char * data = repo->data->a + a[i].data_o;
+      char * data_end = data + a[i].data_len;
+      long c = 0;
+      long first = -1;
+      char * p = data;
+      while (p) {
+        char * q = memmem(p, data_end - p, query, query_len);
+        if (q) {
+          if (document_repo_indexed_pos(repo->data->a, a[i].data_o,
+                                        q - repo->data->a)) {
+            if (c++ == 0) first = q - data;
+          }
+          p = q + 1;
+        } else {
+          p = q;
+        }
+      }
+      if (c) {
+        doc_score_t x = { i, c, first, (double)c / max_long(a[i].data_len, 1) };
+        doc_score_heap_push(h, &n, k, x);
+      }
+    }
+  }
+  qsort(h, n, sizeof(doc_score_t), doc_score_cmp);
+  *result = h;
+  return n;
+}
+
+/** @brief document_repo_dups が覚えるドキュメントの組の数の上限 */
+static const long dups_max_pairs = 1 << 18;
+/** @brief document_repo_dups で, これより多くのドキュメントに現れる繰り返しは
+    (定型文とみなし)組を作らない */
+static const long dups_max_group_docs = 64;
+
+/**
+   @brief ドキュメントの組 -> 共有する繰り返しの数 のハッシュ表(開番地法)
+  */
+typedef struct {
+  dup_pair_t * t;               /**< 要素(空きは doc0 == -1) */
+  long sz;                      /**< tの大きさ(2のべき) */
+  long n;                       /**< 要素数 */
+  int full;                     /**< 要素数が dups_max_pairs に達して組を捨てたら1 */
+} dup_pair_table_t;
+
+/**
+   @brief 大きさ sz の空の表を作る
+   @return 1 (成功) または 0 (失敗)
+  */
+static int dup_pair_table_alloc(dup_pair_table_t * pt, long sz) {
+  dup_pair_t * t = malloc_or_err(sizeof(dup_pair_t) * sz);
+  if (!t) return 0;
+  for (long j = 0; j < sz; j++) t[j].doc0 = -1;
+  pt->t = t;
+  pt->sz = sz;
+  return 1;
+}
+
+/**
+   @brief 組 (doc0, doc1) の要素の場所
+  */
+static dup_pair_t * dup_pair_table_slot(dup_pair_t * t, long sz, long doc0, long doc1) {
+  uint64_t h = (uint64_t)doc0 * 0x9e3779b97f4a7c15ULL ^ (uint64_t)doc1 * 0xc2b2ae3d27d4eb4fULL;
+  long j = (long)(h >> 20) & (sz - 1);
+  while (t[j].doc0 != -1 && (t[j].doc0 != doc0 || t[j].doc1 != doc1)) j = (j + 1) & (sz - 1);
+  return &t[j];
+}
+
+/**
+   @brief 組 (doc0, doc1) (doc0 < doc1) が繰り返しを1つ共有することを数える
+   @return 1 (成功) または 0 (失敗)
+
+   @details 初めての組なら offset (doc0中の位置)をその例として覚える.
+   要素数が大きさの半分に達したら2倍の大きさで作り直す.
+   dups_max_pairs に達したら新しい組は捨てる.
+  */
+static int dup_pair_table_add(dup_pair_table_t * pt, long doc0, long doc1, long offset) {
+  dup_pair_t * e = dup_pair_table_slot(pt->t, pt->sz, doc0, doc1);
+  if (e->doc0 == -1) {
+    if (pt->n >= dups_max_pairs) {
+      pt->full = 1;
+      return 1;
+    }
+    if (2 * (pt->n + 1) > pt->sz) {
+      dup_pair_table_t nt[1] = { { 0, 0, pt->n, pt->full } };
+      if (!dup_pair_table_alloc(nt, pt->sz * 2)) return 0;
+      for (long j = 0; j < pt->sz; j++) {
+        if (pt->t[j].doc0 == -1) continue;
+        *dup_pair_table_slot(nt->t, nt->sz, pt->t[j].doc0, pt->t[j].doc1) = pt->t[j];
+      }
+      my_free(pt->t);
+      *pt = *nt;
+      e = dup_pair_table_slot(pt->t, pt->sz, doc0, doc1);
+    }
+    dup_pair_t x = { doc0, doc1, 0, offset };
+    *e = x;
+    pt->n++;
+  }
+  e->count++;
+  return 1;
+}
+
+/**
+   @brief dup_pair_t の比較(共有する繰り返しの多い順. 同じならドキュメント番号の順)
+ */
+static int dup_pair_cmp(const void * a_, const void * b_) {
+  const dup_pair_t * a = a_;
+  const dup_pair_t * b = b_;
+  if (a->count != b->count) return (a->count > b->count ? -1 : 1);
+  if (a->doc0 != b->doc0) return (a->doc0 < b->doc0 ? -1 : 1);
+  if (a->doc1 != b->doc1) return (a->doc1 < b->doc1 ? -1 : 1);
+  return 0;
+}
+
+/**
+   @brief min_len バイト以上の共通部分(繰り返し)を持つドキュメントの組を求める
+   @return 組の数(*resultの要素数). 失敗(メモリ割り当て失敗, suffix arrayが無い)したら-1
+
+   @details suffix arrayを先頭から1度だけ辿る. 隣り合うsuffixの先頭
+   min_len バイトが等しい間(最長共通接頭辞(LCP)が min_len 以上の間)を
+   1つの繰り返しとし, それが現れるドキュメントの全ての組に1を数える.
+   LCPは min_len バイトまでしか比べないので, 辿る手間はおよそ
+   suffixの数 * min_len で済み, LCP配列も要らない. 繰り返しの数は
+   共有する(索引された)位置の数なので, 長い共通部分ほど多く数えられる.
+   ドキュメントの終わりを越える部分は繰り返しとしない.
+
+   メモリはドキュメント数の配列と, dups_max_pairs 個までの組の
+   ハッシュ表だけを使う. dups_max_group_docs 個より多くのドキュメントに
+   現れる繰り返しは定型文とみなして組を作らない. 組が dups_max_pairs
+   個に達した, または予算(b)で打ち切った場合は b->truncated を1にする.
+   結果は共有する繰り返しの多い順に *result に割り当てられた配列に
+   格納される(呼び出し側がmy_freeする).
+  */
+long document_repo_dups(document_repo_t * repo, /**< ドキュメントレポジトリ */
+                        long min_len,           /**< 繰り返しの最小の長さ(バイト数) */
+                        query_budget_t * b,     /**< 予算(0でもよい) */
+                        dup_pair_t ** result    /**< 結果を格納する場所 */
+                        ) {
+  if (!repo->use_sa || min_len < 1) return -1;
+  document_array_t * da = repo->da;
+  char * text = repo->data->a;
+  sa_idx_t * ptrs = repo->sa->ptrs;
+  long sz = repo->sa->sz;
+  /* stamp[d] : ドキュメント d が現れた最後の繰り返しの番号 */
+  long * stamp = malloc_or_err(sizeof(long) * max_long(da->n, 1));
+  long * gdoc = malloc_or_err(sizeof(long) * dups_max_group_docs);
+  long * gidx = malloc_or_err(sizeof(long) * dups_max_group_docs);
+  dup_pair_table_t pt[1] = { { 0, 0, 0, 0 } };
+  int ok = (stamp && gdoc && gidx && dup_pair_table_alloc(pt, 1024));
+  for (long d = 0; ok && d < da->n; d++) stamp[d] = -1;
+  long group = 0;               /* 今の繰り返しの番号 */
+  long rep = -1;                /* 今の繰り返しの最初のsuffix */
+  long m = 0;                   /* 今の繰り返しが現れるドキュメント数 */
+  for (long i = 0; ok && i <= sz; i++) {
+    long idx = -1;
+    long d = -1;
+    if (i < sz) {
+      if (query_budget_step(b, 1)) break;
+      idx = ptrs[i];
+      if (i > 0 && idx == ptrs[i - 1]) continue;
+      d = document_array_find_doc_idx(da, idx);
+      /* ドキュメントの終わりまで min_len バイト無いsuffixは飛ばす */
+      if (idx + min_len > da->a[d].data_o + da->a[d].data_len) continue;
+      if (rep != -1 && memcmp(text + rep, text + idx, min_len) == 0) {
+        /* 今の繰り返しに加える */
+        if (stamp[d] != group) {
+          stamp[d] = group;
+          if (m < dups_max_group_docs) {
+            gdoc[m] = d;
+            gidx[m] = idx;
+          }
+          m++;
+        }
+        continue;
+      }
+    }
+    /* 今の繰り返しを終え, そのドキュメントの組を数える */
+    if (2 <= m && m <= dups_max_group_docs) {
+      for (long x = 0; ok && x < m; x++) {
+        for (long y = 0; ok && y < m; y++) {
+          if (gdoc[x] < gdoc[y]) {
+            ok = dup_pair_table_add(pt, gdoc[x], gdoc[y],
+                                    gidx[x] - da->a[gdoc[x]].data_o);
+          }
+        }
+      }
+    }
+    /* idx から新しい繰り返しを始める */
+    group++;
+    rep = idx;
+    m = 0;
+    if (d != -1) {
+      stamp[d] = group;
+      gdoc[m] = d;
+      gidx[m] = idx;
+      m++;
+    }
+  }
+  my_free(stamp);
+  my_free(gdoc);
+  my_free(gidx);
+  if (!ok) {
+    my_free(pt->t);
+    return -1;
+  }
+  /* 要素を前に詰めて整列する */
+  long n = 0;
+  for (long j = 0; j < pt->sz; j++) {
+    if (pt->t[j].doc0 != -1) pt->t[n++] = pt->t[j];
+  }
+  qsort(pt->t, n, sizeof(dup_pair_t), dup_pair_cmp);
+  if (pt->full && b) b->truncated = 1;
+  *result = pt->t;
+  return n;
+}
+
+/**
+   @brief ラベルで検索する
+   @return 条件に合うラベルを持つドキュメントの数(*resultの要素数).
+   失敗(メモリ割り当て失敗)したら-1
+   @sa label_match_t
+
+   @details ラベルのsuffix arrayで query から始まるsuffixの範囲を求め,
+   その各要素を含むラベルのうち条件に合うもののドキュメント番号を
+   番号順に *result に格納する(呼び出し側がmy_freeする).
+   prefix, exact はsuffixがラベルの先頭である要素だけを見る.
+  */
+long document_repo_query_label(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                               char * query,           /**< 検索文字列 */
+                               long query_len,         /**< queryの長さ(バイト数) */
+                               label_match_t match,    /**< 一致の条件 */
+                               long ** result          /**< 結果を格納する場所 */
+                               ) {
+  document_array_t * da = repo->da;
+  suffix_array_t * sa = repo->lsa;
+  long begin = 0, end = 0;
+  if (query_len == 0) {
+    /* 空文字列は全てのラベルの先頭に現れる. 以下で全ドキュメントを見る */
+  } else if (sa->sz > 0) {
+    char * chars = repo->labels->a;
+    char * next_query = make_next_string(query, query_len);
+    begin = suffix_array_lower_bound(sa, chars, da, document_array_label_len,
+                                     0, sa->sz, query, query_len);
+    end = (next_query ?
+           suffix_array_lower_bound(sa, chars, da, document_array_label_len,
+                                    begin, sa->sz, next_query, query_len) :
+           sa->sz);
+    my_free(next_query);
+  }
+  assert(begin <= end);
+  long m = (query_len == 0 ? da->n : end - begin);
+  long * docs = malloc_or_err(sizeof(long) * max_long(m, 1));
+  if (!docs) return -1;
+  long n = 0;
+  if (query_len == 0) {
+    for (long d = 0; d < da->n; d++) {
+      if (match != label_match_exact || da->a[d].label_len == 0) {
+        docs[n++] = d;
+      }
+    }
+  } else {
+    sa_idx_t * occurrences = &sa->ptrs[begin];
+    for (long i = 0; i < m; i++) {
+      long idx = occurrences[i];
+      if (i == 0 || idx != occurrences[i - 1]) {
+        long d = document_array_find_label_doc(da, idx);
+        document_t doc = da->a[d];
+        if (match == label_match_substr
+            || (idx == doc.label_o
+                && (match == label_match_prefix || doc.label_len == query_len))) {
+          docs[n++] = d;
+        }
+      }
+    }
+    /* ドキュメント番号順にし, 重複を除く */
+    qsort(docs, n, sizeof(long), long_cmp);
+    long u = 0;
+    for (long i = 0; i < n; i++) {
+      if (u == 0 || docs[u - 1] != docs[i]) docs[u++] = docs[i];
+    }
+    n = u;
+  }
+  *result = docs;
+  return n;
+}
+
+/** @brief complete で検索文字列に続けて取り出す単語の最大長(バイト数) */
+static const long complete_max_len = 64;
+/** @brief complete で調べる候補(続きの単語)の最大数 */
+static const long complete_max_groups = 4096;
+/** @brief complete で出現回数を正確に数える範囲の最大の大きさ */
+static const long complete_exact_sz = 1024;
+
+/**
+   @brief completion_t の比較(出現回数の多い順, 同じならオフセット順)
+ */
+static int completion_cmp_count(const void * a_, const void * b_) {
+  const completion_t * a = a_;
+  const completion_t * b = b_;
+  if (a->count != b->count) return (a->count < b->count ? 1 : -1);
+  return (a->o < b->o ? -1 : (a->o > b->o));
+}
+
+/**
+   @brief suffix arrayの ptrs[p] と同じ値が続く範囲 ptrs[*s:*e] を求める
+   (ただし ptrs[a:b] の中で)
+
+   @details 空きを埋める重複は長く続きうるので, 歩幅を倍々にして
+   探してから2分探索する.
+ */
+static void suffix_array_run(suffix_array_t * sa, long a, long b, long p,
+                             long * s, long * e) {
+  sa_idx_t * ptrs = sa->ptrs;
+  sa_idx_t x = ptrs[p];
+  for (int dir = -1; dir <= 1; dir += 2) {
+    long in = p;                /* ptrs[in] == x */
+    long step = 1;
+    while (a <= in + dir * step && in + dir * step < b
+           && ptrs[in + dir * step] == x) {
+      in += dir * step;
+      step *= 2;
+    }
+    /* out は範囲外か ptrs[out] != x */
+    long out = (dir > 0 ? min_long(in + step, b) : max_long(in - step, a - 1));
+    while (labs(out - in) > 1) {
+      long c = (in + out) / 2;
+      if (ptrs[c] == x) {
+        in = c;
+      } else {
+        out = c;
+      }
+    }
+    if (dir < 0) {
+      *s = in;
+    } else {
+      *e = out;
+    }
+  }
+}
+
+/**
+   @brief suffix arrayの範囲 ptrs[a:b] にある(重複を除いた)要素数を返す
+
+   @details 重複の並びを飛ばしながら先頭から complete_exact_sz 個まで
+   数える. 残りがあれば, 残りから complete_exact_sz 箇所を等間隔に選び,
+   各箇所を含む重複の並びの長さの逆数の和から推定する.
+ */
+static long suffix_array_count_distinct(suffix_array_t * sa, long a, long b) {
+  long c = 0;
+  long p = a;
+  while (p < b && c < complete_exact_sz) {
+    long s, e;
+    suffix_array_run(sa, p, b, p, &s, &e);
+    p = e;
+    c++;
+  }
+  if (p < b) {
+    long m = complete_exact_sz;
+    double s = 0.0;
+    for (long k = 0; k < m; k++) {
+      long q = p + (b - p) * k / m;
+      long rs, re;
+      suffix_array_run(sa, p, b, q, &rs, &re);
+      s += 1.0 / (re - rs);
+    }
+    c += (long)(s * (b - p) / m + 0.5);
+  }
+  return c;
+}
+
+/**
+   @brief suffix arrayの範囲 ptrs[begin:end] (prefix から始まるsuffix)
+   を単語ごとにまとめて r に格納する
+   @return 候補の数. stride == 1 で候補が complete_max_groups 個より
+   多ければ途中でやめて-1
+
+   @details 要素 i から単語 W (次の空白, 制御文字またはドキュメントの
+   終わりまで. ただし prefix の後ろ高々 complete_max_len バイト)を
+   取り出し, W から始まり W の後ろが空白などであるsuffixの範囲を
+   2分探索で求めて, 一度に飛ばす. 次に調べる要素は少なくとも
+   stride 先に進めるので, 調べる候補は高々
+   (end - begin) / stride 個.
+ */
+static long document_repo_complete_walk(document_repo_t * repo, long prefix_len,
+                                        long begin, long end, long stride,
+                                        completion_t * r, char * w) {
+  suffix_array_t * sa = repo->sa;
+  document_array_t * da = repo->da;
+  char * chars = repo->data->a;
+  long n = 0;
+  long lo = begin;              /* ptrs[begin:lo] は調べ終わった */
+  long i = begin;               /* 次に調べる要素 */
+  while (i < end) {
+    long idx = sa->ptrs[i];
+    long len = document_array_data_len(da, idx);
+    if (len < prefix_len) {
+      /* prefix を含まない(ドキュメントの終わりを越える) */
+      lo = i = i + 1;
+      continue;
+    }
+    if (n == complete_max_groups) {
+      assert(stride == 1);
+      return -1;
+    }
+    /* 単語 W = chars[idx:idx+wlen] を取り出す */
+    long wlen = prefix_len;
+    long max_wlen = min_long(len, prefix_len + complete_max_len);
+    while (wlen < max_wlen && (unsigned char)chars[idx + wlen] > ' ') wlen++;
+    memcpy(w, &chars[idx], wlen);
+    /* W から始まる最初の要素 */
+    long a = suffix_array_lower_bound(sa, chars, da, document_array_data_len,
+                                      lo, i, w, wlen);
+    /* W から始まり, その後ろが空白などである最後の要素の次 */
+    long b = end;
+    if (wlen < len && (unsigned char)chars[idx + wlen] > ' ') {
+      /* 長さ制限で切った. W から始まるもの全てとし,
+         W から始まらない最初の文字列を作る */
+      long k = wlen;
+      while (k > prefix_len && (unsigned char)w[k - 1] == 0xff) k--;
+      if (k > prefix_len) {
+        w[k - 1]++;
+        b = suffix_array_lower_bound(sa, chars, da, document_array_data_len,
+                                     i + 1, end, w, k);
+      }
+    } else {
+      /* W + '!' は W + 空白などより大きく, W + 空白以外以下 */
+      w[wlen] = ' ' + 1;
+      b = suffix_array_lower_bound(sa, chars, da, document_array_data_len,
+                                   i + 1, end, w, wlen + 1);
+    }
+    assert(a <= i);
+    assert(i < b);
+    completion_t c = { idx, wlen, suffix_array_count_distinct(sa, a, b) };
+    r[n++] = c;
+    lo = b;
+    i = max_long(b, i + stride);
+  }
+  return n;
+}
+
+/**
+   @brief 検索文字列(prefix)に続く単語の候補を出現回数の多い順に返す(入力補完)
+   @return 候補の数(*resultの要素数). 失敗(メモリ割り当て失敗)したら-1
+   @sa completion_t
+
+   @details prefix から始まるsuffixはsuffix arrayの連続した範囲に
+   辞書順に並んでいるので, 同じ単語になるものもその中で連続している.
+   そこで範囲を単語ごとにまとめて数える(document_repo_complete_walk).
+   候補ごとの手間は2分探索2回と高々 complete_exact_sz 回程度の数え上げで,
+   調べる候補は範囲がいくら大きくても高々 complete_max_groups 個である.
+   候補がそれより多ければ, 範囲の大きさ / complete_max_groups 要素
+   おきに調べ直す. このとき小さい候補は飛ばされうるが, その2倍以上の
+   要素を占める候補は必ず見つかる. また出現の多い候補の出現回数は
+   推定値である(suffix_array_count_distinct).
+   結果は *result に割り当てられた配列に格納される(呼び出し側がmy_freeする).
+   各候補の単語は data[o:o+len] で, prefix を含む.
+   suffix arrayを使っていなければ候補は無しとする.
+  */
+long document_repo_complete(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                            query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                            char * prefix,          /**< 検索文字列 */
+                            long prefix_len,        /**< prefixの長さ(バイト数) */
+                            long top_n,             /**< 上位何件を返すか(0なら全て) */
+                            completion_t ** result  /**< 結果を格納する場所 */
+                            ) {
+  long begin = 0, end = 0;
+  if (repo->use_sa) {
+    document_repo_range(repo, qs, prefix, prefix_len, &begin, &end);
+  }
+  completion_t * r = malloc_or_err(sizeof(completion_t) * complete_max_groups);
+  if (!r) return -1;
+  char * w = malloc_or_err(prefix_len + complete_max_len + 1);
+  if (!w) {
+    my_free(r);
+    return -1;
+  }
+  long n = document_repo_complete_walk(repo, prefix_len, begin, end, 1, r, w);
+  if (n == -1) {
+    long stride = (end - begin + complete_max_groups - 1) / complete_max_groups;
+    n = document_repo_complete_walk(repo, prefix_len, begin, end, stride, r, w);
+  }
+  assert(0 <= n);
+  assert(n <= complete_max_groups);
+  my_free(w);
+  qsort(r, n, sizeof(completion_t), completion_cmp_count);
+  if (top_n > 0 && n > top_n) n = top_n;
+  *result = r;
+  return n;
+}
+
+/**
+   @brief 検索文字列(query)の全ての出現位置を(data中の)オフセットの昇順で返す
+   @return 出現回数(*resultの要素数). 失敗(メモリ割り当て失敗)したら-1
+
+   @details 結果は *result に割り当てられた配列に格納される(呼び出し側がmy_freeする).
+   qs に予算があれば期限と取り消しだけを見る(結果数の上限は
+   呼び出し側が最終結果に対して適用する). 打ち切られたら
+   qs->budget->truncated が立ち, それまでに見つかった分を返す.
+  */
+static long document_repo_query_offsets(document_repo_t * repo,
+                                        query_session_t * qs,
+                                        char * query, long query_len,
+                                        long ** result) {
+  query_budget_t * b = (qs ? qs->budget : 0);
+  query_budget_t tb[1];
+  if (b) {
+    *tb = *b;
+    tb->max_results = 0;
+    qs->budget = tb;
+  }
+  long c = document_repo_queryc(repo, qs, query, query_len);
+  long * r = malloc_or_err(sizeof(long) * max_long(c, 1));
+  query_result_t qr[1];
+  long n = -1;
+  if (r && document_repo_query_sorted(repo, qs, query, query_len, qr) == 0) {
+    n = 0;
+    while (1) {
+      occurrence_t o = query_result_next(qr);
+      if (o.offset == -1) break;
+      assert(n < c);
+      r[n++] = o.doc.data_o + o.offset;
+    }
+    assert(n == c || (b && tb->truncated));
+    query_result_destroy(qr);
+  }
+  if (b) {
+    qs->budget = b;
+    b->n_steps = tb->n_steps;
+    b->truncated = tb->truncated;
+  }
+  if (n == -1) {
+    my_free(r);
+    return -1;
+  }
+  *result = r;
+  return n;
+}
+
+/**
+   @brief 2つの検索文字列(query0, query1)が近く(window バイト以内)に
+   出現する範囲を返す
+   @return 範囲の数(*resultの要素数). 失敗(メモリ割り当て失敗)したら-1
+   @sa text_span_t
+
+   @details 同じドキュメント中で, query0 の出現位置 a と query1 の出現
+   位置 b が |a - b| <= window であれば, 両方の出現を含む範囲を作る.
+   重なる範囲はまとめる. 両方の出現位置を(data中の)オフセットの昇順に
+   並べ(document_repo_query_sorted), query0 の出現ごとに, 条件を満たす query1 の出現の範囲を
+   2つの添字を進めて求める(全体で線形時間).
+   結果はドキュメント, 位置の順に *result に割り当てられた配列に
+   格納される(呼び出し側がmy_freeする).
+  */
+long document_repo_query_near(document_repo_t * repo, /**< 検索対象のドキュメントレポジトリ */
+                              query_session_t * qs,   /**< 検索のセッション(0でもよい) */
+                              char * query0,          /**< 検索文字列 */
+                              long query0_len,        /**< query0の長さ(バイト数) */
+                              char * query1,          /**< 検索文字列 */
+                              long query1_len,        /**< query1の長さ(バイト数) */
+                              long window,            /**< 出現位置の差の上限(バイト数) */
+                              text_span_t ** result   /**< 結果を格納する場所 */
+                              ) {
+  document_array_t * da = repo->da;
+  long * xs = 0;
+  long * ys = 0;
+  long nx = document_repo_query_offsets(repo, qs, query0, query0_len, &xs);
+  if (nx == -1) return -1;
+  long ny = document_repo_query_offsets(repo, qs, query1, query1_len, &ys);
+  if (ny == -1) {
+    my_free(xs);
+    return -1;
+  }
+  text_span_t * r = malloc_or_err(sizeof(text_span_t) * max_long(nx, 1));
+  if (!r) {
+    my_free(xs);
+    my_free(ys);
+    return -1;
+  }
+  long n = 0;
+  long span_end = -1;           /* 最後の範囲の終わり(data中のオフセット) */
+  long lo = 0;                  /* ys[lo] は a - window 以上で最初のもの */
+  long hi = 0;                  /* ys[hi] は a + window より大きい最初のもの */
+  for (long i = 0; i < nx; i++) {
+    long a = xs[i];
+    long d = document_array_find_doc_idx(da, a);
+    long doc_begin = da->a[d].data_o;
+    long doc_end = doc_begin + da->a[d].data_len;
+    long from = max_long(a - window, doc_begin);
+    long to = min_long(a + window, doc_end - 1);
+    while (lo < ny && ys[lo] < from) lo++;
+    if (hi < lo) hi = lo;
+    while (hi < ny && ys[hi] <= to) hi++;
+    if (lo == hi) continue;
+    /* ys[lo:hi] が a の近くにある */
+    long b = min_long(a, ys[lo]);
+    long e = max_long(a + query0_len, ys[hi - 1] + query1_len);
+    if (n > 0 && r[n - 1].doc == d && b <= span_end) {
+      /* 直前の範囲と重なる */
+      span_end = max_long(span_end, e);
+      r[n - 1].len = span_end - (doc_begin + r[n - 1].offset);
+    } else {
+      text_span_t sp = { d, b - doc_begin, e - b };
+      r[n++] = sp;
+      span_end = e;
+    }
+  }
+  my_free(xs);
+  my_free(ys);
+  *result = r;
+  return n;
+}
+
 /**
    @brief 全ドキュメントのダンプを表すデータ構造
 
@@ -912,6 +3158,20 @@ long document_repo_n_docs(document_repo_t * repo) {
   return n;
 }
 
+/**
+   @brief ドキュメント番号(putが返した番号)からドキュメントを得る
+   @return ドキュメント. 番号が範囲外ならラベルのオフセットが-1のドキュメント
+  */
+document_t document_repo_get_doc(document_repo_t * repo, long doc) {
+  document_array_t * da = repo->da;
+  if (0 <= doc && doc < da->n) {
+    return da->a[doc];
+  } else {
+    document_t d = { 0, -1, -1, 0, -1, -1 };
+    return d;
+  }
+}
+
 /**
    @brief document_repo_dump が返した dump_result_t から,
    次のドキュメントを返す.
@@ -931,6 +3191,65 @@ document_t dump_result_next(dump_result_t * dr) {
   }
 }
 
+/**
+   @brief suffix arrayの各要素の先頭8バイト(keys)を持つかどうかを設定
+   @return 成功したら1, 失敗(メモリ割り当て失敗)したら0.
+
+   @details 持つ場合, 検索時の比較の大半がtextを参照せずに済む代わりに,
+   suffix arrayの1要素あたり8バイト余分にメモリを使う.
+   途中で切り替えた場合は現在のsuffix arrayから作り直す.
+ */
+int document_repo_set_use_keys(document_repo_t * repo, int use_keys) {
+  suffix_array_t * sa = repo->sa;
+  if (!use_keys) {
+    my_free(sa->keys);
+    sa->keys = 0;
+    return 1;
+  } else if (sa->keys) {
+    return 1;
+  } else {
+    long sz = sa->sz;
+    /* 空でもmalloc(0)がNULLを返さないよう1要素は割り当てる */
+    uint64_t * keys = malloc_or_err(max_long(sz, 1) * sizeof(uint64_t));
+    if (!keys) return 0;
+    for (long k = 0; k < sz; k++) {
+      long idx = sa->ptrs[k];
+      if (k > 0 && idx == sa->ptrs[k - 1]) {
+        keys[k] = keys[k - 1];
+      } else {
+        long len = document_array_data_len(repo->da, idx);
+        keys[k] = text_key(&repo->data->a[idx], len);
+      }
+    }
+    sa->keys = keys;
+    return 1;
+  }
+}
+
+/**
+   @brief 現在のsuffix arrayから静的探索木を作る
+   @return 標本数. 失敗(メモリ割り当て失敗)したら-1.
+
+   @details 以降の検索はこの木で範囲を狭めてから2分探索する.
+   ドキュメントが追加されると木は捨てられるので, putがしばらく
+   無いことがわかっている時(大量のputの後など)に呼ぶ.
+ */
+long document_repo_freeze(document_repo_t * repo) {
+  sa_tree_t * t = repo->tree;
+  sa_tree_destroy(t);
+  long sz = repo->sa->sz;
+  if (!repo->use_sa || sz == 0) return 0;
+  long n = (sz + sa_tree_step - 1) / sa_tree_step;
+  sa_tree_node_t * nodes = malloc_or_err(sizeof(sa_tree_node_t) * (n + 1));
+  if (!nodes) return -1;
+  t->n = n;
+  t->nodes = nodes;
+  long r = sa_tree_fill(repo, 1, 0);
+  assert(r == n);
+  (void)r;
+  return n;
+}
+
 long cur_time_us() {
   struct timeval tp[1];
   gettimeofday(tp, 0);
@@ -68,9 +68,70 @@ typedef struct {
   long sz;                      /**< ptrsの容量 */
   long n;                       /**< ptrs中で実際に埋まっている要素数  */
   sa_idx_t * ptrs;
+  uint64_t * keys;              /**< keys[i] は ptrs[i] のsuffixの先頭8バイト(big endian). 使わない場合は0 */
   long f;                       /**< n * f >= szになったら拡大  */
 } suffix_array_t;
 
+/** @brief バケット表の大きさ(先頭2バイトの種類数) */
+#define sa_n_buckets (1 << 16)
+
+/**
+   @brief suffix arrayの先頭2バイトによるバケット表
+
+   @details 各suffixの先頭2バイト(長さ1のsuffixは2バイト目を0とみなす)
+   をキーとし, そのキーを持つsuffixがsuffix array中で占める範囲を
+   表す. begin[p] は先頭2バイトが p 以上である最初の添字で,
+   キー p のsuffixは ptrs[begin[p]:begin[p+1]] にある.
+   検索はこの範囲から2分探索を始めればよい. 要素の挿入のたびに
+   変化した範囲だけ更新する.
+  */
+typedef struct {
+  long * begin;                 /**< 大きさ sa_n_buckets + 1. begin[sa_n_buckets] = sz */
+  long * cnt2;                  /**< cnt2[p] : 長さ2以上で先頭2バイトが p のsuffixの数 */
+  long cnt1[256];               /**< cnt1[c] : 長さ1で先頭バイトが c のsuffixの数 */
+} sa_bucket_t;
+
+/**
+   @brief 静的探索木の節点(suffix arrayの標本)
+  */
+typedef struct {
+  uint64_t key;                 /**< 標本のsuffixの先頭8バイト(big endian) */
+  long k;                       /**< 標本のsuffix array中の添字 */
+} sa_tree_node_t;
+
+/**
+   @brief suffix arrayの標本による静的探索木
+
+   @sa document_repo_freeze
+
+   @details suffix arrayから sa_tree_step 要素おきに取り出した標本を,
+   先頭8バイトとともにEytzinger順(nodes[i] の子が nodes[2i],
+   nodes[2i+1]となる順)に並べたもの. 木の上の方の節点は少数の
+   キャッシュラインに収まり, 各節点の比較はtextを参照せずに済む.
+   document_repo_freeze で作り, ドキュメントが追加されると
+   (suffix arrayの添字がずれるので)捨てる.
+  */
+typedef struct {
+  long n;                       /**< 標本数(0なら木は無い) */
+  sa_tree_node_t * nodes;       /**< 大きさ n + 1. nodes[1..n] を使う */
+} sa_tree_t;
+
+/**
+   @brief ラベルからドキュメント番号を引くハッシュ表
+
+   @sa document_repo_find_label
+
+   @details 開番地法(線形探査). slots[i] はドキュメント番号または
+   空き(-1). キーのラベル自体は labels の char_buf にあるものを参照する.
+   同じラベルのドキュメントは探査列上にドキュメント番号順に並ぶ.
+   要素数が大きさの半分を超えたら2倍の大きさで作り直す.
+  */
+typedef struct {
+  long sz;                      /**< slotsの大きさ(0または2のべき) */
+  long n;                       /**< 登録されたドキュメント数 */
+  long * slots;                 /**< ドキュメント番号(空きは-1) */
+} label_index_t;
+
 /** 
     @brief ドキュメントのレポジトリ
 
@@ -88,8 +149,119 @@ typedef struct {
   char_buf_t data[1];
   int use_sa;
   suffix_array_t sa[1];
+  suffix_array_t lsa[1];        /**< ラベル(labels)のsuffix array */
+  sa_bucket_t bt[1];            /**< saの先頭2バイトによるバケット表 */
+  sa_tree_t tree[1];            /**< saの標本による静的探索木 */
+  label_index_t lix[1];         /**< ラベル -> ドキュメント番号のハッシュ表 */
+  long version;                 /**< ドキュメントが追加されるたびに増える(saの添字が変わったことを示す) */
 } document_repo_t;
 
+/**
+   @brief 1回の検索にかけてよい手間(時間, 結果の数)と打ち切りの条件
+
+   @sa query_session_t
+
+   @details query_session_t の budget に設定すると, 検索(queryc,
+   query_result_next など)の中で時々調べ, 期限を過ぎたか,
+   cancelled が1を返したか, 返す結果が max_results を越えたら
+   truncated を1にして, それまでの結果で終える.
+  */
+typedef struct {
+  long deadline_us;             /**< この時刻(cur_time_us)を過ぎたら打ち切る. 0なら無し */
+  long max_results;             /**< 返す結果の数の上限. 0なら無し */
+  int (*cancelled)(void * arg); /**< 0でなければ時々呼び, 1を返したら打ち切る */
+  void * cancelled_arg;         /**< cancelled の引数 */
+  long n_results;               /**< これまでに返した結果の数 */
+  long n_steps;                 /**< これまでの手間(調べた要素の数) */
+  int truncated;                /**< 打ち切ったら1 */
+} query_budget_t;
+
+/**
+   @brief 検索の対象とするドキュメントの条件(ドキュメント番号の範囲とラベルの接頭辞)
+
+   @sa query_session_t
+
+   @details query_session_t の filter に設定すると, 検索(query_result_next,
+   queryc, queryd など)は条件に合うドキュメント中の出現だけを返す(数える).
+   suffix arrayの範囲を辿る場合は, 各出現をドキュメントを求める前に
+   data 上の位置で(番号の範囲のドキュメントは data 上で連続している),
+   求めた後にラベルで除く. スキャンする場合は番号の範囲内の, ラベルが
+   合うドキュメントだけを読む.
+  */
+typedef struct {
+  long doc_begin;               /**< 対象とするドキュメント番号の下限 */
+  long doc_end;                 /**< 対象とするドキュメント番号の上限(の次). 0なら無し */
+  char * label_prefix;          /**< ラベルがこれで始まるドキュメントだけを対象とする. 0なら無し */
+  long label_prefix_len;        /**< label_prefixの長さ(バイト数) */
+} query_filter_t;
+
+/** @brief query_session_t が覚えておく範囲の数 */
+#define query_session_depth 16
+
+/**
+   @brief 検索文字列 query[0:len] から始まるsuffixのsuffix array中の範囲
+  */
+typedef struct {
+  long len;                     /**< 検索文字列の長さ */
+  long begin;                   /**< 範囲の先頭 */
+  long end;                     /**< 範囲の終わり(の次) */
+} query_session_range_t;
+
+/**
+   @brief 接続ごとの検索のセッション(直前の検索の範囲を覚えておく)
+
+   @sa query_session_init
+   @sa document_repo_query
+
+   @details 入力補完などで "a", "ab", "abc", ... と1文字ずつ延ばした
+   (または縮めた)検索が続く場合に, 直前の検索文字列と, その接頭辞で
+   検索した範囲を短い順に最大 query_session_depth 個覚えておく.
+   次の検索文字列がそのいずれかを接頭辞に持てば, 一番長いものの
+   範囲の中だけを探索すればよい(同じ長さなら探索も不要).
+   ドキュメントが追加されたら(version が変わったら)捨てる.
+  */
+typedef struct {
+  long version;                 /**< 範囲を求めた時の document_repo_t の version */
+  long n;                       /**< 覚えている範囲の数 */
+  query_session_range_t r[query_session_depth]; /**< 範囲(lenの短い順) */
+  char * query;                 /**< 直前の検索文字列 */
+  long query_len;               /**< queryの長さ */
+  long query_sz;                /**< queryの容量 */
+  query_budget_t * budget;      /**< 検索の予算(0なら無制限) */
+  query_filter_t * filter;      /**< 検索の対象とするドキュメントの条件(0なら全て) */
+} query_session_t;
+
+/**
+   @brief 検索の方法
+
+   @sa document_repo_plan
+  */
+typedef enum {
+  query_plan_sa,                /**< suffix arrayを2分探索し, 求めた範囲を返す */
+  query_plan_sa_verify,         /**< バケット表の範囲(先頭2バイトが一致)の各要素を照合する */
+  query_plan_scan,              /**< 全ドキュメントをmemmemでスキャンする */
+} query_plan_kind_t;
+
+/**
+   @brief 検索の方法の選択とその根拠(見積もった手間)
+
+   @sa document_repo_plan
+
+   @details 手間はおよそメモリの(キャッシュに無い)参照の回数を単位とする
+  */
+typedef struct {
+  query_plan_kind_t kind;       /**< 選んだ方法 */
+  long data_len;                /**< 全ドキュメントの長さの合計(バイト数) */
+  long n_docs;                  /**< ドキュメント数 */
+  long query_len;               /**< 検索文字列の長さ */
+  long session_len;             /**< セッションが覚えていた接頭辞の長さ(0なら無し) */
+  long range_begin;             /**< 探索の元になる範囲(セッションまたはバケット表)の先頭 */
+  long range_end;               /**< 探索の元になる範囲の終わり(の次) */
+  long cost_sa;                 /**< query_plan_sa の手間の見積もり */
+  long cost_sa_verify;          /**< query_plan_sa_verify の手間の見積もり(-1なら選べない) */
+  long cost_scan;               /**< query_plan_scan の手間の見積もり(-1なら選べない) */
+} query_plan_t;
+
 /**
    @brief 文書中の検索文字列の出現(occurrence)を表すデータ
 
@@ -114,7 +286,7 @@ typedef struct {
    データ構造とする. 具体的には, query_result_next という関数で,
    次の出現を返すようなデータ構造とする. 従って以下のように使う.
 
-   query_result_t qr = document_repo_query(repo, query, query_len);
+   query_result_t qr = document_repo_query(repo, 0, query, query_len);
 
    while (1) {
 
@@ -141,8 +313,79 @@ typedef struct {
   /* 全スキャンで求めた出現箇所 */
   long next_doc;    /**< 次に検索するドキュメントの番号(配列の添字) */
   char * next_pos;  /**< 次に検索を開始する位置  */
+  sa_idx_t * buf;   /**< occurrencesを別に割り当てた場合その領域(query_result_destroyで開放) */
+  query_budget_t * budget; /**< 検索の予算(0なら無制限) */
+  int verify;       /**< occurrencesの各要素が query で始まるか照合する(query_plan_sa_verify) */
+  query_filter_t * filter; /**< 検索の対象とするドキュメントの条件(0なら全て) */
 } query_result_t;
 
+/**
+   @brief 検索文字列が出現するドキュメントとその出現回数
+
+   @sa document_repo_queryd
+  */
+typedef struct {
+  long doc;                     /**< ドキュメント番号(putが返した番号) */
+  long count;                   /**< そのドキュメント中の出現回数 */
+} doc_count_t;
+
+/**
+   @brief 検索文字列の密度で順位付けたドキュメント
+
+   @sa document_repo_queryr
+  */
+typedef struct {
+  long doc;                     /**< ドキュメント番号(putが返した番号) */
+  long count;                   /**< そのドキュメント中の出現回数 */
+  long offset;                  /**< そのドキュメント中の最初の出現の位置 */
+  double score;                 /**< 密度 count / data_len */
+} doc_score_t;
+
+/**
+   @brief 長い共通部分(繰り返し)を共有するドキュメントの組
+
+   @sa document_repo_dups
+  */
+typedef struct {
+  long doc0;                    /**< ドキュメント番号(小さい方) */
+  long doc1;                    /**< ドキュメント番号(大きい方) */
+  long count;                   /**< 共有する繰り返しの数 */
+  long offset;                  /**< 共有する繰り返しの1つの doc0 中の位置 */
+} dup_pair_t;
+
+/**
+   @brief ラベル検索での一致の条件
+
+   @sa document_repo_query_label
+  */
+typedef enum {
+  label_match_exact,            /**< ラベル全体が検索文字列と一致 */
+  label_match_prefix,           /**< ラベルが検索文字列で始まる */
+  label_match_substr,           /**< ラベルが検索文字列を含む */
+} label_match_t;
+
+/**
+   @brief 入力補完の候補(検索文字列に続く単語)とその出現回数
+
+   @sa document_repo_complete
+  */
+typedef struct {
+  long o;                       /**< 候補の単語の(data中の)オフセット. 単語は data[o:o+len] */
+  long len;                     /**< 候補の単語の長さ(バイト数). 検索文字列を含む */
+  long count;                   /**< 出現回数(出現が多い場合は推定値) */
+} completion_t;
+
+/**
+   @brief ドキュメント中の範囲
+
+   @sa document_repo_query_near
+  */
+typedef struct {
+  long doc;                     /**< ドキュメント番号(putが返した番号) */
+  long offset;                  /**< ドキュメント中の範囲の先頭 */
+  long len;                     /**< 範囲の長さ(バイト数) */
+} text_span_t;
+
 /**
    @brief 全ドキュメントのダンプを表すデータ構造
 
@@ -177,16 +420,61 @@ void document_repo_init(document_repo_t * repo);
 void document_repo_destroy(document_repo_t * repo);
 long document_repo_add(document_repo_t * repo, document_t d);
 
+void query_session_init(query_session_t * qs);
+void query_session_destroy(query_session_t * qs);
+
+query_plan_t document_repo_plan(document_repo_t * repo, query_session_t * qs,
+                                char * query, long query_len);
+const char * query_plan_kind_name(query_plan_kind_t kind);
+
 query_result_t
-document_repo_query(document_repo_t * repo, char * query, long query_len);
+document_repo_query(document_repo_t * repo, query_session_t * qs,
+                    char * query, long query_len);
 
-occurrence_t query_result_next(query_result_t * qr);
+int document_repo_query_sorted(document_repo_t * repo, query_session_t * qs,
+                               char * query, long query_len, query_result_t * qr);
+
+int document_repo_query_sample(document_repo_t * repo, query_session_t * qs,
+                               char * query, long query_len, long k,
+                               query_result_t * qr);
 
-long document_repo_queryc(document_repo_t * repo, char * query, long query_len);
+occurrence_t query_result_next(query_result_t * qr);
+query_result_t query_result_part(query_result_t * qr, long begin, long end);
+int query_budget_step(query_budget_t * b, long steps);
+void query_result_destroy(query_result_t * qr);
+
+long document_repo_queryc(document_repo_t * repo, query_session_t * qs,
+                          char * query, long query_len);
+
+long document_repo_queryd(document_repo_t * repo, query_session_t * qs,
+                          char * query, long query_len,
+                          long top_n, doc_count_t ** result);
+long document_repo_queryr(document_repo_t * repo, query_session_t * qs,
+                          char * query, long query_len,
+                          long top_k, doc_score_t ** result);
+long document_repo_dups(document_repo_t * repo, long min_len,
+                        query_budget_t * b, dup_pair_t ** result);
+document_t document_repo_get_doc(document_repo_t * repo, long doc);
+long document_repo_query_label(document_repo_t * repo, char * query, long query_len,
+                               label_match_t match, long ** result);
+long document_repo_find_label(document_repo_t * repo, char * label, long label_len,
+                              long ** result);
+long document_repo_complete(document_repo_t * repo, query_session_t * qs,
+                            char * prefix, long prefix_len,
+                            long top_n, completion_t ** result);
+long document_repo_query_near(document_repo_t * repo, query_session_t * qs,
+                              char * query0, long query0_len,
+                              char * query1, long query1_len,
+                              long window, text_span_t ** result);
 
 dump_result_t document_repo_dump(document_repo_t * repo);
 long document_repo_n_docs(document_repo_t * repo);
 document_t dump_result_next(dump_result_t * dr);
 
+int document_repo_set_use_keys(document_repo_t * repo, int use_keys);
+long document_repo_freeze(document_repo_t * repo);
+
+long cur_time_us();
+
 int document_repo_save(document_repo_t * repo, const char * dir);
 int document_repo_load(document_repo_t * repo, const char * dir);
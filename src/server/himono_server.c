@@ -13,6 +13,7 @@
    このファイルは演習が進むにつれて更新されるかもしれない.
  */
 
+#define _GNU_SOURCE         /* for pthread_setaffinity_np */
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
@@ -25,6 +26,13 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 
 #include "unagi_utility.h"
 #include "document_repository_himono.h"
@@ -38,11 +46,47 @@ typedef struct {
   char * log;   /**< ログファイルの名前 */
   char * data_dir; /**< 保存ディレクトリ */
   int load_data;   /**< ディレクトリからデータをロードするか */
-  int thread;   /**< スレッドを使うか */
+  int thread;   /**< スレッドを使うか(使うならレポジトリの複製を2つ持つ) */
+  int workers;  /**< ワーカースレッドの数(0なら使わない. 使うならレポジトリの複製を2つ持つ) */
+  int reactors; /**< ワーカーを使う時のイベントループ(reactor_t)の数 */
+  int pin;      /**< イベントループのスレッドをそれぞれ1つのCPUに固定するか */
+  int keys;     /**< suffix arrayに各要素の先頭8バイトを持たせるか */
+  long timeout_ms;  /**< 1リクエストの処理時間の上限(ミリ秒. 0なら無し) */
+  long max_results; /**< 1リクエストの結果の件数の上限(0なら無し) */
   int error;    /**< コマンドライン処理でエラーが出たら1にする */
   int help;    /**< コマンドライン処理で'-h'が出たら1にする */
 } cmdline_options_t;
 
+/**
+   @brief dups ジョブの状態
+  */
+typedef enum {
+  dups_job_none,                /**< ジョブは無い */
+  dups_job_running,             /**< 実行中 */
+  dups_job_done,                /**< 終わった(結果がある) */
+  dups_job_failed,              /**< 失敗した(メモリ割り当て失敗など) */
+} dups_job_state_t;
+
+/**
+   @brief 繰り返しを共有するドキュメントの組を求めるバックグラウンドジョブ
+
+   @sa connection_handle_dups
+
+   @details dups リクエストで始め, 専用のスレッドが document_repo_dups
+   を実行する. 結果は dupsr リクエストで取り出す. 同時に走るジョブは
+   1つだけで, 次のジョブを始めると前の結果は捨てる.
+  */
+typedef struct {
+  pthread_mutex_t mu[1];        /**< state, pairs, n_pairs を守る */
+  dups_job_state_t state;       /**< 状態 */
+  pthread_t tid;                /**< ジョブのスレッド(state が none でなければjoinする) */
+  long min_len;                 /**< 繰り返しの最小の長さ(バイト数) */
+  int stop;                     /**< 1ならジョブを打ち切る(サーバの終了時) */
+  query_budget_t budget[1];     /**< ジョブの予算(n_steps が進み具合を表す) */
+  dup_pair_t * pairs;           /**< 結果 */
+  long n_pairs;                 /**< pairs の要素数 */
+} dups_job_t;
+
 /**
    @brief サーバを表すデータ構造
  */
@@ -50,44 +94,107 @@ typedef struct {
   cmdline_options_t opt;
   FILE * log_wp;           /**< ログファイルへ書き込むためのFILE*構造体 */
   int server_sock;         /**< 接続を受け付けるソケット(socket) */
+  int port;                /**< server_sock の(実際の)ポート番号 */
   int server_continues;    /**< サーバが処理を続ける間1  */
   int term_fd[2];          /**< スレッドの終了通知用パイプ  */
   int nthreads;            /**< 走行中スレッド */
-  document_repo_t repo[1]; /**< ドキュメントレポジトリ */
+  document_repo_t repos[2];       /**< ドキュメントレポジトリとその複製(server_read_begin を参照) */
+  int n_repos;                    /**< 使う複製の数(スレッドを使うなら2, 使わなければ1) */
+  int repo_active;                /**< 読み手が読む複製(repos の添字) */
+  int repo_epoch;                 /**< 読み手が到着を数える側(repo_readers の添字) */
+  long repo_readers[2];           /**< repo_readers[e] : 側 e に到着し, まだ去っていない読み手の数 */
+  pthread_mutex_t repo_write_mu[1]; /**< 書き手を1つにする */
+  int repo_broken;                /**< 読まれていない複製への変更が失敗したら1(以降の変更を断る) */
+  struct single_flight * flights; /**< 実行中の get, getc (single_flight_begin を参照) */
+  pthread_mutex_t flights_mu[1];  /**< flights とその要素を守る */
+  pthread_cond_t flights_cv[1];   /**< flights の要素の結果が出たことの通知 */
+  dups_job_t dups[1];             /**< dups のバックグラウンドジョブ */
+  pthread_t * workers;            /**< ワーカースレッド(opt.workers 個. run_server_workers を参照) */
+  struct reactor * reactors;      /**< イベントループ(opt.reactors 個) */
+  pthread_mutex_t queue_mu[1];    /**< 以下の待ち行列と workers_exit を守る */
+  pthread_cond_t queue_cv[1];     /**< ready に接続が入ったことの通知 */
+  struct connection * ready_head; /**< リクエストを受信し終え, ワーカーを待つ接続の列の先頭 */
+  struct connection * ready_tail; /**< 同末尾 */
+  int workers_exit;               /**< 1ならワーカーは終了する */
 } server_t;
 
 /**
-   @brief サーバを起動する
+   @brief 接続要求と接続からの受信を待つイベントループ(-w)
 
-   @details クライアントからの接続を受け付けるソケットを作る; ログファイルを開く; 空のドキュメントレポジトリを作る.
+   @sa reactor_run
   */
-static server_t * start_server(cmdline_options_t opt) {
+typedef struct reactor {
+  server_t * sv;                /**< サーバ */
+  int idx;                      /**< 番号(server_t の reactors の添字) */
+  int listen_sock;              /**< 接続を受け付けるソケット(0番目は server_sock) */
+  int epoll_fd;                 /**< listen_sock と受け付けた接続を待つ epoll */
+  int wake_fd[2];               /**< イベントループを起こす通知用パイプ(サーバの終了中) */
+  long n_live;                  /**< 受け付けて, まだ閉じていない接続の数 */
+  int ok;                       /**< エラーで終わったら0 */
+  pthread_t tid;                /**< スレッド */
+} reactor_t;
+
+/**
+   @brief 接続を受け付けるソケットを作る
+   @return ソケットまたは-1(エラー)
+
+   @details port 番号(0ならOSが選ぶ)に bind し, listen する.
+   実際の番号を *bound_port に返す. reuse_port なら SO_REUSEPORT を
+   設定し, 同じ番号にいくつものソケットを bind できるようにする
+   (カーネルが接続要求をそれらに振り分ける).
+  */
+static int server_listen(int port, int qlen, int reuse_port, int * bound_port) {
   /* ソケットを作る */
   int ss = socket(AF_INET, SOCK_STREAM, 0);
   if (ss == -1) {
     api_err("socket");
-    return 0;
+    return -1;
+  }
+  int one = 1;
+  if (reuse_port
+      && setsockopt(ss, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+    api_err("setsockopt");
+    close(ss);
+    return -1;
   }
   struct sockaddr_in addr[1];
   /* ポート番号を割り当てる(bind) */
   addr->sin_family = AF_INET;
-  addr->sin_port = htons(opt.port);
+  addr->sin_port = htons(port);
   addr->sin_addr.s_addr = INADDR_ANY;
   unsigned int addrlen = sizeof(addr);
   if (bind(ss, (struct sockaddr *)addr, addrlen) == -1) {
     api_err("bind");
-    return 0;
+    close(ss);
+    return -1;
   }
   /* 割り当てられたポート番号を得る */
   if (getsockname(ss, (struct sockaddr *)addr, &addrlen) == -1) {
     api_err("getsockname");
-    return 0;
+    close(ss);
+    return -1;
   }
   /* 接続可能にする. 接続要求を貯めるキューの長さを設定する(listen) */
-  if (listen(ss, opt.qlen) == -1) {
+  if (listen(ss, qlen) == -1) {
     api_err("listen");
-    return 0;
+    close(ss);
+    return -1;
   }
+  *bound_port = ntohs(addr->sin_port);
+  return ss;
+}
+
+/**
+   @brief サーバを起動する
+
+   @details クライアントからの接続を受け付けるソケットを作る; ログファイルを開く; 空のドキュメントレポジトリを作る.
+  */
+static server_t * start_server(cmdline_options_t opt) {
+  /* イベントループが複数なら各々が同じポート番号のソケットを持つ */
+  int port = 0;
+  int ss = server_listen(opt.port, opt.qlen,
+                         (opt.workers > 0 && opt.reactors > 1), &port);
+  if (ss == -1) return 0;
   /* ログファイルを開く */
   FILE * log_wp = 0;
   if (strlen(opt.log)) {
@@ -112,25 +219,52 @@ static server_t * start_server(cmdline_options_t opt) {
   if (!sv) return 0;
   sv->opt = opt;
   sv->server_sock = ss;
+  sv->port = port;
   sv->server_continues = 1;
   sv->log_wp = log_wp;
   sv->term_fd[0] = term_fd[0];
   sv->term_fd[1] = term_fd[1];
   sv->nthreads = 0;
-
-  if (opt.load_data) {
-    /* ファイルからロード */
-    if (!document_repo_load(sv->repo, opt.data_dir)) {
+  sv->flights = 0;
+  pthread_mutex_init(sv->flights_mu, 0);
+  pthread_cond_init(sv->flights_cv, 0);
+  pthread_mutex_init(sv->dups->mu, 0);
+  sv->dups->state = dups_job_none;
+  sv->dups->pairs = 0;
+  sv->dups->n_pairs = 0;
+
+  sv->workers = 0;
+  sv->reactors = 0;
+  sv->ready_head = sv->ready_tail = 0;
+  sv->workers_exit = 0;
+  pthread_mutex_init(sv->queue_mu, 0);
+  pthread_cond_init(sv->queue_cv, 0);
+
+  /* スレッドを使うなら読み手と書き手が同時に走るので複製を作る */
+  sv->n_repos = (opt.thread || opt.workers > 0 ? 2 : 1);
+  sv->repo_active = 0;
+  sv->repo_epoch = 0;
+  sv->repo_readers[0] = sv->repo_readers[1] = 0;
+  sv->repo_broken = 0;
+  pthread_mutex_init(sv->repo_write_mu, 0);
+  for (int i = 0; i < sv->n_repos; i++) {
+    if (opt.load_data) {
+      /* ファイルからロード */
+      if (!document_repo_load(&sv->repos[i], opt.data_dir)) {
+        return 0;
+      }
+    } else {
+      /* 空のドキュメントレポジトリを作る */
+      document_repo_init(&sv->repos[i]);
+    }
+    if (!document_repo_set_use_keys(&sv->repos[i], opt.keys)) {
       return 0;
     }
-  } else {
-    /* 空のドキュメントレポジトリを作る */
-    document_repo_init(sv->repo);
   }
-  fprintf(stderr, "server listening on port %d\n", ntohs(addr->sin_port));
+  fprintf(stderr, "server listening on port %d\n", port);
   if (sv->log_wp) {
     fprintf(sv->log_wp, "server pid %d\n", getpid());
-    fprintf(sv->log_wp, "server listening on port %d\n", ntohs(addr->sin_port));
+    fprintf(sv->log_wp, "server listening on port %d\n", port);
     fflush(sv->log_wp);
   }
   return sv;
@@ -140,16 +274,111 @@ static server_t * start_server(cmdline_options_t opt) {
    @brief サーバを停止. メモリを開放
   */
 static void stop_server(server_t * sv) {
-  if (sv->repo) {
-    document_repo_destroy(sv->repo);
+  if (sv->dups->state != dups_job_none) {
+    /* 走っていれば打ち切る */
+    sv->dups->stop = 1;
+    pthread_join(sv->dups->tid, 0);
   }
+  my_free(sv->dups->pairs);
+  pthread_mutex_destroy(sv->dups->mu);
+  for (int i = 0; i < sv->n_repos; i++) {
+    document_repo_destroy(&sv->repos[i]);
+  }
+  pthread_mutex_destroy(sv->repo_write_mu);
   if (sv->log_wp) {
     fclose(sv->log_wp);
   }
   close(sv->server_sock);
+  pthread_cond_destroy(sv->flights_cv);
+  pthread_mutex_destroy(sv->flights_mu);
+  pthread_cond_destroy(sv->queue_cv);
+  pthread_mutex_destroy(sv->queue_mu);
   my_free(sv);
 }
 
+/**
+   @brief 読み手としてドキュメントレポジトリ(の複製)を得る
+   @return 読む複製
+
+   @details スレッドを使う場合, サーバは同じ内容のレポジトリの複製を
+   2つ持つ(left-right). 読み手はロックを取らずに公開されている方
+   (repo_active)を読む. 読み始めに repo_epoch の側の repo_readers を
+   1増やし(その側を *epoch に返す), server_read_end で1減らす.
+   書き手(server_write)は読まれていない方を変更してから公開し, 古い方を
+   読んでいるかもしれない読み手が全て去るのを待ってから古い方を
+   同じように変更する. そのため読み手は待たず, 変更の途中でない
+   複製を読み, バッファが読み手の下で開放されることもない.
+  */
+static document_repo_t * server_read_begin(server_t * sv, int * epoch) {
+  int e = __atomic_load_n(&sv->repo_epoch, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&sv->repo_readers[e], 1, __ATOMIC_SEQ_CST);
+  *epoch = e;
+  return &sv->repos[__atomic_load_n(&sv->repo_active, __ATOMIC_SEQ_CST)];
+}
+
+/**
+   @brief server_read_begin で得た複製を読み終える
+  */
+static void server_read_end(server_t * sv, int epoch) {
+  __atomic_sub_fetch(&sv->repo_readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+/** @brief 書き手が読み手が去るのを待つ間隔(マイクロ秒) */
+static const long server_write_wait_us = 50;
+
+/**
+   @brief 側 e に到着した読み手が全て去るのを待つ
+  */
+static void server_wait_readers(server_t * sv, int e) {
+  while (__atomic_load_n(&sv->repo_readers[e], __ATOMIC_SEQ_CST) > 0) {
+    usleep(server_write_wait_us);
+  }
+}
+
+/**
+   @brief 書き手としてドキュメントレポジトリの全ての複製に op を施す
+   @return op が返した値
+
+   @details 書き手は一度に1つ. 複製が2つなら, 読まれていない方に op を
+   施して公開し, 到着を数える側を切り替えながら古い方の読み手が
+   両側とも去るのを待ち(left-right), 古い方にも op を施す.
+   複製には同じ順で同じ変更を施すので, 内容(suffix arrayの添字,
+   version なども)は同じに保たれ, 接続ごとのセッションが覚えた範囲は
+   どちらの複製でも使える. 長い読み手(大きな結果の送信など)がいると
+   書き手はそれが終わるまで待つ.
+
+   op が失敗(-1)しても複製は途中まで変わっているかもしれず, 元に
+   戻せない. 最初の複製で失敗したらそれを公開せず(読み手は変わらない
+   方を読み続ける), 以降の変更は全て断る(-1). 公開した後の2つ目の
+   複製で失敗したら, 食い違った複製を読ませないようサーバを止める.
+  */
+static long server_write(server_t * sv, long (*op)(document_repo_t *, void *), void * arg) {
+  pthread_mutex_lock(sv->repo_write_mu);
+  long r;
+  if (sv->n_repos == 1) {
+    r = op(&sv->repos[0], arg);
+  } else if (sv->repo_broken) {
+    r = -1;
+  } else {
+    int a = sv->repo_active;
+    r = op(&sv->repos[1 - a], arg);
+    if (r == -1) {
+      sv->repo_broken = 1;
+    } else {
+      __atomic_store_n(&sv->repo_active, 1 - a, __ATOMIC_SEQ_CST);
+      int e = sv->repo_epoch;
+      server_wait_readers(sv, 1 - e);
+      __atomic_store_n(&sv->repo_epoch, 1 - e, __ATOMIC_SEQ_CST);
+      server_wait_readers(sv, e);
+      if (op(&sv->repos[a], arg) == -1) {
+        internal_err("could not apply a write to the second copy of the repository");
+      }
+    }
+  }
+  pthread_mutex_unlock(sv->repo_write_mu);
+  return r;
+}
+
 /**
    @brief クライアントからのリクエストの種類
   */
@@ -157,10 +386,25 @@ static void stop_server(server_t * sv) {
 typedef enum {
   request_kind_put,             /**< put (ドキュメント追加) */
   request_kind_get,             /**< get (文字列検索)  */
+  request_kind_geto,            /**< geto (文字列検索. ドキュメント, 位置の順)  */
   request_kind_getc,             /**< getc (文字列出現数)  */
+  request_kind_getd,             /**< getd (文字列が出現するドキュメント)  */
+  request_kind_gets,             /**< gets (文字列の出現の無作為抽出)  */
+  request_kind_getr,             /**< getr (文字列の密度で順位付けたドキュメント)  */
+  request_kind_getl,             /**< getl (ラベル検索)  */
+  request_kind_getdoc,           /**< getdoc (番号によるドキュメント(の一部)取得)  */
+  request_kind_getlabel,         /**< getlabel (ラベルによるドキュメント取得)  */
+  request_kind_complete,         /**< complete (入力補完)  */
+  request_kind_near,             /**< near (2つの文字列が近くに出現する範囲)  */
+  request_kind_explain,          /**< explain (検索の方法の選択とその根拠) */
   request_kind_dump,             /**< dump (全ドキュメントダンプ) */
   request_kind_dumpc,             /**< dumpc (全ドキュメント数) */
   request_kind_save,             /**< save */
+  request_kind_freeze,           /**< freeze (静的探索木の構築) */
+  request_kind_dups,             /**< dups (繰り返しを共有するドキュメントの組を求めるジョブの開始) */
+  request_kind_dupsr,            /**< dupsr (dups の結果) */
+  request_kind_limit,            /**< limit (この接続の時間と結果件数の上限) */
+  request_kind_filter,           /**< filter (この接続の検索の対象とするドキュメントの条件) */
   request_kind_discon,            /**< discon (接続終了) */
   request_kind_quit,            /**< quit (サーバ終了) */
   request_kind_invalid,         /**< 無効なリクエスト  */
@@ -184,7 +428,32 @@ typedef struct {
     struct {
       char * query;             /**< 検索文字列 */
       size_t query_len;         /**< queryの長さ(バイト数) */
+      long n;                   /**< 結果の件数の上限(getd, complete: 上位何件か. 0なら全て. gets: 抽出する件数. getr: 上位何件か) */
+      label_match_t match;      /**< getl: 一致の条件 */
     } get;
+    struct {
+      char * query[2];          /**< 検索文字列 */
+      size_t query_len[2];      /**< queryの長さ(バイト数) */
+      long window;              /**< 出現位置の差の上限(バイト数) */
+    } near;
+    struct {
+      long doc;                 /**< ドキュメント番号(putが返した番号) */
+      long offset;              /**< 読み出す範囲の先頭(バイト) */
+      long len;                 /**< 読み出す長さ(バイト数. 0ならドキュメントの終わりまで) */
+    } getdoc;
+    struct {
+      long doc_begin;           /**< 対象とするドキュメント番号の下限 */
+      long doc_end;             /**< 対象とするドキュメント番号の上限(の次). 0なら無し */
+      char * label_prefix;      /**< 対象とするドキュメントのラベルの接頭辞. 0なら無し */
+      size_t label_prefix_len;  /**< label_prefixの長さ(バイト数) */
+    } filter;
+    struct {
+      long n;                   /**< dups: 繰り返しの最小の長さ(バイト数). dupsr: 上位何件か(0なら全て) */
+    } dups;
+    struct {
+      long timeout_ms;          /**< 1リクエストの処理時間の上限(ミリ秒. 0なら無し) */
+      long max_results;         /**< 1リクエストの結果の件数の上限(0なら無し) */
+    } limit;
   };
 } request_t;
 
@@ -200,7 +469,8 @@ typedef struct {
 static ssize_t send_bytes(int so, char * buf, size_t n) {
   size_t sent = 0;
   while (sent < n) {
-    ssize_t r = send(so, buf + sent, n - sent, 0);
+    /* 相手が接続を切っていてもSIGPIPEで落ちないようにする */
+    ssize_t r = send(so, buf + sent, n - sent, MSG_NOSIGNAL);
     if (r == -1) {
       api_err("send");
       return -1;
@@ -211,6 +481,14 @@ static ssize_t send_bytes(int so, char * buf, size_t n) {
   return sent;
 }
 
+/**
+   @brief ソケットにbufから指定されたnバイト全て送る.
+   @return 1 (全て送れた. n == 0 も含む) または 0 (失敗)
+   */
+static int send_all(int so, char * buf, size_t n) {
+  return send_bytes(so, buf, n) == (ssize_t)n;
+}
+
 /**
    @brief 数字を送信
   */
@@ -249,6 +527,26 @@ static int send_ok_and_num(int so,   /**< ソケット */
   }
 }
 
+/**
+   @brief 返事の先頭 "OK 件数\n" を送信. 打ち切られていたら
+   "OK 件数 truncated\n" を送信
+  */
+static int send_ok_and_count(int so,        /**< ソケット */
+                             size_t x,      /**< 送信する件数 */
+                             int truncated) { /**< 打ち切られたか */
+  if (!truncated) return send_ok_and_num(so, x, '\n');
+  return send_ok_and_num(so, x, ' ') && send_all(so, "truncated\n", 10);
+}
+
+/**
+   @brief 返事の終わり "0\n" を送信. 打ち切られていたら
+   "0 truncated\n" を送信
+  */
+static int send_end(int so, int truncated) {
+  if (!truncated) return send_num(so, 0, '\n');
+  return send_num(so, 0, ' ') && send_all(so, "truncated\n", 10);
+}
+
 /**
    @brief 返事 "NG + 理由\n" を送信
   */
@@ -268,62 +566,143 @@ static int send_ng(int so, char * msg) {
 }
 
 /**
-   @brief ソケットからbufにnバイト受信する.
-   @return 実際に受信されたバイト数
+   @brief 受信したが, まだリクエストとして読んでいないバイト列
+
+   @details リクエストはソケットから直接ではなくここから読む
+   (server_parse_message). 受信は別に行う(recv_buf_fill).
+   リクエストの途中までしか届いていなければ, 読み終えるのに必要な
+   バイト数を need に記録して読むのをやめ, さらに受信してから
+   最初から読み直す. そのためソケットを待たずにリクエストを
+   組み立てられる.
+  */
+typedef struct {
+  char * a;                     /**< バイト列 */
+  size_t n;                     /**< a の有効なバイト数 */
+  size_t sz;                    /**< a の大きさ */
+  size_t pos;                   /**< 読んでいる位置 */
+  size_t need;                  /**< 足りなかった時, 読み終えるのに必要な n (足りていれば0) */
+  int eof;                      /**< 相手が送信を終えた(またはエラー)なら1 */
+} recv_buf_t;
 
-   @details 指定されたバイト数(n)受信するまでrecvする. 
-   途中でエラーが発生したり, データ(接続)が終了したら終了. 
-   受け取れたバイト数を返す. 返り値がnでなかったらそれは,
-   エラーまたは相手の接続断により, 意図したデータが受信
-   できていないということ.
-*/
-/* receive exactly n bytes or until EOF.
-   return -1 if we encountered an error.
-   return the number of bytes read otherwise */
-static ssize_t recv_bytes(int so, size_t n, char * buf) {
-  size_t received = 0;
-  while (received < n) {
-    ssize_t r = recv(so, buf + received, n - received, 0);
-    if (r == -1) {
-      api_err("recv");
-      return -1;
-    }
-    if (r == 0) {
-      fprintf(stderr,
-              "premature end of stream. expected %ld bytes"
-              " but ended with %ld bytes\n", n, received);
-      return received;
+/** @brief 1回の recv で受信する最小のバイト数 */
+static const size_t recv_buf_chunk = 1 << 16;
+
+/**
+   @brief 空の recv_buf_t を作る
+  */
+static void recv_buf_init(recv_buf_t * rb) {
+  rb->a = 0;
+  rb->n = rb->sz = rb->pos = rb->need = 0;
+  rb->eof = 0;
+}
+
+/**
+   @brief recv_buf_t のメモリを開放する
+  */
+static void recv_buf_destroy(recv_buf_t * rb) {
+  my_free(rb->a);
+  recv_buf_init(rb);
+}
+
+/**
+   @brief ソケットから recv_buf_t に受信する
+   @return 受信したバイト数. 0 (相手が送信を終えた, エラー, 
+   または nonblock で何も届いていない) 
+
+   @details 1回だけ recv する. nonblock なら待たない(MSG_DONTWAIT).
+   need を満たす(リクエストを読み終えられる)だけの空きを用意する.
+   相手が送信を終えたかエラーなら eof を1にする.
+  */
+static ssize_t recv_buf_fill(recv_buf_t * rb, int so, int nonblock) {
+  size_t want = rb->n + recv_buf_chunk;
+  if (want < rb->need) want = rb->need;
+  if (rb->sz < want) {
+    char * a = realloc(rb->a, want);
+    if (!a) {
+      api_err("realloc");
+      rb->eof = 1;
+      return 0;
     }
-    received += r;
+    rb->a = a;
+    rb->sz = want;
   }
-  return received;
+  ssize_t r = recv(so, rb->a + rb->n, rb->sz - rb->n, (nonblock ? MSG_DONTWAIT : 0));
+  if (r == -1) {
+    if (nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    api_err("recv");
+    rb->eof = 1;
+    return 0;
+  }
+  if (r == 0) {
+    rb->eof = 1;
+    return 0;
+  }
+  rb->n += r;
+  return r;
+}
+
+/**
+   @brief 空の recv_buf_t の領域を開放する
+
+   @details リクエストの合間の接続が領域を持ち続けないよう, 
+   接続を epoll に戻す時に呼ぶ
+  */
+static void recv_buf_shrink(recv_buf_t * rb) {
+  if (rb->n == 0 && rb->a) {
+    my_free(rb->a);
+    rb->a = 0;
+    rb->sz = 0;
+  }
+}
+
+/**
+   @brief 読み終えたリクエストの分を recv_buf_t から取り除く
+  */
+static void recv_buf_consume(recv_buf_t * rb, size_t len) {
+  memmove(rb->a, rb->a + len, rb->n - len);
+  rb->n -= len;
+  if (rb->n == 0 && rb->sz > recv_buf_chunk) {
+    /* 大きなリクエスト(put)のための領域は持ち続けない */
+    my_free(rb->a);
+    rb->a = 0;
+    rb->sz = 0;
+  }
+}
+
+/**
+   @brief recv_buf_t からbufにnバイト読む.
+   @return n または -1 (まだnバイト届いていない)
+
+   @details 届いていなければ何も読まず, need を設定する.
+*/
+static ssize_t recv_bytes(recv_buf_t * rb, size_t n, char * buf) {
+  if (rb->n - rb->pos < n) {
+    rb->need = rb->pos + n;
+    return -1;
+  }
+  memcpy(buf, rb->a + rb->pos, n);
+  rb->pos += n;
+  return n;
 }
 
 /** 
     @brief 空白文字(' ', '\\t', '\\n'など. man isspaceを参照)が現れるまで, 最大でnバイト, データを読む. 
 
-    @details 空白文字(' ', '\\t', '\\n'など. man isspaceを参照)が現れるかnバイト読まれるまでデータを読む. そうなる前にエラーになったり, 接続が終了したら終了.
-    エラーが生じたら-1, そうでなければ実際に読まれたバイト数(空白文字含め)を返す. 返り値をmとしたとき, m > 0 かつ isspace(buf[m - 1]) が成り立っていれば意図通りのデータが読まれている.
+    @details 空白文字(' ', '\\t', '\\n'など. man isspaceを参照)が現れるかnバイト読まれるまでデータを読む. そうなる前にデータが尽きたら何も読まずに need を設定し -1 を返す.
+    そうでなければ実際に読まれたバイト数(空白文字含め)を返す. 返り値をmとしたとき, m > 0 かつ isspace(buf[m - 1]) が成り立っていれば意図通りのデータが読まれている.
  */
-static ssize_t recv_until_ws(int so, size_t n, char * buf) {
+static ssize_t recv_until_ws(recv_buf_t * rb, size_t n, char * buf) {
   size_t received = 0;
   while (received < n) {
-    ssize_t r = recv(so, buf + received, 1, 0);
-    if (r == -1) {
-      api_err("recv");
+    if (rb->pos + received == rb->n) {
+      rb->need = rb->n + 1;
       return -1;
     }
-    if (r == 0) {
-      if (received) {
-        fprintf(stderr,
-                "premature end of stream. expected %ld bytes"
-                " but ended with %ld bytes\n", n, received);
-      }
-      return received;
-    }
+    buf[received] = rb->a[rb->pos + received];
     received++;
     if (isspace(buf[received - 1])) break;
   }
+  rb->pos += received;
   if (!isspace(buf[received - 1])) {
     fprintf(stderr, "error: a line too long (> %ld bytes) [%s...]\n", n, buf);
   }
@@ -331,16 +710,16 @@ static ssize_t recv_until_ws(int so, size_t n, char * buf) {
 }
 
 /**
-   @brief ソケットから数字の列を読み込みそれを数字として返す. 
+   @brief 数字の列を読み込みそれを数字として返す. 
 
    @details 例えば, '3', '4', '5', 空白文字 が順に読み込まれたら, 
    空白文字 まで読み込んだところで 345 を返す.
 
  */
-static ssize_t recv_num(int so) {
+static ssize_t recv_num(recv_buf_t * rb) {
   char num[max_num_len + 1];
   memset(num, 0, max_num_len + 1);
-  ssize_t num_len = recv_until_ws(so, max_num_len, num);
+  ssize_t num_len = recv_until_ws(rb, max_num_len, num);
   if (num_len <= 0) return -1;
   if (!isspace(num[num_len - 1])) return -1;
   char * end = 0;
@@ -360,8 +739,8 @@ static ssize_t recv_num(int so) {
 /**
    @brief quit メッセージを受信
  */
-static request_t server_recv_message_quit(int so) {
-  (void)so;
+static request_t server_recv_message_quit(recv_buf_t * rb) {
+  (void)rb;
   request_t req;
   req.kind = request_kind_quit;
   return req;
@@ -370,8 +749,8 @@ static request_t server_recv_message_quit(int so) {
 /**
    @brief discon メッセージを受信
  */
-static request_t server_recv_message_discon(int so) {
-  (void)so;
+static request_t server_recv_message_discon(recv_buf_t * rb) {
+  (void)rb;
   request_t req;
   req.kind = request_kind_discon;
   return req;
@@ -380,8 +759,8 @@ static request_t server_recv_message_discon(int so) {
 /**
    @brief dump メッセージを受信
  */
-static request_t server_recv_message_dump(int so) {
-  (void)so;
+static request_t server_recv_message_dump(recv_buf_t * rb) {
+  (void)rb;
   request_t req;
   req.kind = request_kind_dump;
   return req;
@@ -390,8 +769,8 @@ static request_t server_recv_message_dump(int so) {
 /**
    @brief dumpc メッセージを受信
  */
-static request_t server_recv_message_dumpc(int so) {
-  (void)so;
+static request_t server_recv_message_dumpc(recv_buf_t * rb) {
+  (void)rb;
   request_t req;
   req.kind = request_kind_dumpc;
   return req;
@@ -407,32 +786,39 @@ static request_t server_recv_message_dumpc(int so) {
      LABEL_LEN, DATA_LENはそれぞれLABEL, DATAの長さ(バイト数)
 
  */
-static request_t server_recv_message_put(int so) {
+static request_t server_recv_message_put(recv_buf_t * rb) {
   request_t req;
   req.kind = request_kind_invalid;
 
   /* LABEL_LEN + LABEL を受信 */
-  ssize_t label_len = recv_num(so);
+  ssize_t label_len = recv_num(rb);
   if (label_len == -1) return req;
   char * label = malloc_or_err(label_len + 1);
   if (!label) return req;
-  ssize_t r = recv_bytes(so, label_len, label);
-  if (r != label_len) return req;
+  ssize_t r = recv_bytes(rb, label_len, label);
+  if (r != label_len) {
+    my_free(label);
+    return req;
+  }
   label[label_len] = 0;
 
   /* LABEL 後の空白を受信 */
   char ws[1];
-  r = recv_bytes(so, 1, ws);
-  if (r != 1) return req;
+  r = recv_bytes(rb, 1, ws);
+  if (r != 1) {
+    my_free(label);
+    return req;
+  }
   if (!isspace(ws[0])) {
     fprintf(stderr,
             "expected a whitespace but received %c after label (%s)\n",
             ws[0], label);
+    my_free(label);
     return req;
   }
 
   /* DATA_LEN + DATA を受信 */
-  ssize_t data_len = recv_num(so);
+  ssize_t data_len = recv_num(rb);
   if (data_len == -1) {
     my_free(label);
     return req;
@@ -442,9 +828,10 @@ static request_t server_recv_message_put(int so) {
     my_free(label);
     return req;
   }
-  r = recv_bytes(so, data_len, data);
+  r = recv_bytes(rb, data_len, data);
   if (r != data_len) {
     my_free(label);
+    my_free(data);
     return req;
   }
   data[data_len] = 0;
@@ -467,19 +854,22 @@ static request_t server_recv_message_put(int so) {
    QUERY_LENはQUERYの長さ(バイト数)
 
  */
-static request_t server_recv_message_getc(int so) {
+static request_t server_recv_message_getc(recv_buf_t * rb) {
   request_t req;
   req.kind = request_kind_invalid;
 
   /* QUERY_LEN + QUERYを受信 */
-  ssize_t query_len = recv_num(so);
+  ssize_t query_len = recv_num(rb);
   if (query_len == -1) return req;
   /* allocate the buffer for the payload */
   char * query = malloc_or_err(query_len + 1);
   if (!query) return req;
   /* receive the payload */
-  ssize_t r = recv_bytes(so, query_len, query);
-  if (r != query_len) return req;
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
   query[query_len] = 0;
 
   req.kind = request_kind_getc;
@@ -498,19 +888,22 @@ static request_t server_recv_message_getc(int so) {
    QUERY_LENはQUERYの長さ(バイト数)
 
  */
-static request_t server_recv_message_get(int so) {
+static request_t server_recv_message_get(recv_buf_t * rb) {
   request_t req;
   req.kind = request_kind_invalid;
 
   /* QUERY_LEN + QUERYを受信 */
-  ssize_t query_len = recv_num(so);
+  ssize_t query_len = recv_num(rb);
   if (query_len == -1) return req;
   /* allocate the buffer for the payload */
   char * query = malloc_or_err(query_len + 1);
   if (!query) return req;
   /* receive the payload */
-  ssize_t r = recv_bytes(so, query_len, query);
-  if (r != query_len) return req;
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
   query[query_len] = 0;
 
   req.kind = request_kind_get;
@@ -519,167 +912,1755 @@ static request_t server_recv_message_get(int so) {
   return req;
 }
 
-static request_t server_recv_message_save(int so) {
-  (void)so;
-  request_t req;
-  req.kind = request_kind_save;
+/**
+   @brief geto メッセージを受信
+
+   @details geto メッセージの形式 (geto 空白 まですでに読み込み済み) は
+   getと同じ. 結果をドキュメント, 位置の順に返す.
+
+ */
+static request_t server_recv_message_geto(recv_buf_t * rb) {
+  request_t req = server_recv_message_get(rb);
+  if (req.kind == request_kind_get) req.kind = request_kind_geto;
   return req;
 }
 
-/** 
-    @brief ソケットからリクエストメッセージをひとつ受信する.
+/**
+   @brief explain メッセージを受信
 
-    @details 現在は以下の3種類 (空白 は ' ' でも '\\n' でもよい. isspaceが1を返す任意の文字)
-   
-   (1) quit 空白
+   @details explain メッセージの形式 (explain 空白 まですでに読み込み済み) は
+   getcと同じ. 検索はせず, getで使う検索の方法とその根拠を返す.
 
-   (2) put 空白 LABEL_LEN 空白 LABEL 空白 DATA_LEN DATA
+ */
+static request_t server_recv_message_explain(recv_buf_t * rb) {
+  request_t req = server_recv_message_getc(rb);
+  if (req.kind == request_kind_getc) req.kind = request_kind_explain;
+  return req;
+}
 
-   (3) get 空白 QUERY_LEN 空白 QUERY
+/** @brief gets で選べる出現の数の上限(これを超えるKは無効なリクエストとする) */
+static const long gets_max_k = 1L << 32;
 
- */
+/**
+   @brief gets メッセージを受信
+
+   @details gets メッセージの形式 (gets 空白 まですでに読み込み済み) 
+
+   gets 空白 K 空白 QUERY_LEN QUERY
+
+   Kは無作為に選ぶ出現の数,
+   QUERY_LENはQUERYの長さ(バイト数)
 
-static request_t server_recv_message(int so) {
+ */
+static request_t server_recv_message_gets(recv_buf_t * rb) {
   request_t req;
   req.kind = request_kind_invalid;
-  char inst[max_inst_len + 1];
-  /* clear all bytes in inst */
-  memset(inst, 0, max_inst_len + 1);
-  /* get a line */
-  ssize_t inst_len = recv_until_ws(so, max_inst_len, inst);
-  /* error? -> return invalid */
-  if (inst_len <= 0) return req;
-  /* could not get a line */
-  if (!isspace(inst[inst_len - 1])) return req;
-  inst[inst_len - 1] = 0;
-  /* parse the instruction (quit, get or put) */
-  if (strcasecmp(inst, "quit") == 0) {
-    return server_recv_message_quit(so);
-  } else if (strcasecmp(inst, "discon") == 0) {
-    return server_recv_message_discon(so);
-  } else if (strcasecmp(inst, "dumpc") == 0) {
-    return server_recv_message_dumpc(so);
-  } else if (strcasecmp(inst, "dump") == 0) {
-    return server_recv_message_dump(so);
-  } else if (strcasecmp(inst, "put") == 0) {
-    return server_recv_message_put(so);
-  } else if (strcasecmp(inst, "getc") == 0) {
-    return server_recv_message_getc(so);
-  } else if (strcasecmp(inst, "get") == 0) {
-    return server_recv_message_get(so);
-  } else if (strcasecmp(inst, "save") == 0) {
-    return server_recv_message_save(so);
-  } else {
-    fprintf(stderr, "invalid command [%s]\n", inst);
+
+  /* Kを受信 */
+  ssize_t k = recv_num(rb);
+  if (k == -1) return req;
+  if (k < 0 || k > gets_max_k) {
+    fprintf(stderr, "invalid number of samples [%ld]\n", k);
+    return req;
+  }
+  /* QUERY_LEN + QUERYを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
   }
+  query[query_len] = 0;
+
+  req.kind = request_kind_gets;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  req.get.n = k;
   return req;
 }
 
 /**
-   @brief putメッセージを処理
-   @return 1 (成功) または 0 (失敗)
-  */
-static int connection_handle_put(request_t req, int so, server_t * sv) {
-  if (sv->log_wp) {
-    fprintf(sv->log_wp, "put label[%ld]=[%s] data[%ld]=[...]\n",
-            req.put.label_len, req.put.label,
-            req.put.data_len); // , req.put.data
-    fflush(sv->log_wp);
-  }
-  document_t doc = { req.put.label, 0, req.put.label_len, 
-                     req.put.data, 0, req.put.data_len };
-  ssize_t c = document_repo_add(sv->repo, doc);
-  if (c == -1) {
-    return send_ng(so, "could not put the requested document");
-  } else {
-    return send_ok_and_num(so, c, '\n');
+   @brief getr メッセージを受信
+
+   @details getr メッセージの形式 (getr 空白 まですでに読み込み済み) 
+
+   getr 空白 TOP_K 空白 QUERY_LEN QUERY
+
+   TOP_Kは密度の高い順に何件返すか,
+   QUERY_LENはQUERYの長さ(バイト数)
+
+ */
+static request_t server_recv_message_getr(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* TOP_Kを受信 */
+  ssize_t top_k = recv_num(rb);
+  if (top_k == -1) return req;
+  /* QUERY_LEN + QUERYを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
   }
-}
+  query[query_len] = 0;
 
-/** 検索結果のスニペットに含める, 出現部分に先立つバイト数 */
-static const size_t snippet_prefix_len = 12;
-/** 検索結果のスニペットに含める, 出現部分に続くバイト数 */
-static const size_t snippet_suffix_len = 12;
+  req.kind = request_kind_getr;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  req.get.n = top_k;
+  return req;
+}
 
 /**
-   @brief getメッセージを処理
-   @return 1 (成功) または 0 (失敗)
-  */
-static int connection_handle_getc(request_t req, int so, server_t * sv) {
-  char * q = req.get.query;
+   @brief getd メッセージを受信
+
+   @details getd メッセージの形式 (getd 空白 まですでに読み込み済み) 
+
+   getd 空白 TOP_N 空白 QUERY_LEN QUERY
+
+   TOP_Nは出現回数の多い順に何件返すか(0なら全て),
+   QUERY_LENはQUERYの長さ(バイト数)
+
+ */
+static request_t server_recv_message_getd(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* TOP_Nを受信 */
+  ssize_t top_n = recv_num(rb);
+  if (top_n == -1) return req;
+  /* QUERY_LEN + QUERYを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
+  query[query_len] = 0;
+
+  req.kind = request_kind_getd;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  req.get.n = top_n;
+  return req;
+}
+
+/**
+   @brief getl メッセージを受信
+
+   @details getl メッセージの形式 (getl 空白 まですでに読み込み済み) 
+
+   getl 空白 MATCH 空白 QUERY_LEN QUERY
+
+   MATCHは exact (ラベル全体が一致), prefix (ラベルがQUERYで始まる),
+   substr (ラベルがQUERYを含む) のいずれか.
+   QUERY_LENはQUERYの長さ(バイト数)
+
+ */
+static request_t server_recv_message_getl(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* MATCHを受信 */
+  char match[max_inst_len + 1];
+  memset(match, 0, max_inst_len + 1);
+  ssize_t match_len = recv_until_ws(rb, max_inst_len, match);
+  if (match_len <= 0) return req;
+  if (!isspace(match[match_len - 1])) return req;
+  match[match_len - 1] = 0;
+  if (strcasecmp(match, "exact") == 0) {
+    req.get.match = label_match_exact;
+  } else if (strcasecmp(match, "prefix") == 0) {
+    req.get.match = label_match_prefix;
+  } else if (strcasecmp(match, "substr") == 0) {
+    req.get.match = label_match_substr;
+  } else {
+    fprintf(stderr, "invalid label match [%s]\n", match);
+    return req;
+  }
+  /* QUERY_LEN + QUERYを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
+  query[query_len] = 0;
+
+  req.kind = request_kind_getl;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  return req;
+}
+
+/**
+   @brief getdoc メッセージを受信
+
+   @details getdoc メッセージの形式 (getdoc 空白 まですでに読み込み済み) 
+
+   getdoc 空白 DOC_ID 空白 OFFSET 空白 LEN 空白
+
+   DOC_IDはドキュメント番号(putが返した番号), OFFSET, LENは
+   読み出す範囲の先頭と長さ(バイト数). LENが0ならドキュメントの
+   終わりまで
+
+ */
+static request_t server_recv_message_getdoc(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  ssize_t doc = recv_num(rb);
+  if (doc == -1) return req;
+  ssize_t offset = recv_num(rb);
+  if (offset == -1) return req;
+  ssize_t len = recv_num(rb);
+  if (len == -1) return req;
+
+  req.kind = request_kind_getdoc;
+  req.getdoc.doc = doc;
+  req.getdoc.offset = offset;
+  req.getdoc.len = len;
+  return req;
+}
+
+/**
+   @brief getlabel メッセージを受信
+
+   @details getlabel メッセージの形式 (getlabel 空白 まですでに読み込み済み) 
+
+   getlabel 空白 LABEL_LEN LABEL
+
+   LABEL_LENはLABELの長さ(バイト数)
+
+ */
+static request_t server_recv_message_getlabel(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* LABEL_LEN + LABELを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
+  query[query_len] = 0;
+
+  req.kind = request_kind_getlabel;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  return req;
+}
+
+/**
+   @brief complete メッセージを受信
+
+   @details complete メッセージの形式 (complete 空白 まですでに読み込み済み) 
+
+   complete 空白 TOP_N 空白 PREFIX_LEN PREFIX
+
+   TOP_Nは出現回数の多い順に何件返すか(0なら全て),
+   PREFIX_LENはPREFIX(補完する単語の先頭)の長さ(バイト数)
+
+ */
+static request_t server_recv_message_complete(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* TOP_Nを受信 */
+  ssize_t top_n = recv_num(rb);
+  if (top_n == -1) return req;
+  /* PREFIX_LEN + PREFIXを受信 */
+  ssize_t query_len = recv_num(rb);
+  if (query_len == -1) return req;
+  /* allocate the buffer for the payload */
+  char * query = malloc_or_err(query_len + 1);
+  if (!query) return req;
+  /* receive the payload */
+  ssize_t r = recv_bytes(rb, query_len, query);
+  if (r != query_len) {
+    my_free(query);
+    return req;
+  }
+  query[query_len] = 0;
+
+  req.kind = request_kind_complete;
+  req.get.query_len = query_len;
+  req.get.query = query;
+  req.get.n = top_n;
+  return req;
+}
+
+/**
+   @brief near メッセージを受信
+
+   @details near メッセージの形式 (near 空白 まですでに読み込み済み) 
+
+   near 空白 WINDOW 空白 QUERY0_LEN QUERY0 空白 QUERY1_LEN QUERY1
+
+   WINDOWは2つの文字列の出現位置の差の上限(バイト数),
+   QUERY0_LEN, QUERY1_LENはそれぞれQUERY0, QUERY1の長さ(バイト数)
+
+ */
+static request_t server_recv_message_near(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  for (int k = 0; k < 2; k++) {
+    req.near.query[k] = 0;
+    req.near.query_len[k] = 0;
+  }
+  /* WINDOWを受信 */
+  ssize_t window = recv_num(rb);
+  req.near.window = window;
+  if (window == -1) return req;
+  for (int k = 0; k < 2; k++) {
+    if (k == 1) {
+      /* QUERY0 後の空白を受信 */
+      char ws[1];
+      ssize_t r = recv_bytes(rb, 1, ws);
+      if (r != 1) break;
+      if (!isspace(ws[0])) {
+        fprintf(stderr,
+                "expected a whitespace but received %c after query (%s)\n",
+                ws[0], req.near.query[0]);
+        break;
+      }
+    }
+    /* QUERY_LEN + QUERYを受信 */
+    ssize_t query_len = recv_num(rb);
+    if (query_len == -1) break;
+    /* allocate the buffer for the payload */
+    char * query = malloc_or_err(query_len + 1);
+    if (!query) break;
+    /* receive the payload */
+    ssize_t r = recv_bytes(rb, query_len, query);
+    query[r > 0 ? r : 0] = 0;
+    req.near.query[k] = query;
+    req.near.query_len[k] = query_len;
+    if (r != query_len) break;
+    if (k == 1) req.kind = request_kind_near;
+  }
+  if (req.kind == request_kind_invalid) {
+    my_free(req.near.query[0]);
+    my_free(req.near.query[1]);
+  }
+  return req;
+}
+
+static request_t server_recv_message_save(recv_buf_t * rb) {
+  (void)rb;
+  request_t req;
+  req.kind = request_kind_save;
+  return req;
+}
+
+/**
+   @brief limit メッセージを受信
+
+   @details limit メッセージの形式 (limit 空白 まですでに読み込み済み) 
+
+   limit 空白 TIMEOUT_MS 空白 MAX_RESULTS
+
+   以降この接続の各リクエストを TIMEOUT_MS ミリ秒, MAX_RESULTS 件
+   で打ち切る(0なら上限無し)
+ */
+static request_t server_recv_message_limit(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+  ssize_t timeout_ms = recv_num(rb);
+  if (timeout_ms == -1) return req;
+  ssize_t max_results = recv_num(rb);
+  if (max_results == -1) return req;
+  req.kind = request_kind_limit;
+  req.limit.timeout_ms = timeout_ms;
+  req.limit.max_results = max_results;
+  return req;
+}
+
+/**
+   @brief filter メッセージを受信
+
+   @details filter メッセージの形式 (filter 空白 まですでに読み込み済み) 
+
+   filter 空白 DOC_BEGIN 空白 DOC_END 空白 PREFIX_LEN 空白 PREFIX 空白
+
+   以降この接続の get, geto, getc, getd, near は, 番号が DOC_BEGIN 以上
+   DOC_END 未満(DOC_ENDが0なら上限無し)で, ラベルが PREFIX で始まる
+   (PREFIX_LENが0なら条件無し)ドキュメントだけを検索する.
+   PREFIX_LENはPREFIXの長さ(バイト数)
+ */
+static request_t server_recv_message_filter(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+  ssize_t doc_begin = recv_num(rb);
+  if (doc_begin == -1) return req;
+  ssize_t doc_end = recv_num(rb);
+  if (doc_end == -1) return req;
+  /* PREFIX_LEN + PREFIXを受信 */
+  ssize_t prefix_len = recv_num(rb);
+  if (prefix_len == -1) return req;
+  char * prefix = 0;
+  if (prefix_len > 0) {
+    prefix = malloc_or_err(prefix_len + 1);
+    if (!prefix) return req;
+    ssize_t r = recv_bytes(rb, prefix_len, prefix);
+    if (r != prefix_len) {
+      my_free(prefix);
+      return req;
+    }
+    prefix[prefix_len] = 0;
+  }
+  /* PREFIX 後の空白を受信(次のリクエストと区切る) */
+  char ws[1];
+  ssize_t r = recv_bytes(rb, 1, ws);
+  if (r != 1 || !isspace(ws[0])) {
+    if (r == 1) {
+      fprintf(stderr, "expected a whitespace but received %c after label prefix\n",
+              ws[0]);
+    }
+    my_free(prefix);
+    return req;
+  }
+  req.kind = request_kind_filter;
+  req.filter.doc_begin = doc_begin;
+  req.filter.doc_end = doc_end;
+  req.filter.label_prefix = prefix;
+  req.filter.label_prefix_len = prefix_len;
+  return req;
+}
+
+/**
+   @brief freeze メッセージを受信
+ */
+static request_t server_recv_message_freeze(recv_buf_t * rb) {
+  (void)rb;
+  request_t req;
+  req.kind = request_kind_freeze;
+  return req;
+}
+
+/**
+   @brief dups, dupsr メッセージを受信
+
+   @details dups, dupsr メッセージの形式 (dups 空白 まですでに読み込み済み) 
+
+   dups 空白 MIN_LEN
+
+   dupsr 空白 TOP_N
+
+   dups は MIN_LEN バイト以上の共通部分を持つドキュメントの組を
+   求めるジョブを始める. dupsr はその結果のうち共有する部分の多い
+   上位 TOP_N 件(0なら全て)を返す.
+ */
+static request_t server_recv_message_dups(recv_buf_t * rb, request_kind_t kind) {
+  request_t req;
+  req.kind = request_kind_invalid;
+  ssize_t n = recv_num(rb);
+  if (n == -1) return req;
+  req.kind = kind;
+  req.dups.n = n;
+  return req;
+}
+
+/** 
+    @brief 受信したバイト列(rb)からリクエストメッセージをひとつ読む.
+
+    @details 現在は以下の3種類 (空白 は ' ' でも '\\n' でもよい. isspaceが1を返す任意の文字)
+   
+   (1) quit 空白
+
+   (2) put 空白 LABEL_LEN 空白 LABEL 空白 DATA_LEN DATA
+
+   (3) get 空白 QUERY_LEN 空白 QUERY
+
+ */
+
+static request_t server_recv_message(recv_buf_t * rb) {
+  request_t req;
+  req.kind = request_kind_invalid;
+  char inst[max_inst_len + 1];
+  /* clear all bytes in inst */
+  memset(inst, 0, max_inst_len + 1);
+  /* get a line */
+  ssize_t inst_len = recv_until_ws(rb, max_inst_len, inst);
+  /* error? -> return invalid */
+  if (inst_len <= 0) return req;
+  /* could not get a line */
+  if (!isspace(inst[inst_len - 1])) return req;
+  inst[inst_len - 1] = 0;
+  /* parse the instruction (quit, get or put) */
+  if (strcasecmp(inst, "quit") == 0) {
+    return server_recv_message_quit(rb);
+  } else if (strcasecmp(inst, "discon") == 0) {
+    return server_recv_message_discon(rb);
+  } else if (strcasecmp(inst, "dumpc") == 0) {
+    return server_recv_message_dumpc(rb);
+  } else if (strcasecmp(inst, "dump") == 0) {
+    return server_recv_message_dump(rb);
+  } else if (strcasecmp(inst, "put") == 0) {
+    return server_recv_message_put(rb);
+  } else if (strcasecmp(inst, "getc") == 0) {
+    return server_recv_message_getc(rb);
+  } else if (strcasecmp(inst, "getd") == 0) {
+    return server_recv_message_getd(rb);
+  } else if (strcasecmp(inst, "gets") == 0) {
+    return server_recv_message_gets(rb);
+  } else if (strcasecmp(inst, "getr") == 0) {
+    return server_recv_message_getr(rb);
+  } else if (strcasecmp(inst, "getl") == 0) {
+    return server_recv_message_getl(rb);
+  } else if (strcasecmp(inst, "getdoc") == 0) {
+    return server_recv_message_getdoc(rb);
+  } else if (strcasecmp(inst, "getlabel") == 0) {
+    return server_recv_message_getlabel(rb);
+  } else if (strcasecmp(inst, "complete") == 0) {
+    return server_recv_message_complete(rb);
+  } else if (strcasecmp(inst, "near") == 0) {
+    return server_recv_message_near(rb);
+  } else if (strcasecmp(inst, "explain") == 0) {
+    return server_recv_message_explain(rb);
+  } else if (strcasecmp(inst, "get") == 0) {
+    return server_recv_message_get(rb);
+  } else if (strcasecmp(inst, "geto") == 0) {
+    return server_recv_message_geto(rb);
+  } else if (strcasecmp(inst, "save") == 0) {
+    return server_recv_message_save(rb);
+  } else if (strcasecmp(inst, "freeze") == 0) {
+    return server_recv_message_freeze(rb);
+  } else if (strcasecmp(inst, "limit") == 0) {
+    return server_recv_message_limit(rb);
+  } else if (strcasecmp(inst, "filter") == 0) {
+    return server_recv_message_filter(rb);
+  } else if (strcasecmp(inst, "dups") == 0) {
+    return server_recv_message_dups(rb, request_kind_dups);
+  } else if (strcasecmp(inst, "dupsr") == 0) {
+    return server_recv_message_dups(rb, request_kind_dupsr);
+  } else {
+    fprintf(stderr, "invalid command [%s]\n", inst);
+  }
+  return req;
+}
+
+/**
+   @brief 受信したバイト列(rb)の先頭からリクエストをひとつ読む
+   @return 1 (*req にリクエストを得た. 無効なものを含む) または
+   0 (リクエストの途中までしか届いていない)
+
+   @details 読めたらその分を rb から取り除く. 途中までしか届いて
+   いなければ rb はそのままにし, rb->need バイト届いたら呼び直す.
+   ただし相手が送信を終えていれば無効なリクエストとする.
+  */
+static int server_parse_message(recv_buf_t * rb, request_t * req) {
+  rb->pos = 0;
+  rb->need = 0;
+  *req = server_recv_message(rb);
+  if (rb->need) {
+    if (!rb->eof) return 0;
+    if (rb->n) {
+      fprintf(stderr,
+              "premature end of stream. expected %ld bytes"
+              " but ended with %ld bytes\n", rb->need, rb->n);
+    }
+    req->kind = request_kind_invalid;
+    rb->pos = rb->n;
+  }
+  recv_buf_consume(rb, rb->pos);
+  return 1;
+}
+
+/**
+   @brief put で各複製に加えるドキュメント
+  */
+typedef struct {
+  document_t docs[2];           /**< 複製ごとのドキュメント */
+  int next;                     /**< 次に加える docs の添字 */
+} server_put_arg_t;
+
+/**
+   @brief server_write で各複製にドキュメントを加える
+  */
+static long server_put_op(document_repo_t * repo, void * arg_) {
+  server_put_arg_t * arg = arg_;
+  return document_repo_add(repo, arg->docs[arg->next++]);
+}
+
+/**
+   @brief putメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_put(request_t req, int so, server_t * sv) {
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "put label[%ld]=[%s] data[%ld]=[...]\n",
+            req.put.label_len, req.put.label,
+            req.put.data_len); // , req.put.data
+    fflush(sv->log_wp);
+  }
+  /* dups のジョブがsuffix arrayを辿っている間は追加しない */
+  pthread_mutex_lock(sv->dups->mu);
+  int busy = (sv->dups->state == dups_job_running);
+  pthread_mutex_unlock(sv->dups->mu);
+  if (busy) {
+    my_free(req.put.label);
+    my_free(req.put.data);
+    return send_ng(so, "a dups job is running");
+  }
+  /* 複製ごとのドキュメント(document_repo_add が開放する)を作る */
+  server_put_arg_t arg[1];
+  arg->next = 0;
+  for (int i = 0; i < sv->n_repos; i++) {
+    document_t doc = { req.put.label, 0, req.put.label_len, 
+                       req.put.data, 0, req.put.data_len };
+    if (i > 0) {
+      doc.label = malloc_or_err(req.put.label_len + 1);
+      doc.data = malloc_or_err(req.put.data_len + 1);
+      if (!doc.label || !doc.data) {
+        my_free(doc.label);
+        my_free(doc.data);
+        for (int j = 0; j < i; j++) {
+          my_free(arg->docs[j].label);
+          my_free(arg->docs[j].data);
+        }
+        return send_ng(so, "could not put the requested document");
+      }
+      memcpy(doc.label, req.put.label, req.put.label_len + 1);
+      memcpy(doc.data, req.put.data, req.put.data_len + 1);
+    }
+    arg->docs[i] = doc;
+  }
+  ssize_t c = server_write(sv, server_put_op, arg);
+  /* 途中で失敗したら残りの複製のドキュメントは使われていない */
+  for (int i = arg->next; i < sv->n_repos; i++) {
+    my_free(arg->docs[i].label);
+    my_free(arg->docs[i].data);
+  }
+  if (c == -1) {
+    return send_ng(so, "could not put the requested document");
+  } else {
+    return send_ok_and_num(so, c, '\n');
+  }
+}
+
+/** 検索結果のスニペットに含める, 出現部分に先立つバイト数 */
+static const size_t snippet_prefix_len = 12;
+/** 検索結果のスニペットに含める, 出現部分に続くバイト数 */
+static const size_t snippet_suffix_len = 12;
+
+/**
+   @brief 結果の件数 *n を予算の件数の上限までに切り詰める
+   @return 打ち切られたか(件数を切り詰めたか, 期限などで検索が打ち切られたか)
+  */
+static int connection_cap_results(query_budget_t * b, long * n) {
+  int capped = (b->max_results && *n > b->max_results);
+  if (capped) *n = b->max_results;
+  return capped || b->truncated;
+}
+
+/**
+   @brief 接続相手がいなくなったか(検索の取り消しに使う)
+   @return 1 (いなくなった) または 0
+
+   @details ソケットを待たずにpollし, エラーまたは切断(POLLHUP)を
+   調べる. 相手が送信側だけを閉じた(shutdown(SHUT_WR))のは
+   リクエストの終わりでもありうるので取り消しとは見なさない.
+   そのため相手が単にcloseした場合は, こちらから送信して
+   エラーになった後に分かる.
+  */
+static int connection_peer_gone(void * arg) {
+  struct pollfd pfd[1] = { { *(int *)arg, 0, 0 } };
+  if (poll(pfd, 1, 0) <= 0) return 0;
+  return (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+/**
+   @brief 出現位置を含む周辺(スニペット)の範囲 [*start, *end) を求める
+
+   @details 例えば O バイト目に現れたら 
+   (O - snippet_prefix_len) バイト目から
+   (O + 検索文字列長 + snippet_suffix_len - 1) バイト目
+   までとする. ただしドキュメントの先頭や終了を飛び越えないように注意
+  */
+static void get_snippet_range(occurrence_t occ, size_t qlen,
+                              ssize_t * start_, ssize_t * end_) {
+  /* 出現位置 */
+  ssize_t o = occ.offset;
+  /* スニペット先頭. ただし < 0 になったら 0 */
+  ssize_t start = o - snippet_prefix_len;
+  if (start < 0) start = 0;
+  /* スニペット終わり. ただし >= ドキュメント長 になったらドキュメント長  */
+  ssize_t end = o + qlen + snippet_suffix_len;
+  if (end > (ssize_t)occ.doc.data_len) end = occ.doc.data_len;
+  *start_ = start;
+  *end_ = end;
+}
+
+/**
+   @brief 出現 occ をget の返事の1レコードとして送信
+   @return 1 (成功) または 0 (失敗)
+
+   @details 形式: LABEL_LEN LABEL OFFSET SNIPPET_LEN SNIPPET <改行>
+  */
+static int send_occurrence(int so, occurrence_t occ, size_t qlen,
+                           char * labels_base, char * data_base) {
+  /* 出現位置を含む周辺(スニペット)を返す */
+  ssize_t start, end;
+  get_snippet_range(occ, qlen, &start, &end);
+  /* ラベル長 ラベル, 出現位置, スニペット長 スニペット を送信 */
+  return (send_num(so, occ.doc.label_len, ' ')
+          && send_all(so, labels_base + occ.doc.label_o, occ.doc.label_len)
+          && send_all(so, " ", 1)
+          && send_num(so, occ.offset, ' ')
+          && send_num(so, end - start, ' ')
+          && send_all(so, data_base + occ.doc.data_o + start, end - start)
+          && send_all(so, "\n", 1));
+}
+
+/** @brief getを並列に処理する最小の範囲(suffix arrayの要素数) */
+static const long get_parallel_min = 1 << 16;
+/** @brief getを並列に処理する際, スレッドが一度に取る範囲(suffix arrayの要素数) */
+static const long get_parallel_chunk = 1 << 13;
+/** @brief getを並列に処理する最大のスレッド数 */
+static const long get_parallel_max_threads = 8;
+/** @brief 送信し終えたチャンクより先にスレッドあたり何個のチャンクを作っておくか */
+static const long get_parallel_ahead = 4;
+
+/**
+   @brief 送信する返事を溜めておくバッファ
+  */
+typedef struct {
+  char * a;                     /**< 返事 */
+  long n;                       /**< aの長さ */
+  long sz;                      /**< aの容量 */
+  long * ends;                  /**< 各レコードの終わり(a中の位置) */
+  long n_records;               /**< レコード数 */
+  long ends_sz;                 /**< endsの容量 */
+  int error;                    /**< メモリ割り当てに失敗したら1 */
+} reply_buf_t;
+
+/**
+   @brief reply_buf_t の末尾に s[0:len] を追加
+  */
+static void reply_buf_append(reply_buf_t * rb, char * s, long len) {
+  if (rb->error) return;
+  if (rb->n + len > rb->sz) {
+    long sz = (rb->n + len) * 2;
+    char * a = realloc(rb->a, sz);
+    if (!a) {
+      api_err("realloc");
+      rb->error = 1;
+      return;
+    }
+    rb->a = a;
+    rb->sz = sz;
+  }
+  memcpy(rb->a + rb->n, s, len);
+  rb->n += len;
+}
+
+/**
+   @brief reply_buf_t の末尾に数字 x と空白文字 ws を追加
+  */
+static void reply_buf_append_num(reply_buf_t * rb, long x, int ws) {
+  char s[24];
+  int n = sprintf(s, "%ld%c", x, ws);
+  reply_buf_append(rb, s, n);
+}
+
+/**
+   @brief reply_buf_t のレコードを終える(ここまでを1レコードとする)
+  */
+static void reply_buf_end_record(reply_buf_t * rb) {
+  if (rb->error) return;
+  if (rb->n_records == rb->ends_sz) {
+    long sz = 2 * rb->ends_sz + 16;
+    long * ends = realloc(rb->ends, sizeof(long) * sz);
+    if (!ends) {
+      api_err("realloc");
+      rb->error = 1;
+      return;
+    }
+    rb->ends = ends;
+    rb->ends_sz = sz;
+  }
+  rb->ends[rb->n_records++] = rb->n;
+}
+
+/**
+   @brief reply_buf_t のメモリを開放する
+  */
+static void reply_buf_destroy(reply_buf_t * rb) {
+  free(rb->a);
+  free(rb->ends);
+}
+
+/**
+   @brief 出現 occ を get の返事の1レコード(send_occurrence と同じ形式)
+   として reply_buf_t の末尾に追加
+  */
+static void reply_buf_append_occurrence(reply_buf_t * rb, occurrence_t occ, size_t qlen,
+                                        char * labels_base, char * data_base) {
+  ssize_t start, end;
+  get_snippet_range(occ, qlen, &start, &end);
+  reply_buf_append_num(rb, occ.doc.label_len, ' ');
+  reply_buf_append(rb, labels_base + occ.doc.label_o, occ.doc.label_len);
+  reply_buf_append(rb, " ", 1);
+  reply_buf_append_num(rb, occ.offset, ' ');
+  reply_buf_append_num(rb, end - start, ' ');
+  reply_buf_append(rb, data_base + occ.doc.data_o + start, end - start);
+  reply_buf_append(rb, "\n", 1);
+  reply_buf_end_record(rb);
+}
+
+/** @brief getで件数を送る前に溜めておく返事の最大のバイト数
+    (越えたら件数を document_repo_queryc で別に数える) */
+static const long get_buffer_max = 1 << 23;
+
+/**
+   @brief 実行中の get, geto, getc (他の接続が同じ検索を待っている場合がある)
+
+   @sa single_flight_begin
+
+   @details 同じ種類, 検索文字列, レポジトリの版(version), 結果件数の
+   上限の検索は同じ結果になるので, 実行中のものがあれば後から来た
+   接続はその結果を待って共有する. 結果は getc なら件数, get, geto なら
+   送る返事のレコード(rb)である.
+  */
+typedef struct single_flight {
+  struct single_flight * next;  /**< server_t の flights の次の要素 */
+  request_kind_t kind;          /**< 検索の種類 */
+  char * query;                 /**< 検索文字列(実行する接続のもの) */
+  size_t query_len;             /**< queryの長さ */
+  long version;                 /**< 検索した時のレポジトリの version */
+  long max_results;             /**< 結果件数の上限 */
+  int done;                     /**< 実行を終えたら1 */
+  int shared;                   /**< 結果を共有できたら1(0なら待った接続も各自が実行する) */
+  long count;                   /**< 結果の件数 */
+  int truncated;                /**< 結果が(件数の上限で)打ち切られたか */
+  reply_buf_t rb;               /**< get, geto の返事のレコード */
+  int refs;                     /**< この要素を使っている接続の数 */
+} single_flight_t;
+
+/**
+   @brief 検索を実行中のものとして登録する. 同じ検索が実行中ならそれを返す
+   @return 登録した, または見つけた要素. 共有しない検索なら0
+
+   @details *leader を, 登録した(この接続が実行する)なら1, 見つけた
+   (single_flight_wait で結果を待つ)なら0にする. いずれの場合も使い
+   終えたら single_flight_release を呼ぶ. 複数の接続が同時に
+   走るのはスレッドを使う(-t 1 または -w N)場合だけなので, そうでなければ
+   何もしない. filter が設定された検索は共有しない.
+  */
+static single_flight_t * single_flight_begin(server_t * sv, document_repo_t * repo,
+                                             request_kind_t kind,
+                                             char * q, size_t qlen,
+                                             query_session_t * qs, int * leader) {
+  if (sv->n_repos == 1 || qs->filter) return 0;
+  long version = repo->version;
+  long max_results = (qs->budget ? qs->budget->max_results : 0);
+  pthread_mutex_lock(sv->flights_mu);
+  single_flight_t * fl;
+  for (fl = sv->flights; fl; fl = fl->next) {
+    if (fl->kind == kind && fl->version == version
+        && fl->max_results == max_results
+        && fl->query_len == qlen && memcmp(fl->query, q, qlen) == 0) {
+      break;
+    }
+  }
+  if (fl) {
+    fl->refs++;
+    *leader = 0;
+  } else {
+    fl = calloc(1, sizeof(single_flight_t));
+    if (fl) {
+      fl->kind = kind;
+      fl->query = q;
+      fl->query_len = qlen;
+      fl->version = version;
+      fl->max_results = max_results;
+      fl->refs = 1;
+      fl->next = sv->flights;
+      sv->flights = fl;
+      *leader = 1;
+    } else {
+      api_err("calloc");
+    }
+  }
+  pthread_mutex_unlock(sv->flights_mu);
+  return fl;
+}
+
+/**
+   @brief 実行した接続が結果を書き終えたことを通知する
+
+   @details shared が1なら fl の count, truncated, rb を待っている接続が
+   使える. 0なら待っている接続は各自が実行する. 以後 fl は新しい
+   接続からは見つからない(fl->query は実行した接続が開放してよい).
+  */
+static void single_flight_finish(server_t * sv, single_flight_t * fl, int shared) {
+  pthread_mutex_lock(sv->flights_mu);
+  single_flight_t ** p = &sv->flights;
+  while (*p != fl) p = &(*p)->next;
+  *p = fl->next;
+  fl->query = 0;
+  fl->done = 1;
+  fl->shared = shared;
+  pthread_cond_broadcast(sv->flights_cv);
+  pthread_mutex_unlock(sv->flights_mu);
+}
+
+/**
+   @brief 実行中の検索の結果を待つ
+   @return 1 (結果を共有できる) または 0 (各自が実行する)
+
+   @details 予算(b)に期限があれば期限までしか待たない(その後に実行
+   すれば直ちに打ち切られる).
+  */
+static int single_flight_wait(server_t * sv, single_flight_t * fl, query_budget_t * b) {
+  long deadline_us = (b ? b->deadline_us : 0);
+  struct timespec ts[1] = { { deadline_us / 1000000, (deadline_us % 1000000) * 1000 } };
+  int timed_out = 0;
+  pthread_mutex_lock(sv->flights_mu);
+  while (!fl->done && !timed_out) {
+    if (deadline_us) {
+      timed_out = (pthread_cond_timedwait(sv->flights_cv, sv->flights_mu, ts) == ETIMEDOUT);
+    } else {
+      pthread_cond_wait(sv->flights_cv, sv->flights_mu);
+    }
+  }
+  int shared = fl->done && fl->shared;
+  pthread_mutex_unlock(sv->flights_mu);
+  return shared;
+}
+
+/**
+   @brief single_flight_begin で得た要素を使い終える(最後なら開放する)
+  */
+static void single_flight_release(server_t * sv, single_flight_t * fl) {
+  pthread_mutex_lock(sv->flights_mu);
+  int refs = --fl->refs;
+  pthread_mutex_unlock(sv->flights_mu);
+  if (refs == 0) {
+    reply_buf_destroy(&fl->rb);
+    free(fl);
+  }
+}
+
+/**
+   @brief getcメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_getc(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
   size_t qlen = req.get.query_len;
   if (sv->log_wp) {
     fprintf(sv->log_wp, "getc query[%ld]=[%s]\n", qlen, q);
     fflush(sv->log_wp);
   }
-  /* 検索を実行 */
-  size_t c = document_repo_queryc(sv->repo, q, qlen);
-  my_free(q);
-  return send_ok_and_num(so, c, '\n');
+  /* 同じ検索を実行中の接続があればその結果を待つ */
+  int leader = 0;
+  single_flight_t * fl = single_flight_begin(sv, repo, req.kind, q, qlen, qs, &leader);
+  if (fl && !leader) {
+    int shared = single_flight_wait(sv, fl, qs->budget);
+    long c = fl->count;
+    int truncated = fl->truncated;
+    single_flight_release(sv, fl);
+    if (shared) {
+      my_free(q);
+      return send_ok_and_count(so, c, truncated);
+    }
+    fl = 0;
+  }
+  /* 検索を実行 */
+  size_t c = document_repo_queryc(repo, qs, q, qlen);
+  if (fl) {
+    /* 打ち切られた結果は共有しない */
+    fl->count = c;
+    single_flight_finish(sv, fl, !qs->budget->truncated);
+    single_flight_release(sv, fl);
+  }
+  my_free(q);
+  return send_ok_and_count(so, c, qs->budget->truncated);
+}
+
+/**
+   @brief getの並列処理で, 1チャンク(suffix arrayの範囲の一部)の結果
+  */
+typedef struct {
+  reply_buf_t rb;               /**< このチャンクの出現のレコード */
+  int done;                     /**< 作り終えたら1 */
+} get_chunk_t;
+
+/**
+   @brief getの並列処理の全スレッドが共有するデータ
+
+   @details 各スレッドは次のチャンク(next_chunk)を取っては, その範囲の
+   出現のドキュメントを求め, レコードを作ってチャンクのバッファに溜める.
+   先に終わったスレッドが残りのチャンクを取っていくので, 出現の
+   多い範囲に偏っていても負荷は均される. 呼び出したスレッドは
+   チャンクを順に待って送信する. 送信が遅い場合にメモリを使い
+   過ぎないように, 送信し終えたチャンクから ahead 個先までしか作らない.
+  */
+typedef struct {
+  query_result_t * qr;          /**< 検索結果 */
+  size_t qlen;                  /**< 検索文字列の長さ */
+  char * labels_base;           /**< ラベルの先頭 */
+  char * data_base;             /**< ドキュメントの先頭 */
+  long begin;                   /**< 範囲 qr->occurrences[begin:end] を処理する */
+  long end;                     /**< 範囲の終わり */
+  get_chunk_t * chunks;         /**< チャンク */
+  long n_chunks;                /**< チャンク数 */
+  long next_chunk;              /**< 次にスレッドが取るチャンク */
+  long sent_chunk;              /**< 送信し終えたチャンク数 */
+  long ahead;                   /**< sent_chunk + ahead 未満のチャンクだけ作る */
+  int stop;                     /**< 送信をやめたら1 */
+  pthread_mutex_t mu[1];        /**< 以上の変数を守る */
+  pthread_cond_t cv[1];         /**< チャンクを作り終えた, 送信し終えたことの通知 */
+} get_parallel_t;
+
+/**
+   @brief getの並列処理で, k 番目のチャンクの出現のレコードを作る
+  */
+static void get_parallel_format(get_parallel_t * gp, long k) {
+  long b = gp->begin + (gp->end - gp->begin) * k / gp->n_chunks;
+  long e = gp->begin + (gp->end - gp->begin) * (k + 1) / gp->n_chunks;
+  reply_buf_t * rb = &gp->chunks[k].rb;
+  query_result_t part = query_result_part(gp->qr, b, e);
+  while (!rb->error) {
+    occurrence_t occ = query_result_next(&part);
+    if (occ.offset == -1) break;
+    reply_buf_append_occurrence(rb, occ, gp->qlen, gp->labels_base, gp->data_base);
+  }
+}
+
+/**
+   @brief getの並列処理の各スレッドが実行する関数
+  */
+static void * get_parallel_thread(void * arg) {
+  get_parallel_t * gp = arg;
+  pthread_mutex_lock(gp->mu);
+  while (1) {
+    while (!gp->stop && gp->next_chunk < gp->n_chunks
+           && gp->next_chunk >= gp->sent_chunk + gp->ahead) {
+      pthread_cond_wait(gp->cv, gp->mu);
+    }
+    if (gp->stop || gp->next_chunk >= gp->n_chunks) break;
+    long k = gp->next_chunk++;
+    pthread_mutex_unlock(gp->mu);
+    get_parallel_format(gp, k);
+    pthread_mutex_lock(gp->mu);
+    gp->chunks[k].done = 1;
+    pthread_cond_broadcast(gp->cv);
+  }
+  pthread_mutex_unlock(gp->mu);
+  return 0;
+}
+
+/**
+   @brief getの結果(suffix arrayの範囲の残り全て)を複数のスレッドで作り,
+   順に送信する
+   @return 1 (成功) または 0 (失敗)
+
+   @details 送信したレコード数を *cx に加える. 予算(b)の件数の上限に
+   達するか, 期限を過ぎるか取り消されたら(チャンクごとに調べる)やめる.
+   スレッドが作れなければ作れた数で行い, 1つも作れなければ -1 を返す
+   (呼び出し側が逐次に処理する).
+  */
+static int get_send_parallel(int so, query_result_t * qr, size_t qlen,
+                             query_budget_t * b, size_t * cx) {
+  long T = sysconf(_SC_NPROCESSORS_ONLN);
+  if (T > get_parallel_max_threads) T = get_parallel_max_threads;
+  if (T < 1) T = 1;
+  get_parallel_t gp[1];
+  gp->qr = qr;
+  gp->qlen = qlen;
+  gp->labels_base = qr->repo->labels->a;
+  gp->data_base = qr->repo->data->a;
+  gp->begin = qr->next_occ;
+  gp->end = qr->n_occs;
+  gp->n_chunks = (gp->end - gp->begin + get_parallel_chunk - 1) / get_parallel_chunk;
+  gp->next_chunk = 0;
+  gp->sent_chunk = 0;
+  gp->ahead = T * get_parallel_ahead;
+  gp->stop = 0;
+  gp->chunks = calloc(gp->n_chunks, sizeof(get_chunk_t));
+  pthread_t * tids = malloc_or_err(sizeof(pthread_t) * T);
+  if (!gp->chunks || !tids) {
+    if (!gp->chunks) api_err("calloc");
+    free(gp->chunks);
+    my_free(tids);
+    return -1;
+  }
+  pthread_mutex_init(gp->mu, 0);
+  pthread_cond_init(gp->cv, 0);
+  long t;
+  for (t = 0; t < T; t++) {
+    if (pthread_create(&tids[t], 0, get_parallel_thread, gp)) {
+      api_err("pthread_create");
+      break;
+    }
+  }
+  int ok = (t > 0 ? 1 : -1);
+  for (long k = 0; ok == 1 && k < gp->n_chunks; k++) {
+    get_chunk_t * c = &gp->chunks[k];
+    pthread_mutex_lock(gp->mu);
+    while (!c->done) pthread_cond_wait(gp->cv, gp->mu);
+    pthread_mutex_unlock(gp->mu);
+    reply_buf_t * rb = &c->rb;
+    /* 件数の上限までのレコードを送る */
+    long m = rb->n_records;
+    if (b->max_results && (long)*cx + m > b->max_results) {
+      m = b->max_results - *cx;
+    }
+    long len = (m > 0 ? rb->ends[m - 1] : 0);
+    if (rb->error || !send_all(so, rb->a, len)) {
+      ok = 0;
+    }
+    *cx += m;
+    int capped = (m < rb->n_records);
+    reply_buf_destroy(rb);
+    pthread_mutex_lock(gp->mu);
+    gp->sent_chunk = k + 1;
+    pthread_cond_broadcast(gp->cv);
+    pthread_mutex_unlock(gp->mu);
+    if (capped) break;
+    long steps = (gp->end - gp->begin) / gp->n_chunks;
+    if (query_budget_step(b, steps)) break;
+  }
+  pthread_mutex_lock(gp->mu);
+  gp->stop = 1;
+  pthread_cond_broadcast(gp->cv);
+  pthread_mutex_unlock(gp->mu);
+  for (long u = 0; u < t; u++) {
+    pthread_join(tids[u], 0);
+  }
+  /* 送らなかったチャンク */
+  for (long k = gp->sent_chunk; k < gp->n_chunks; k++) {
+    reply_buf_destroy(&gp->chunks[k].rb);
+  }
+  pthread_cond_destroy(gp->cv);
+  pthread_mutex_destroy(gp->mu);
+  free(gp->chunks);
+  my_free(tids);
+  return ok;
+}
+
+/**
+   @brief getメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details suffix arrayの範囲が小さければ, 結果を1度だけ辿って
+   レコードを溜め, 辿り終えたらその数を件数として送ってから
+   レコードを送る. 溜めた量が get_buffer_max を越えたら(範囲が
+   大きく並列にレコードを作る場合も), 件数を document_repo_queryc で
+   別に数えて送り, 溜めた分に続けて残りを送りながら辿る.
+  */
+static int connection_handle_get(request_t req, int so, server_t * sv,
+                                 document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  /* geto なら結果をドキュメント, 位置の順に返す */
+  int sorted = (req.kind == request_kind_geto);
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "%s query[%ld]=[%s]\n", (sorted ? "geto" : "get"), qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 同じ検索を実行中の接続があればその結果(返事のレコード)を待つ */
+  int leader = 0;
+  single_flight_t * fl = single_flight_begin(sv, repo, req.kind, q, qlen, qs, &leader);
+  if (fl && !leader) {
+    int shared = single_flight_wait(sv, fl, qs->budget);
+    int ok = (!shared
+              || (send_ok_and_count(so, fl->count, fl->truncated)
+                  && send_all(so, fl->rb.a, fl->rb.n)
+                  && send_end(so, fl->truncated)));
+    single_flight_release(sv, fl);
+    if (shared) {
+      my_free(q);
+      return ok;
+    }
+    fl = 0;
+  }
+  /* 検索を実行 */
+  query_result_t qr[1];
+  if (sorted) {
+    if (document_repo_query_sorted(repo, qs, q, qlen, qr) == -1) {
+      if (fl) {
+        single_flight_finish(sv, fl, 0);
+        single_flight_release(sv, fl);
+      }
+      my_free(q);
+      return send_ng(so, "could not allocate memory for the result");
+    }
+  } else {
+    *qr = document_repo_query(repo, qs, q, qlen);
+  }
+  query_budget_t * b = qs->budget;
+  char * labels_base = qr->repo->labels->a;
+  char * data_base   = qr->repo->data->a;
+  /* 範囲が小さければ, 結果を1度だけ辿ってレコードを溜め, 辿り終えたら
+     その数を件数として送る(件数のためにもう一度検索しない) */
+  reply_buf_t own[1] = { { 0, 0, 0, 0, 0, 0, 0 } };
+  reply_buf_t * rb = (fl ? &fl->rb : own);
+  size_t cx = 0;
+  int complete = 0;
+  if (!(qr->occurrences && qr->n_occs - qr->next_occ >= get_parallel_min)) {
+    while (!rb->error && rb->n < get_buffer_max) {
+      occurrence_t occ = query_result_next(qr);
+      if (occ.offset == -1) {
+        complete = 1;
+        break;
+      }
+      cx++;
+      reply_buf_append_occurrence(rb, occ, qlen, labels_base, data_base);
+    }
+  }
+  if (rb->error) complete = 0;
+  if (fl) {
+    /* 期限などで打ち切られた結果は共有しない(件数の上限で打ち切ったものと
+       同じなら共有する). 待っている接続は共有しなければ各自が実行する */
+    int share = (complete
+                 && (!b->truncated || (b->max_results && (long)cx == b->max_results)));
+    fl->count = cx;
+    fl->truncated = b->truncated;
+    single_flight_finish(sv, fl, share);
+  }
+  int ok = 1;
+  if (complete) {
+    ok = (send_ok_and_count(so, cx, b->truncated)
+          && send_all(so, rb->a, rb->n)
+          && send_end(so, b->truncated));
+  } else if (rb->error) {
+    ok = send_ng(so, "could not allocate memory for the result");
+  }
+  if (complete || rb->error) {
+    if (fl) single_flight_release(sv, fl);
+    else reply_buf_destroy(own);
+    query_result_destroy(qr);
+    my_free(q);
+    return ok;
+  }
+  /* 溜めきれなかった(または範囲が大きい)ので件数を別に数え,
+     溜めた分に続けて残りを送りながら辿る */
+  size_t c = document_repo_queryc(repo, qs, q, qlen);
+  /* 件数の上限を超える分は返さない(query_result_nextが打ち切る) */
+  int capped = (b->max_results && (long)c > b->max_results);
+  if (capped) c = b->max_results;
+  ok = (send_ok_and_count(so, c, capped || b->truncated)
+        && send_all(so, rb->a, rb->n));
+  if (fl) single_flight_release(sv, fl);
+  else reply_buf_destroy(own);
+  if (!ok) {
+    query_result_destroy(qr);
+    my_free(q);
+    return 0;
+  }
+  
+  /* 結果(出現位置)を順に取り出して返事を送信. 形式:
+
+     (LABEL_LEN LABEL <改行> SNIPPET_LEN SNIPPET <改行>)* 0
+
+     LABEL_LEN, SNIPPET_LENはそれぞれLABEL, SNIPPETの長さ(バイト数)
+     
+ */
+  if (qr->occurrences && qr->n_occs - qr->next_occ >= get_parallel_min) {
+    /* 範囲が大きければ複数のスレッドでレコードを作る */
+    int r = get_send_parallel(so, qr, qlen, b, &cx);
+    if (r == 0) {
+      query_result_destroy(qr);
+      my_free(q);
+      return 0;
+    }
+    if (r == 1) {
+      /* 件数の上限で打ち切った */
+      if (capped) b->truncated = 1;
+      qr->next_occ = qr->n_occs;
+    }
+  }
+  while (1) {
+    occurrence_t occ = query_result_next(qr);
+    if (occ.offset == -1) break;
+    cx++;
+    if (!send_occurrence(so, occ, qlen, labels_base, data_base)) {
+      query_result_destroy(qr);
+      my_free(q);
+      return 0;
+    }
+  }
+  if (cx != c && !b->truncated) {
+    fprintf(stderr, "occurrence count did not match (before: %ld after: %ld)\n",
+            c, cx);
+  }
+  query_result_destroy(qr);
+  my_free(q);
+  return send_end(so, b->truncated);
+}
+
+/**
+   @brief getsメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details 検索文字列の出現を無作為に K 個(出現がK個未満なら全て)選び,
+   ドキュメント, 位置の順に get と同じ形式で返す. 手間は出現の総数に
+   よらない(document_repo_query_sample を参照)
+  */
+static int connection_handle_gets(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  long k = req.get.n;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "gets k=%ld query[%ld]=[%s]\n", k, qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  query_result_t qr[1];
+  if (document_repo_query_sample(repo, qs, q, qlen, k, qr) == -1) {
+    my_free(q);
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  long n = qr->n_occs;
+  query_budget_t * b = qs->budget;
+  int capped = connection_cap_results(b, &n);
+  int ok = send_ok_and_count(so, n, capped || b->truncated);
+  char * labels_base = repo->labels->a;
+  char * data_base   = repo->data->a;
+  while (ok) {
+    occurrence_t occ = query_result_next(qr);
+    if (occ.offset == -1) break;
+    ok = send_occurrence(so, occ, qlen, labels_base, data_base);
+  }
+  query_result_destroy(qr);
+  my_free(q);
+  return ok && send_end(so, b->truncated);
+}
+
+/**
+   @brief getrメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details 検索文字列の密度(出現回数 / ドキュメント長)の高い順に上位
+   TOP_K 件のドキュメントを返す. スニペットは各ドキュメントの最初の
+   出現についてだけ作る. 返事の形式:
+
+     OK N <改行>
+     (LABEL_LEN LABEL DOC_ID COUNT SCORE OFFSET SNIPPET_LEN SNIPPET <改行>)*
+     0 <改行>
+
+   SCOREは密度, OFFSETは最初の出現の位置
+  */
+static int connection_handle_getr(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  long top_k = req.get.n;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "getr top_k=%ld query[%ld]=[%s]\n", top_k, qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  doc_score_t * ds = 0;
+  long n = document_repo_queryr(repo, qs, q, qlen, top_k, &ds);
+  my_free(q);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(ds);
+    return 0;
+  }
+  char * labels_base = repo->labels->a;
+  char * data_base   = repo->data->a;
+  for (long i = 0; i < n; i++) {
+    document_t doc = document_repo_get_doc(repo, ds[i].doc);
+    occurrence_t occ = { doc, ds[i].offset };
+    ssize_t start, end;
+    get_snippet_range(occ, qlen, &start, &end);
+    char score[32];
+    int score_len = snprintf(score, sizeof(score), "%.6g ", ds[i].score);
+    if (!send_num(so, doc.label_len, ' ')
+        || !send_all(so, labels_base + doc.label_o, doc.label_len)
+        || !send_all(so, " ", 1)
+        || !send_num(so, ds[i].doc, ' ')
+        || !send_num(so, ds[i].count, ' ')
+        || !send_all(so, score, score_len)
+        || !send_num(so, ds[i].offset, ' ')
+        || !send_num(so, end - start, ' ')
+        || !send_all(so, data_base + doc.data_o + start, end - start)
+        || !send_all(so, "\n", 1)) {
+      my_free(ds);
+      return 0;
+    }
+  }
+  my_free(ds);
+  return send_end(so, truncated);
+}
+
+/**
+   @brief getdメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_getd(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  long top_n = req.get.n;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "getd top_n=%ld query[%ld]=[%s]\n", top_n, qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  doc_count_t * dcs = 0;
+  long n = document_repo_queryd(repo, qs, q, qlen, top_n, &dcs);
+  my_free(q);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(dcs);
+    return 0;
+  }
+  /* 結果(ドキュメント)を順に返事を送信. 形式:
+
+     (LABEL_LEN LABEL DOC_ID COUNT <改行>)* 0
+
+     DOC_ID はputが返したドキュメントの番号, COUNT はその中の出現回数
+  */
+  char * labels_base = repo->labels->a;
+  for (long i = 0; i < n; i++) {
+    document_t doc = document_repo_get_doc(repo, dcs[i].doc);
+    if (!send_num(so, doc.label_len, ' ')
+        || !send_all(so, labels_base + doc.label_o, doc.label_len)
+        || !send_all(so, " ", 1)
+        || !send_num(so, dcs[i].doc, ' ')
+        || !send_num(so, dcs[i].count, '\n')) {
+      my_free(dcs);
+      return 0;
+    }
+  }
+  my_free(dcs);
+  return send_end(so, truncated);
+}
+
+/**
+   @brief getlメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_getl(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "getl match=%d query[%ld]=[%s]\n", req.get.match, qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  long * docs = 0;
+  long n = document_repo_query_label(repo, q, qlen, req.get.match, &docs);
+  my_free(q);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(docs);
+    return 0;
+  }
+  /* 結果(ドキュメント)を順に返事を送信. 形式:
+
+     (LABEL_LEN LABEL DOC_ID <改行>)* 0
+  */
+  char * labels_base = repo->labels->a;
+  for (long i = 0; i < n; i++) {
+    document_t doc = document_repo_get_doc(repo, docs[i]);
+    if (!send_num(so, doc.label_len, ' ')
+        || !send_all(so, labels_base + doc.label_o, doc.label_len)
+        || !send_all(so, " ", 1)
+        || !send_num(so, docs[i], '\n')) {
+      my_free(docs);
+      return 0;
+    }
+  }
+  my_free(docs);
+  return send_end(so, truncated);
+}
+
+/**
+   @brief ドキュメントの data の [offset, offset + len) を1レコードとして送信
+   @return 1 (成功) または 0 (失敗)
+
+   @details 形式:
+
+     LABEL_LEN LABEL DOC_ID OFFSET LEN DATA <改行>
+
+   data は char_buf 上で連続しているので, そのまま送る
+  */
+static int send_doc_range(int so, document_repo_t * repo, long d, long offset, long len) {
+  document_t doc = document_repo_get_doc(repo, d);
+  char * labels_base = repo->labels->a;
+  char * data_base   = repo->data->a;
+  return (send_num(so, doc.label_len, ' ')
+          && send_all(so, labels_base + doc.label_o, doc.label_len)
+          && send_all(so, " ", 1)
+          && send_num(so, d, ' ')
+          && send_num(so, offset, ' ')
+          && send_num(so, len, ' ')
+          && send_all(so, data_base + doc.data_o + offset, len)
+          && send_all(so, "\n", 1));
+}
+
+/**
+   @brief getdocメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details ドキュメント番号で指定されたドキュメントの指定範囲を返す.
+   範囲はドキュメントの終わりで切り詰める. 返事の形式:
+
+     OK 1 <改行> LABEL_LEN LABEL DOC_ID OFFSET LEN DATA <改行> 0 <改行>
+
+   番号や範囲の先頭がドキュメントの外, または範囲の先頭か長さが
+   負ならNG
+  */
+static int connection_handle_getdoc(request_t req, int so, server_t * sv,
+                                    document_repo_t * repo) {
+  long d = req.getdoc.doc;
+  long offset = req.getdoc.offset;
+  long len = req.getdoc.len;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "getdoc doc=%ld offset=%ld len=%ld\n", d, offset, len);
+    fflush(sv->log_wp);
+  }
+  document_t doc = document_repo_get_doc(repo, d);
+  if (doc.label_o == -1) {
+    return send_ng(so, "no such document");
+  }
+  if (offset < 0 || len < 0) {
+    return send_ng(so, "negative offset or length");
+  }
+  if (offset > doc.data_len) {
+    return send_ng(so, "offset beyond the end of the document");
+  }
+  if (len == 0 || len > doc.data_len - offset) len = doc.data_len - offset;
+  return (send_ok_and_num(so, 1, '\n')
+          && send_doc_range(so, repo, d, offset, len)
+          && send_num(so, 0, '\n'));
+}
+
+/**
+   @brief getlabelメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details ラベルが一致するドキュメント全体を番号順に返す. 返事の形式:
+
+     OK N <改行> (LABEL_LEN LABEL DOC_ID 0 DATA_LEN DATA <改行>)* 0 <改行>
+  */
+static int connection_handle_getlabel(request_t req, int so, server_t * sv,
+                                      document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "getlabel label[%ld]=[%s]\n", qlen, q);
+    fflush(sv->log_wp);
+  }
+  long * docs = 0;
+  long n = document_repo_find_label(repo, q, qlen, &docs);
+  my_free(q);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(docs);
+    return 0;
+  }
+  for (long i = 0; i < n; i++) {
+    document_t doc = document_repo_get_doc(repo, docs[i]);
+    if (!send_doc_range(so, repo, docs[i], 0, doc.data_len)) {
+      my_free(docs);
+      return 0;
+    }
+  }
+  my_free(docs);
+  return send_end(so, truncated);
+}
+
+/**
+   @brief completeメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_complete(request_t req, int so, server_t * sv,
+                                      document_repo_t * repo, query_session_t * qs) {
+  char * q = req.get.query;
+  size_t qlen = req.get.query_len;
+  long top_n = req.get.n;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "complete top_n=%ld prefix[%ld]=[%s]\n", top_n, qlen, q);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  completion_t * cs = 0;
+  long n = document_repo_complete(repo, qs, q, qlen, top_n, &cs);
+  my_free(q);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(cs);
+    return 0;
+  }
+  /* 結果(候補)を出現回数の多い順に返事を送信. 形式:
+
+     (WORD_LEN WORD COUNT <改行>)* 0
+
+     WORD はPREFIXで始まり次の空白(または制御文字)の前で終わる単語,
+     COUNT はその出現回数(出現が多い場合は推定値)
+  */
+  char * data_base = repo->data->a;
+  for (long i = 0; i < n; i++) {
+    if (!send_num(so, cs[i].len, ' ')
+        || !send_all(so, data_base + cs[i].o, cs[i].len)
+        || !send_all(so, " ", 1)
+        || !send_num(so, cs[i].count, '\n')) {
+      my_free(cs);
+      return 0;
+    }
+  }
+  my_free(cs);
+  return send_end(so, truncated);
+}
+
+/**
+   @brief nearメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+  */
+static int connection_handle_near(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo, query_session_t * qs) {
+  char ** q = req.near.query;
+  size_t * qlen = req.near.query_len;
+  long window = req.near.window;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "near window=%ld query0[%ld]=[%s] query1[%ld]=[%s]\n",
+            window, qlen[0], q[0], qlen[1], q[1]);
+    fflush(sv->log_wp);
+  }
+  /* 検索を実行 */
+  text_span_t * sps = 0;
+  long n = document_repo_query_near(repo, qs, q[0], qlen[0], q[1], qlen[1],
+                                    window, &sps);
+  my_free(q[0]);
+  my_free(q[1]);
+  if (n == -1) {
+    return send_ng(so, "could not allocate memory for the result");
+  }
+  int truncated = connection_cap_results(qs->budget, &n);
+  if (!send_ok_and_count(so, n, truncated)) {
+    my_free(sps);
+    return 0;
+  }
+  /* 結果(範囲)を順に返事を送信. 形式:
+
+     (LABEL_LEN LABEL OFFSET SPAN_LEN SPAN <改行>)* 0
+
+     SPAN は両方の文字列の出現を含む範囲, OFFSET はそのドキュメント中の位置
+  */
+  char * labels_base = repo->labels->a;
+  char * data_base   = repo->data->a;
+  for (long i = 0; i < n; i++) {
+    document_t doc = document_repo_get_doc(repo, sps[i].doc);
+    if (!send_num(so, doc.label_len, ' ')
+        || !send_all(so, labels_base + doc.label_o, doc.label_len)
+        || !send_all(so, " ", 1)
+        || !send_num(so, sps[i].offset, ' ')
+        || !send_num(so, sps[i].len, ' ')
+        || !send_all(so, data_base + doc.data_o + sps[i].offset, sps[i].len)
+        || !send_all(so, "\n", 1)) {
+      my_free(sps);
+      return 0;
+    }
+  }
+  my_free(sps);
+  return send_end(so, truncated);
 }
 
 /**
-   @brief getメッセージを処理
+   @brief explainメッセージを処理
    @return 1 (成功) または 0 (失敗)
   */
-static int connection_handle_get(request_t req, int so, server_t * sv) {
+static int connection_handle_explain(request_t req, int so, server_t * sv,
+                                     document_repo_t * repo, query_session_t * qs) {
   char * q = req.get.query;
   size_t qlen = req.get.query_len;
   if (sv->log_wp) {
-    fprintf(sv->log_wp, "get query[%ld]=[%s]\n", qlen, q);
+    fprintf(sv->log_wp, "explain query[%ld]=[%s]\n", qlen, q);
     fflush(sv->log_wp);
   }
-  /* 検索を実行 */
-  size_t c = document_repo_queryc(sv->repo, q, qlen);
-  if (!send_ok_and_num(so, c, '\n')) return 0;
-  
-  query_result_t qr[1] = { document_repo_query(sv->repo, q, qlen) };
-  /* 結果(出現位置)を順に取り出して返事を送信. 形式:
+  query_plan_t plan = document_repo_plan(repo, qs, q, qlen);
+  my_free(q);
+  /* 選んだ方法と根拠を返事を送信. 形式:
 
-     (LABEL_LEN LABEL <改行> SNIPPET_LEN SNIPPET <改行>)* 0
+     kind 方法 <改行> (NAME VALUE <改行>)* 0
 
-     LABEL_LEN, SNIPPET_LENはそれぞれLABEL, SNIPPETの長さ(バイト数)
-     
- */
-  size_t cx = 0;
-  char * labels_base = qr->repo->labels->a;
-  char * data_base   = qr->repo->data->a;
-  while (1) {
-    occurrence_t occ = query_result_next(qr);
-    if (occ.offset == -1) break;
-    cx++;
-    /* 出現位置 */
-    ssize_t o = occ.offset;
-    /* 出現位置を含む周辺(スニペット)を返す.
-       例えば O バイト目に現れたら 
-       (O - snippet_prefix_len) バイト目から
-       (O + 検索文字列長 + snippet_suffix_len - 1) バイト目
-       までを返す.
-       ただしドキュメントの先頭や終了を飛び越えないように注意 */
-    /* スニペット先頭. ただし < 0 になったら 0 */
-    ssize_t start = o - snippet_prefix_len;
-    if (start < 0) start = 0;
-    /* スニペット終わり. ただし >= ドキュメント長 になったらドキュメント長  */
-    ssize_t end = o + qlen + snippet_suffix_len;
-    if (end > (ssize_t)occ.doc.data_len) end = occ.doc.data_len;
-    /* ラベル長 ラベル を送信 */
-    if (!send_num(so, occ.doc.label_len, ' ')) return 0;
-    if (!send_bytes(so, labels_base + occ.doc.label_o, occ.doc.label_len))
-      return 0;
-    if (!send_bytes(so, " ", 1)) return 0;
-    /* 出現位置を送信 */
-    if (!send_num(so, occ.offset, ' ')) return 0;
-    /* スニペット長 スニペット を送信 */
-    if (!send_num(so, end - start, ' ')) return 0;
-    if (!send_bytes(so, data_base + occ.doc.data_o + start, end - start))
-      return 0;
-    if (!send_bytes(so, "\n", 1)) return 0;
+     方法は sa, sa_verify, scan のいずれか. VALUE が -1 の手間は
+     その方法を選べないことを示す
+  */
+  struct {
+    char * name;
+    long value;
+  } items[] = {
+    { "data_len",       plan.data_len },
+    { "n_docs",         plan.n_docs },
+    { "query_len",      plan.query_len },
+    { "session_len",    plan.session_len },
+    { "range",          plan.range_end - plan.range_begin },
+    { "cost_sa",        plan.cost_sa },
+    { "cost_sa_verify", plan.cost_sa_verify },
+    { "cost_scan",      plan.cost_scan },
+  };
+  long n_items = sizeof(items) / sizeof(items[0]);
+  char * kind = (char *)query_plan_kind_name(plan.kind);
+  if (!send_ok_and_num(so, n_items + 1, '\n')
+      || !send_all(so, "kind ", 5)
+      || !send_all(so, kind, strlen(kind))
+      || !send_all(so, "\n", 1)) {
+    return 0;
   }
-  if (cx != c) {
-    fprintf(stderr, "occurrence count did not match (before: %ld after: %ld)\n",
-            c, cx);
+  for (long i = 0; i < n_items; i++) {
+    if (!send_all(so, items[i].name, strlen(items[i].name))
+        || !send_all(so, " ", 1)
+        || !send_num(so, items[i].value, '\n')) {
+      return 0;
+    }
   }
-  my_free(q);
   return send_num(so, 0, '\n');
 }
 
@@ -687,17 +2668,18 @@ static int connection_handle_get(request_t req, int so, server_t * sv) {
    @brief dumpメッセージを処理
    @return 0
   */
-static int connection_handle_dump(request_t req, int so, server_t * sv) {
+static int connection_handle_dump(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo) {
   (void)req;
   if (sv->log_wp) {
     fprintf(sv->log_wp, "dump\n");
     fflush(sv->log_wp);
   }
   /* 検索を実行 */
-  size_t c = document_repo_n_docs(sv->repo);
+  size_t c = document_repo_n_docs(repo);
   if (!send_ok_and_num(so, c, '\n')) return 0;
   
-  dump_result_t dr[1] = { document_repo_dump(sv->repo) };
+  dump_result_t dr[1] = { document_repo_dump(repo) };
   /* 結果(出現位置)を順に取り出して返事を送信. 形式:
 
      (LABEL_LEN LABEL <改行> SNIPPET_LEN SNIPPET <改行>)* 0
@@ -713,11 +2695,11 @@ static int connection_handle_dump(request_t req, int so, server_t * sv) {
     if (doc.label_o == -1) break;
     cx++;
     if (!send_num(so, doc.label_len, ' ')) return 0;
-    if (!send_bytes(so, labels_base + doc.label_o, doc.label_len)) return 0;
-    if (!send_bytes(so, " ", 1)) return 0;
+    if (!send_all(so, labels_base + doc.label_o, doc.label_len)) return 0;
+    if (!send_all(so, " ", 1)) return 0;
     if (!send_num(so, doc.data_len, ' ')) return 0;
-    if (!send_bytes(so, data_base + doc.data_o, doc.data_len)) return 0;
-    if (!send_bytes(so, "\n", 1)) return 0;
+    if (!send_all(so, data_base + doc.data_o, doc.data_len)) return 0;
+    if (!send_all(so, "\n", 1)) return 0;
   }
   if (cx != c) {
     fprintf(stderr, "occurrence count did not match (before: %ld after: %ld)\n",
@@ -730,14 +2712,15 @@ static int connection_handle_dump(request_t req, int so, server_t * sv) {
    @brief dumpcメッセージを処理
    @return 0
   */
-static int connection_handle_dumpc(request_t req, int so, server_t * sv) {
+static int connection_handle_dumpc(request_t req, int so, server_t * sv,
+                                   document_repo_t * repo) {
   (void)req;
   if (sv->log_wp) {
     fprintf(sv->log_wp, "dumpc\n");
     fflush(sv->log_wp);
   }
   /* 検索を実行 */
-  size_t c = document_repo_n_docs(sv->repo);
+  size_t c = document_repo_n_docs(repo);
   return send_ok_and_num(so, c, '\n');
 }
 
@@ -745,17 +2728,251 @@ static int connection_handle_dumpc(request_t req, int so, server_t * sv) {
    @brief saveメッセージを処理
    @return 0
   */
-static int connection_handle_save(request_t req, int so, server_t * sv) {
+static int connection_handle_save(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo) {
   (void)req;
   if (sv->log_wp) {
     fprintf(sv->log_wp, "save\n");
     fflush(sv->log_wp);
   }
   /* 検索を実行 */
-  size_t c = document_repo_save(sv->repo, sv->opt.data_dir);
+  size_t c = document_repo_save(repo, sv->opt.data_dir);
   return send_ok_and_num(so, c, '\n');
 }
 
+/**
+   @brief server_write で各複製の静的探索木を作る
+  */
+static long server_freeze_op(document_repo_t * repo, void * arg) {
+  (void)arg;
+  return document_repo_freeze(repo);
+}
+
+/**
+   @brief freezeメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details 現在のsuffix arrayから検索用の静的探索木を作る.
+   次のputまで有効. 返事は OK 標本数
+  */
+static int connection_handle_freeze(request_t req, int so, server_t * sv) {
+  (void)req;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "freeze\n");
+    fflush(sv->log_wp);
+  }
+  long c = server_write(sv, server_freeze_op, 0);
+  if (c == -1) {
+    return send_ng(so, "could not build the search tree");
+  } else {
+    return send_ok_and_num(so, c, '\n');
+  }
+}
+
+/**
+   @brief dups のジョブを打ち切るか(query_budget_t の cancelled)
+  */
+static int dups_job_cancelled(void * arg) {
+  dups_job_t * job = arg;
+  return job->stop;
+}
+
+/**
+   @brief dups のジョブのスレッドが実行する関数
+  */
+static void * dups_job_thread(void * arg) {
+  server_t * sv = arg;
+  dups_job_t * job = sv->dups;
+  long t0 = cur_time_us();
+  dup_pair_t * pairs = 0;
+  int epoch;
+  document_repo_t * repo = server_read_begin(sv, &epoch);
+  long n = document_repo_dups(repo, job->min_len, job->budget, &pairs);
+  server_read_end(sv, epoch);
+  long t1 = cur_time_us();
+  pthread_mutex_lock(job->mu);
+  job->pairs = pairs;
+  job->n_pairs = n;
+  job->state = (n == -1 ? dups_job_failed : dups_job_done);
+  pthread_mutex_unlock(job->mu);
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "dups min_len=%ld finished: %ld pairs in %.6f sec\n",
+            job->min_len, n, (t1 - t0) * 1.0e-6);
+    fflush(sv->log_wp);
+  }
+  return 0;
+}
+
+/**
+   @brief dupsメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details MIN_LEN バイト以上の共通部分を持つドキュメントの組を
+   求めるジョブを別のスレッドで始め, 終わるのを待たずに OK 0 を返す.
+   結果は dupsr で取り出す. ジョブの間は put を受け付けない
+   (suffix arrayを変えないため).
+  */
+static int connection_handle_dups(request_t req, int so, server_t * sv,
+                                  document_repo_t * repo) {
+  dups_job_t * job = sv->dups;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "dups min_len=%ld\n", req.dups.n);
+    fflush(sv->log_wp);
+  }
+  if (req.dups.n < 1) {
+    return send_ng(so, "MIN_LEN must be positive");
+  }
+  if (!repo->use_sa) {
+    return send_ng(so, "dups needs the suffix array");
+  }
+  pthread_mutex_lock(job->mu);
+  if (job->state == dups_job_running) {
+    pthread_mutex_unlock(job->mu);
+    return send_ng(so, "a dups job is already running");
+  }
+  if (job->state != dups_job_none) {
+    /* 前のジョブ(終わっている)のスレッドを回収し, 結果を捨てる */
+    pthread_join(job->tid, 0);
+    my_free(job->pairs);
+    job->pairs = 0;
+    job->n_pairs = 0;
+    job->state = dups_job_none;
+  }
+  query_budget_t b = { 0, 0, dups_job_cancelled, job, 0, 0, 0 };
+  *job->budget = b;
+  job->min_len = req.dups.n;
+  job->stop = 0;
+  int ok = (pthread_create(&job->tid, 0, dups_job_thread, sv) == 0);
+  if (ok) {
+    job->state = dups_job_running;
+  } else {
+    api_err("pthread_create");
+  }
+  pthread_mutex_unlock(job->mu);
+  if (!ok) return send_ng(so, "could not start a dups job");
+  return send_ok_and_num(so, 0, '\n');
+}
+
+/**
+   @brief dupsrメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details 終わった dups のジョブの結果を, 共有する繰り返しの多い順に
+   上位 TOP_N 件返す. 形式:
+
+   OK 件数 <改行> (DOC0 DOC1 COUNT OFFSET SAMPLE_LEN SAMPLE <改行>)* 0
+
+   DOC0 < DOC1 はドキュメント番号, COUNT は共有する繰り返しの数,
+   SAMPLE は共有する繰り返しの1つ(DOC0 の OFFSET バイト目から
+   MIN_LEN バイト). ジョブが実行中なら進み具合を NG で返す.
+  */
+static int connection_handle_dupsr(request_t req, int so, server_t * sv,
+                                   document_repo_t * repo, query_session_t * qs) {
+  dups_job_t * job = sv->dups;
+  long top_n = req.dups.n;
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "dupsr top_n=%ld\n", top_n);
+    fflush(sv->log_wp);
+  }
+  /* 結果(の送る分)を mu を持って写し, 放してから送る. 読まない
+     クライアントが mu を持ち続け, put や次の dups を止めないように */
+  pthread_mutex_lock(job->mu);
+  dups_job_state_t state = job->state;
+  long n = 0;
+  long min_len = job->min_len;
+  int truncated = 0;
+  dup_pair_t * pairs = 0;
+  if (state == dups_job_done) {
+    n = job->n_pairs;
+    truncated = job->budget->truncated;
+    if (top_n > 0 && n > top_n) {
+      n = top_n;
+      truncated = 1;
+    }
+    if (connection_cap_results(qs->budget, &n)) truncated = 1;
+    pairs = malloc_or_err(sizeof(dup_pair_t) * (n > 0 ? n : 1));
+    if (pairs) memcpy(pairs, job->pairs, sizeof(dup_pair_t) * n);
+  }
+  pthread_mutex_unlock(job->mu);
+  int ok = 1;
+  if (state == dups_job_none) {
+    ok = send_ng(so, "no dups job has been started");
+  } else if (state == dups_job_failed) {
+    ok = send_ng(so, "the dups job failed");
+  } else if (state == dups_job_running) {
+    /* n_steps はジョブのスレッドが書き換えている */
+    char msg[64];
+    long sz = repo->sa->sz;
+    long steps = __atomic_load_n(&job->budget->n_steps, __ATOMIC_RELAXED);
+    long percent = (sz ? steps * 100 / sz : 0);
+    sprintf(msg, "the dups job is running (%ld%% done)", (percent < 99 ? percent : 99));
+    ok = send_ng(so, msg);
+  } else if (!pairs) {
+    ok = send_ng(so, "could not allocate memory for the result");
+  } else {
+    char * data_base = repo->data->a;
+    ok = send_ok_and_count(so, n, truncated);
+    for (long i = 0; ok && i < n; i++) {
+      dup_pair_t p = pairs[i];
+      document_t doc = repo->da->a[p.doc0];
+      ok = (send_num(so, p.doc0, ' ')
+            && send_num(so, p.doc1, ' ')
+            && send_num(so, p.count, ' ')
+            && send_num(so, p.offset, ' ')
+            && send_num(so, min_len, ' ')
+            && send_all(so, data_base + doc.data_o + p.offset, min_len)
+            && send_all(so, "\n", 1));
+    }
+    ok = ok && send_end(so, truncated);
+  }
+  my_free(pairs);
+  return ok;
+}
+
+/**
+   @brief limitメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details この接続の以降のリクエストの時間と結果件数の上限を設定する
+  */
+static int connection_handle_limit(request_t req, int so, server_t * sv,
+                                   long * timeout_ms, long * max_results) {
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "limit timeout_ms=%ld max_results=%ld\n",
+            req.limit.timeout_ms, req.limit.max_results);
+    fflush(sv->log_wp);
+  }
+  *timeout_ms = req.limit.timeout_ms;
+  *max_results = req.limit.max_results;
+  return send_ok_and_num(so, 0, '\n');
+}
+
+/**
+   @brief filterメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details この接続の検索の条件 *filter を置き換える. 条件が無ければ
+   (全ドキュメントが対象なら) qs->filter を0にして, 検索が条件を
+   調べる手間も省く
+  */
+static int connection_handle_filter(request_t req, int so, server_t * sv,
+                                    query_session_t * qs, query_filter_t * filter) {
+  if (sv->log_wp) {
+    fprintf(sv->log_wp, "filter doc_begin=%ld doc_end=%ld label_prefix[%ld]=[%s]\n",
+            req.filter.doc_begin, req.filter.doc_end, req.filter.label_prefix_len,
+            req.filter.label_prefix ? req.filter.label_prefix : "");
+    fflush(sv->log_wp);
+  }
+  my_free(filter->label_prefix);
+  filter->doc_begin = req.filter.doc_begin;
+  filter->doc_end = req.filter.doc_end;
+  filter->label_prefix = req.filter.label_prefix;
+  filter->label_prefix_len = req.filter.label_prefix_len;
+  int active = (filter->doc_begin > 0 || filter->doc_end > 0 || filter->label_prefix);
+  qs->filter = (active ? filter : 0);
+  return send_ok_and_num(so, 0, '\n');
+}
+
 /**
    @brief quitメッセージを処理
    @return 0
@@ -796,6 +3013,165 @@ static int connection_handle_invalid(request_t req, int so, server_t * sv) {
   return 0;                     /* NG. abandon this connection */
 }
 
+/**
+   @brief 1クライアントとの接続の状態(リクエストをまたいで覚えておくもの)
+  */
+typedef struct connection {
+  int so;                       /**< クライアントと接続されたソケット */
+  query_session_t qs[1];        /**< この接続での直前の検索の範囲 */
+  long timeout_ms;              /**< この接続の各リクエストの時間の上限 */
+  long max_results;             /**< この接続の各リクエストの結果件数の上限 */
+  query_budget_t budget[1];     /**< 処理中のリクエストの予算 */
+  query_filter_t filter[1];     /**< この接続の検索の対象とするドキュメントの条件(filterで設定) */
+  recv_buf_t in[1];             /**< 受信したがまだ処理していないバイト列 */
+  request_t req;                /**< 次に処理するリクエスト(in から読んだもの) */
+  reactor_t * reactor;          /**< 接続を受け付けたイベントループ(-w) */
+  struct connection * next;     /**< ワーカーの待ち行列での次の接続 */
+} connection_t;
+
+/**
+   @brief 接続の状態を作る
+   @return 接続の状態または0(メモリ割り当て失敗)
+  */
+static connection_t * connection_make(int so, server_t * sv) {
+  connection_t * c = malloc_or_err(sizeof(connection_t));
+  if (!c) return 0;
+  c->so = so;
+  query_session_init(c->qs);
+  c->qs->budget = c->budget;
+  c->timeout_ms = sv->opt.timeout_ms;
+  c->max_results = sv->opt.max_results;
+  query_filter_t f = { 0, 0, 0, 0 };
+  *c->filter = f;
+  recv_buf_init(c->in);
+  c->req.kind = request_kind_invalid;
+  c->reactor = 0;
+  c->next = 0;
+  return c;
+}
+
+/**
+   @brief 接続を閉じ, 状態を開放する
+  */
+static void connection_destroy(connection_t * c) {
+  query_session_destroy(c->qs);
+  my_free(c->filter->label_prefix);
+  recv_buf_destroy(c->in);
+  close(c->so);
+  my_free(c);
+}
+
+/**
+   @brief 接続から1リクエストを受信し終えるまで待つ(c->req に得る)
+  */
+static void connection_recv_request(connection_t * c) {
+  while (!server_parse_message(c->in, &c->req)) {
+    recv_buf_fill(c->in, c->so, 0);
+  }
+}
+
+/**
+   @brief 接続の受信済みのリクエスト(c->req)を処理する
+   @return 1 (接続は続く) または 0 (接続を閉じる)
+  */
+static int connection_process_request(connection_t * c, server_t * sv) {
+  int connection_continues = 1;
+  request_t req = c->req;
+  c->req.kind = request_kind_invalid;
+  /* リクエストごとに予算を作り直す */
+  query_budget_t b = {
+    (c->timeout_ms ? cur_time_us() + c->timeout_ms * 1000 : 0),
+    c->max_results,
+    connection_peer_gone,
+    &c->so,
+    0, 0, 0
+  };
+  *c->budget = b;
+  /* put, freeze 以外は読み手としてレポジトリの複製を得る */
+  int writes = (req.kind == request_kind_put || req.kind == request_kind_freeze);
+  int epoch = 0;
+  document_repo_t * repo = (writes ? 0 : server_read_begin(sv, &epoch));
+  switch (req.kind) {
+  case request_kind_put:
+    connection_continues = connection_handle_put(req, c->so, sv);
+    break;
+  case request_kind_getc:
+    connection_continues = connection_handle_getc(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_get:
+  case request_kind_geto:
+    connection_continues = connection_handle_get(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_getd:
+    connection_continues = connection_handle_getd(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_gets:
+    connection_continues = connection_handle_gets(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_getr:
+    connection_continues = connection_handle_getr(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_getl:
+    connection_continues = connection_handle_getl(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_getdoc:
+    connection_continues = connection_handle_getdoc(req, c->so, sv, repo);
+    break;
+  case request_kind_getlabel:
+    connection_continues = connection_handle_getlabel(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_complete:
+    connection_continues = connection_handle_complete(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_near:
+    connection_continues = connection_handle_near(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_explain:
+    connection_continues = connection_handle_explain(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_dump:
+    connection_continues = connection_handle_dump(req, c->so, sv, repo);
+    break;
+  case request_kind_dumpc:
+    connection_continues = connection_handle_dumpc(req, c->so, sv, repo);
+    break;
+  case request_kind_save:
+    connection_continues = connection_handle_save(req, c->so, sv, repo);
+    break;
+  case request_kind_freeze:
+    connection_continues = connection_handle_freeze(req, c->so, sv);
+    break;
+  case request_kind_dups:
+    connection_continues = connection_handle_dups(req, c->so, sv, repo);
+    break;
+  case request_kind_dupsr:
+    connection_continues = connection_handle_dupsr(req, c->so, sv, repo, c->qs);
+    break;
+  case request_kind_limit:
+    connection_continues = connection_handle_limit(req, c->so, sv,
+                                                   &c->timeout_ms, &c->max_results);
+    break;
+  case request_kind_filter:
+    connection_continues = connection_handle_filter(req, c->so, sv, c->qs, c->filter);
+    break;
+  case request_kind_discon:
+    connection_continues = connection_handle_discon(req, c->so, sv);
+    break;
+  case request_kind_quit:
+    connection_continues = connection_handle_quit(req, c->so, sv);
+    break;
+  case request_kind_invalid:
+    connection_continues = connection_handle_invalid(req, c->so, sv);
+    break;
+  default:
+    internal_err("unknown request kind");
+    connection_continues = 0;
+    break;
+  }
+  if (!writes) server_read_end(sv, epoch);
+  return connection_continues;
+}
+
 /**
    @brief 1クライアントからの接続を処理
    @return 1 (サーバーは処理を継続可能), 
@@ -805,44 +3181,15 @@ static int connection_handle_invalid(request_t req, int so, server_t * sv) {
    その処理, を繰り返す.
   */
 static int server_process_connection(int so, server_t * sv) {
-  int connection_continues = 1;
-  while (connection_continues) {
-    request_t req = server_recv_message(so);
-    switch (req.kind) {
-    case request_kind_put:
-      connection_continues = connection_handle_put(req, so, sv);
-      break;
-    case request_kind_getc:
-      connection_continues = connection_handle_getc(req, so, sv);
-      break;
-    case request_kind_get:
-      connection_continues = connection_handle_get(req, so, sv);
-      break;
-    case request_kind_dump:
-      connection_continues = connection_handle_dump(req, so, sv);
-      break;
-    case request_kind_dumpc:
-      connection_continues = connection_handle_dumpc(req, so, sv);
-      break;
-    case request_kind_save:
-      connection_continues = connection_handle_save(req, so, sv);
-      break;
-    case request_kind_discon:
-      connection_continues = connection_handle_discon(req, so, sv);
-      break;
-    case request_kind_quit:
-      connection_continues = connection_handle_quit(req, so, sv);
-      break;
-    case request_kind_invalid:
-      connection_continues = connection_handle_invalid(req, so, sv);
-      break;
-    default:
-      internal_err("unknown request kind");
-      connection_continues = 0;
-      break;
-    }
+  connection_t * c = connection_make(so, sv);
+  if (!c) {
+    close(so);
+    return 1;
   }
-  close(so);
+  do {
+    connection_recv_request(c);
+  } while (connection_process_request(c, sv));
+  connection_destroy(c);
   return 1;
 }
 
@@ -851,16 +3198,17 @@ static int server_process_connection(int so, server_t * sv) {
    @return クライアントと接続されたソケット
 
    @details クライアントから接続要求が来るのを待ち, 
-   クライアントと接続されたソケットを返す
+   クライアントと接続されたソケット(ss から accept したもの)を返す.
+   ss が nonblock で接続要求が無ければ errno を EAGAIN にして
+   -1 を返す(エラーとして表示しない).
   */
-static int server_accept_connection(server_t * sv) {
+static int server_accept_connection(server_t * sv, int ss) {
   struct sockaddr_in addr[1];
   socklen_t addrlen = sizeof(addr);
-  int ss = sv->server_sock;
   int so = accept(ss, (struct sockaddr *)addr, &addrlen);
   if (so == -1) {
-    api_err("accept");
-  } else {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) api_err("accept");
+  } else if (sv->log_wp) {
     struct sockaddr_in caddr[1];
     socklen_t caddrlen = sizeof(caddr);
     if (getsockname(ss, (struct sockaddr *)caddr, &caddrlen) == -1) {
@@ -960,6 +3308,363 @@ int server_process_connection_thread(int so, server_t * sv) {
   }
 }
 
+/**
+   @brief 接続をワーカーの待ち行列(ready)に入れる
+  */
+static void server_enqueue_connection(server_t * sv, connection_t * c) {
+  pthread_mutex_lock(sv->queue_mu);
+  c->next = 0;
+  if (sv->ready_tail) {
+    sv->ready_tail->next = c;
+  } else {
+    sv->ready_head = c;
+  }
+  sv->ready_tail = c;
+  pthread_cond_signal(sv->queue_cv);
+  pthread_mutex_unlock(sv->queue_mu);
+}
+
+/**
+   @brief 接続からの受信を(接続を受け付けたイベントループの) epoll で待つようにする
+   @return 1 (OK) または 0 (エラー)
+
+   @details EPOLLONESHOT で登録するので, 受信を1度知らせたら
+   再びこれを呼ぶ(op = EPOLL_CTL_MOD)まで知らせない. その間
+   接続を扱えるのは1つのスレッド(イベントループかワーカー)だけである.
+   受信済みのバイト列が無ければその領域は開放しておく.
+  */
+static int server_watch_connection(connection_t * c, int op) {
+  recv_buf_shrink(c->in);
+  struct epoll_event ev[1];
+  ev->events = EPOLLIN | EPOLLONESHOT;
+  ev->data.ptr = c;
+  if (epoll_ctl(c->reactor->epoll_fd, op, c->so, ev) == -1) {
+    api_err("epoll_ctl");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+   @brief 全てのイベントループを起こす(サーバの終了中)
+  */
+static void server_wake_reactors(server_t * sv) {
+  for (int i = 0; i < sv->opt.reactors; i++) {
+    char x = 0;
+    if (write(sv->reactors[i].wake_fd[1], &x, 1) != 1) {
+      api_err("write");
+    }
+  }
+}
+
+/**
+   @brief 接続を閉じる
+
+   @details サーバの終了中なら, 接続が全て閉じたかを調べられるよう
+   イベントループを起こす. quit を受けた接続もここで閉じるので,
+   他のイベントループも新しい接続の受け付けをやめる.
+  */
+static void server_close_connection(server_t * sv, connection_t * c) {
+  reactor_t * r = c->reactor;
+  connection_destroy(c);
+  __atomic_sub_fetch(&r->n_live, 1, __ATOMIC_SEQ_CST);
+  if (!sv->server_continues) server_wake_reactors(sv);
+}
+
+/**
+   @brief ワーカースレッド
+
+   @details ready から接続を取り出し, 受信済みのリクエストを1つだけ
+   処理する, を workers_exit が1になり ready が空になるまで繰り返す.
+   処理の後, 次のリクエストがもう届いていれば接続を ready の末尾に
+   戻し, そうでなければ epoll で待つようにして手放す.
+  */
+static void * server_worker_fun(void * arg) {
+  server_t * sv = arg;
+  while (1) {
+    pthread_mutex_lock(sv->queue_mu);
+    while (!sv->ready_head && !sv->workers_exit) {
+      pthread_cond_wait(sv->queue_cv, sv->queue_mu);
+    }
+    connection_t * c = sv->ready_head;
+    if (c) {
+      sv->ready_head = c->next;
+      if (!sv->ready_head) sv->ready_tail = 0;
+    }
+    pthread_mutex_unlock(sv->queue_mu);
+    if (!c) break;
+    if (!connection_process_request(c, sv)) {
+      server_close_connection(sv, c);
+    } else if (server_parse_message(c->in, &c->req)) {
+      server_enqueue_connection(sv, c);
+    } else if (!server_watch_connection(c, EPOLL_CTL_MOD)) {
+      server_close_connection(sv, c);
+    }
+  }
+  return 0;
+}
+
+/** @brief ワーカーが1回の送信で待つ時間の上限(秒). 返事を読まないクライアントがワーカーを止め続けないように */
+static const long worker_send_timeout_s = 10;
+
+/** @brief 1回の epoll_wait で受け取るイベントの最大数 */
+#define reactor_max_events 64
+
+/** @brief accept がファイル記述子不足などで失敗した時, 接続要求を待つのを休む時間(ミリ秒) */
+static const int reactor_accept_pause_ms = 100;
+
+/**
+   @brief イベントループを作る
+   @return 1 (OK) または 0 (エラー)
+
+   @details 0番目はサーバの server_sock を, 他は同じポート番号に
+   bind した自分のソケット(SO_REUSEPORT)を使う. 接続要求が
+   来なければ待たずに次へ進めるよう, いずれも nonblock にする
+   (accept した接続は nonblock ではない).
+  */
+static int reactor_init(reactor_t * r, server_t * sv, int idx) {
+  r->sv = sv;
+  r->idx = idx;
+  r->n_live = 0;
+  r->ok = 1;
+  r->listen_sock = r->epoll_fd = r->wake_fd[0] = r->wake_fd[1] = -1;
+  if (idx == 0) {
+    r->listen_sock = sv->server_sock;
+  } else {
+    int port = 0;
+    r->listen_sock = server_listen(sv->port, sv->opt.qlen, 1, &port);
+    if (r->listen_sock == -1) return 0;
+  }
+  int flags = fcntl(r->listen_sock, F_GETFL);
+  if (flags == -1 || fcntl(r->listen_sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+    api_err("fcntl");
+    return 0;
+  }
+  if (pipe(r->wake_fd) == -1) {
+    api_err("pipe");
+    return 0;
+  }
+  r->epoll_fd = epoll_create1(0);
+  if (r->epoll_fd == -1) {
+    api_err("epoll_create1");
+    return 0;
+  }
+  /* 接続要求と通知用パイプは data.ptr でそれと分かるようにする */
+  struct epoll_event lev[1] = { { EPOLLIN, { .ptr = &r->listen_sock } } };
+  struct epoll_event wev[1] = { { EPOLLIN, { .ptr = r->wake_fd } } };
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_sock, lev) == -1
+      || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd[0], wev) == -1) {
+    api_err("epoll_ctl");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+   @brief イベントループのファイル記述子を閉じる
+  */
+static void reactor_destroy(reactor_t * r) {
+  if (r->idx > 0 && r->listen_sock != -1) close(r->listen_sock);
+  if (r->epoll_fd != -1) close(r->epoll_fd);
+  if (r->wake_fd[0] != -1) close(r->wake_fd[0]);
+  if (r->wake_fd[1] != -1) close(r->wake_fd[1]);
+}
+
+/**
+   @brief 1つのイベントループを実行する(スレッドの関数)
+
+   @details 自分のソケットへの接続要求と, それで受け付けた接続を epoll
+   で待つ. 接続要求は来ている限りまとめて accept する. 接続から
+   届いたバイト列は待たずに(MSG_DONTWAIT)接続ごとの recv_buf_t に
+   受信し, リクエストを読み終えた接続だけをワーカーに渡す.
+   リクエストの途中までしか届いていない接続は読めた所まで
+   覚えておき, 残りが届くのを待つ. サーバの終了中(quit の後)は
+   接続要求を受け付けず, 自分の接続が全て閉じたら終わる.
+   負荷の高い時に起こる accept の失敗ではサーバを止めない.
+   EINTR, ECONNABORTED なら次の接続要求に進み, それ以外
+   (EMFILE, ENFILE, ENOBUFS など)なら reactor_accept_pause_ms の間
+   接続要求を epoll から外す(外さないと同じ失敗を繰り返し続ける).
+  */
+static void * reactor_run(void * arg) {
+  reactor_t * r = arg;
+  server_t * sv = r->sv;
+  void * listen_tag = &r->listen_sock;
+  void * wake_tag = r->wake_fd;
+  int listening = 1;
+  int paused = 0;               /* 接続要求を一時的に epoll から外している */
+  while (sv->server_continues
+         || __atomic_load_n(&r->n_live, __ATOMIC_SEQ_CST) > 0) {
+    struct epoll_event evs[reactor_max_events];
+    int n = epoll_wait(r->epoll_fd, evs, reactor_max_events,
+                       paused ? reactor_accept_pause_ms : -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      api_err("epoll_wait");
+      r->ok = 0;
+      break;
+    }
+    if (paused && sv->server_continues) {
+      /* 休んだ後(または接続が閉じた後)は接続要求を再び待つ */
+      struct epoll_event lev[1] = { { EPOLLIN, { .ptr = listen_tag } } };
+      if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_sock, lev) == -1) {
+        api_err("epoll_ctl");
+        r->ok = 0;
+        break;
+      }
+      paused = 0;
+      listening = 1;
+    }
+    for (int i = 0; i < n; i++) {
+      void * tag = evs[i].data.ptr;
+      if (tag == wake_tag) {
+        char buf[64];
+        if (read(r->wake_fd[0], buf, sizeof(buf)) == -1) {
+          api_err("read");
+        }
+      } else if (tag == listen_tag) {
+        while (sv->server_continues) {
+          int so = server_accept_connection(sv, r->listen_sock);
+          if (so == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+              /* 失敗は server_accept_connection が表示している */
+              if (epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->listen_sock, 0) == -1) {
+                api_err("epoll_ctl");
+                r->ok = 0;
+              }
+              paused = 1;
+              listening = 0;
+            }
+            break;
+          }
+          struct timeval tv = { worker_send_timeout_s, 0 };
+          if (setsockopt(so, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+            api_err("setsockopt");
+          }
+          connection_t * c = connection_make(so, sv);
+          if (!c) {
+            close(so);
+            continue;
+          }
+          c->reactor = r;
+          if (!server_watch_connection(c, EPOLL_CTL_ADD)) {
+            connection_destroy(c);
+          } else {
+            __atomic_add_fetch(&r->n_live, 1, __ATOMIC_SEQ_CST);
+          }
+        }
+        if (!r->ok) break;
+      } else {
+        /* 届いた分を受信し, リクエストを読み終えたらワーカーに渡す */
+        connection_t * c = tag;
+        recv_buf_fill(c->in, c->so, 1);
+        if (server_parse_message(c->in, &c->req)) {
+          server_enqueue_connection(sv, c);
+        } else if (!server_watch_connection(c, EPOLL_CTL_MOD)) {
+          server_close_connection(sv, c);
+        }
+      }
+    }
+    if (!r->ok) break;
+    if (!sv->server_continues) {
+      /* quit を受けたら新しい接続は受け付けない */
+      if (listening) epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->listen_sock, 0);
+      listening = 0;
+      paused = 0;
+    }
+  }
+  if (!r->ok) {
+    /* 他のイベントループも終わらせる */
+    sv->server_continues = 0;
+    server_wake_reactors(sv);
+  }
+  return 0;
+}
+
+/**
+   @brief ワーカースレッドとイベントループを使ってサーバを実行する(-w N)
+   @return 1 (OK) または 0 (エラー)
+
+   @details opt.workers 個のワーカースレッドと opt.reactors 個の
+   イベントループ(reactor_run)のスレッドを最初に作り, 接続ごとには
+   スレッドを作らない. イベントループは各々が同じポート番号の
+   ソケットを持ち(SO_REUSEPORT), 接続要求の受け付けとリクエストの
+   受信を分担する. ワーカーはリクエストを処理し(返事は従来通り
+   ワーカーが送る), 接続をそれを受け付けたイベントループに戻す.
+   そのためリクエストの合間の接続も, リクエストを送りかけの接続も
+   スレッドを占有せず, 接続の数は select の FD_SETSIZE に縛られない.
+   opt.pin なら i 番目のイベントループを i 番目のCPU(の数で割った
+   余り)に固定する.
+  */
+static int run_server_workers(server_t * sv) {
+  int nw = sv->opt.workers;
+  int nr = sv->opt.reactors;
+  sv->reactors = malloc_or_err(sizeof(reactor_t) * nr);
+  sv->workers = malloc_or_err(sizeof(pthread_t) * nw);
+  if (!sv->reactors || !sv->workers) {
+    my_free(sv->reactors);
+    my_free(sv->workers);
+    return 0;
+  }
+  int ok = 1;
+  int n_init = 0;
+  for (; ok && n_init < nr; n_init++) {
+    if (!reactor_init(&sv->reactors[n_init], sv, n_init)) ok = 0;
+  }
+  int n_started = 0;
+  for (; ok && n_started < nw; n_started++) {
+    if (pthread_create(&sv->workers[n_started], 0, server_worker_fun, sv)) {
+      api_err("pthread_create");
+      ok = 0;
+      break;
+    }
+  }
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int n_running = 0;
+  for (; ok && n_running < nr; n_running++) {
+    reactor_t * r = &sv->reactors[n_running];
+    if (pthread_create(&r->tid, 0, reactor_run, r)) {
+      api_err("pthread_create");
+      ok = 0;
+      break;
+    }
+    if (sv->opt.pin && n_cpus > 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(n_running % n_cpus, &cpus);
+      int e = pthread_setaffinity_np(r->tid, sizeof(cpus), &cpus);
+      if (e) {
+        errno = e;
+        api_err("pthread_setaffinity_np");
+      }
+    }
+  }
+  if (!ok && n_running > 0) {
+    sv->server_continues = 0;
+    server_wake_reactors(sv);
+  }
+  for (int i = 0; i < n_running; i++) {
+    pthread_join(sv->reactors[i].tid, 0);
+    if (!sv->reactors[i].ok) ok = 0;
+  }
+  /* ワーカーを終了させる. 既に ready にある接続は処理される */
+  pthread_mutex_lock(sv->queue_mu);
+  sv->workers_exit = 1;
+  pthread_cond_broadcast(sv->queue_cv);
+  pthread_mutex_unlock(sv->queue_mu);
+  for (int i = 0; i < n_started; i++) {
+    pthread_join(sv->workers[i], 0);
+  }
+  for (int i = 0; i < n_init; i++) {
+    reactor_destroy(&sv->reactors[i]);
+  }
+  my_free(sv->reactors);
+  my_free(sv->workers);
+  sv->reactors = 0;
+  sv->workers = 0;
+  return ok;
+}
+
 /**
    @brief クライアントからの接続を待つ
    @return クライアントと接続されたソケット
@@ -1007,17 +3712,22 @@ server_event_kind_t server_wait_for_event(server_t * sv) {
    @brief サーバを実行する
 
    @details サーバを生成し, 接続用のオープン, 接続待ち, その処理まで,
-   全てを行う
+   全てを行う. ワーカースレッドを使う(-w N)なら run_server_workers に任せる.
   */
 static void run_server(cmdline_options_t opt) {
   server_t * sv = start_server(opt);
   if (!sv) return;
+  if (opt.workers > 0) {
+    run_server_workers(sv);
+    stop_server(sv);
+    return;
+  }
   while (sv->server_continues || sv->nthreads > 0) {
     server_event_kind_t ev = server_wait_for_event(sv);
     if (ev == server_event_kind_err) {
       sv->server_continues = 0;
     } else if (ev == server_event_kind_accept_connection) {
-      int so = server_accept_connection(sv);
+      int so = server_accept_connection(sv, sv->server_sock);
       if (so == -1) break;
       if (opt.thread) {
         if (!server_process_connection_thread(so, sv)) break;
@@ -1045,6 +3755,18 @@ static void run_server(cmdline_options_t opt) {
 #define options_default_load_data 0
 /** @brief デフォルトでスレッドを使うか */
 #define options_default_thread 0
+/** @brief デフォルトのワーカースレッドの数(0なら使わない) */
+#define options_default_workers 0
+/** @brief デフォルトのイベントループの数(-w を使う時) */
+#define options_default_reactors 1
+/** @brief デフォルトでイベントループをCPUに固定するか */
+#define options_default_pin 0
+/** @brief デフォルトでsuffix arrayに先頭8バイトを持たせるか */
+#define options_default_keys 0
+/** @brief デフォルトの1リクエストの処理時間の上限(ミリ秒. 0なら無し) */
+#define options_default_timeout_ms 0
+/** @brief デフォルトの1リクエストの結果の件数の上限(0なら無し) */
+#define options_default_max_results 0
 
 /**
    @brief デフォルトのコマンドラインオプションを作る
@@ -1060,6 +3782,12 @@ static cmdline_options_t default_opts() {
   opt.data_dir = strdup(options_default_data_dir);
   opt.load_data = 0;
   opt.thread = options_default_thread;
+  opt.workers = options_default_workers;
+  opt.reactors = options_default_reactors;
+  opt.pin = options_default_pin;
+  opt.keys = options_default_keys;
+  opt.timeout_ms = options_default_timeout_ms;
+  opt.max_results = options_default_max_results;
   opt.error = 0;
   opt.help = 0;
   return opt;
@@ -1086,12 +3814,24 @@ static void unagi_usage(const char * prog) {
           "  -q QLEN : the length of the listen queue [%d]\n"
           "  -l LOG_FILE : log file. not generated if the empty string \"\" is given [%s]\n"
           "  -t 0/1 : use thread or not [%d]\n"
+          "  -w N : wait for requests with epoll and serve them with a fixed pool of N worker threads (0 : no pool) [%d]\n"
+          "  -r N : with -w, run N event loops, each accepting on its own SO_REUSEPORT socket [%d]\n"
+          "  -A 0/1 : with -w, pin the i-th event loop to the i-th CPU or not [%d]\n"
+          "  -k 0/1 : keep the first 8 bytes of each suffix next to the suffix array or not [%d]\n"
+          "  -T MS : cut off each request after MS milliseconds (0 : no limit) [%d]\n"
+          "  -R N : return at most N results for each request (0 : no limit) [%d]\n"
           ,
           prog,
           options_default_port,
           options_default_qlen,
           options_default_log,
-          options_default_thread);
+          options_default_thread,
+          options_default_workers,
+          options_default_reactors,
+          options_default_pin,
+          options_default_keys,
+          options_default_timeout_ms,
+          options_default_max_results);
 }
 
 
@@ -1104,7 +3844,7 @@ static cmdline_options_t parse_args(int argc, char ** argv) {
   char * prog = argv[0];
   cmdline_options_t opt = default_opts();
   while (1) {
-    int c = getopt(argc, argv, "d:l:p:q:t:Lh");
+    int c = getopt(argc, argv, "d:k:l:p:q:r:t:w:A:R:T:Lh");
     if (c == -1) break;
     switch (c) {
     case 'd':
@@ -1127,6 +3867,25 @@ static cmdline_options_t parse_args(int argc, char ** argv) {
     case 't':
       opt.thread = atoi(optarg);
       break;
+    case 'w':
+      opt.workers = atoi(optarg);
+      break;
+    case 'r':
+      opt.reactors = atoi(optarg);
+      if (opt.reactors < 1) opt.reactors = 1;
+      break;
+    case 'A':
+      opt.pin = atoi(optarg);
+      break;
+    case 'k':
+      opt.keys = atoi(optarg);
+      break;
+    case 'T':
+      opt.timeout_ms = atol(optarg);
+      break;
+    case 'R':
+      opt.max_results = atol(optarg);
+      break;
     case 'h':
       opt.help = 1;
       break;
@@ -133,6 +133,7 @@ typedef enum {
   request_kind_put,             /**< put (ドキュメント追加) */
   request_kind_get,             /**< get (文字列検索)  */
   request_kind_getc,             /**< getc (文字列出現数)  */
+  request_kind_getcm,            /**< getcm (複数の文字列の出現数)  */
   request_kind_dump,             /**< dump (全ドキュメントダンプ) */
   request_kind_dumpc,             /**< dumpc (全ドキュメント数) */
   request_kind_discon,            /**< discon (接続終了) */
@@ -159,6 +160,11 @@ typedef struct {
       char * query;             /**< 検索文字列 */
       size_t query_len;         /**< queryの長さ(バイト数) */
     } get;
+    struct {
+      size_t n;                 /**< 検索文字列の数 */
+      char ** query;            /**< 検索文字列の配列 */
+      size_t * query_len;       /**< 各検索文字列の長さ(バイト数) */
+    } getcm;
   };
 } request_t;
 
@@ -462,6 +468,99 @@ static request_t server_recv_message_getc(int so) {
   return req;
 }
 
+/**
+   @brief getcm メッセージで受信した検索文字列を開放
+ */
+static void getcm_queries_destroy(size_t n, char ** query, size_t * query_len) {
+  if (query) {
+    for (size_t k = 0; k < n; k++) {
+      if (query[k]) my_free(query[k]);
+    }
+    my_free(query);
+  }
+  if (query_len) my_free(query_len);
+}
+
+/** @brief getcm で1度に送れる検索文字列の数の上限(これを超えるNは無効なリクエストとする) */
+static const long getcm_max_n = 1L << 16;
+/** @brief getcm で1度に送れる検索文字列の長さの合計の上限(バイト数) */
+static const long getcm_max_bytes = 1L << 26;
+
+/**
+   @brief getcm メッセージを受信
+
+   @details getcm メッセージの形式 (getcm 空白 まですでに読み込み済み) 
+
+   getcm 空白 N 空白 QUERY_LEN QUERY (空白 QUERY_LEN QUERY)*
+
+   N は検索文字列の数, QUERY_LENはQUERYの長さ(バイト数).
+   QUERY_LEN QUERY が N 回続く. N が getcm_max_n を, QUERY_LEN の
+   合計が getcm_max_bytes を超えたら無効なリクエストとする.
+
+ */
+static request_t server_recv_message_getcm(int so) {
+  request_t req;
+  req.kind = request_kind_invalid;
+
+  /* Nを受信 */
+  ssize_t n = recv_num(so);
+  if (n <= 0) return req;
+  if (n > getcm_max_n) {
+    fprintf(stderr, "too many queries [%ld]\n", n);
+    return req;
+  }
+  char ** queries = malloc_or_err(sizeof(char *) * n);
+  size_t * query_lens = malloc_or_err(sizeof(size_t) * n);
+  if (!queries || !query_lens) {
+    getcm_queries_destroy(0, queries, query_lens);
+    return req;
+  }
+  memset(queries, 0, sizeof(char *) * n);
+  long total_len = 0;
+  ssize_t k;
+  for (k = 0; k < n; k++) {
+    if (k > 0) {
+      /* 前の QUERY 後の空白を受信 */
+      char ws[1];
+      ssize_t r = recv_bytes(so, 1, ws);
+      if (r != 1) break;
+      if (!isspace(ws[0])) {
+        fprintf(stderr,
+                "expected a whitespace but received %c after query (%s)\n",
+                ws[0], queries[k - 1]);
+        break;
+      }
+    }
+    /* QUERY_LEN + QUERYを受信 */
+    ssize_t query_len = recv_num(so);
+    if (query_len < 0) break;
+    if (query_len > getcm_max_bytes - total_len) {
+      fprintf(stderr, "queries too long (more than %ld bytes in total)\n",
+              getcm_max_bytes);
+      break;
+    }
+    total_len += query_len;
+    /* allocate the buffer for the payload */
+    char * query = malloc_or_err(query_len + 1);
+    if (!query) break;
+    queries[k] = query;
+    /* receive the payload */
+    ssize_t r = recv_bytes(so, query_len, query);
+    query[r > 0 ? r : 0] = 0;
+    query_lens[k] = query_len;
+    if (r != query_len) break;
+  }
+  if (k < n) {
+    getcm_queries_destroy(n, queries, query_lens);
+    return req;
+  }
+  req.kind = request_kind_getcm;
+  req.getcm.n = n;
+  req.getcm.query = queries;
+  req.getcm.query_len = query_lens;
+  return req;
+}
+
 /**
    @brief get メッセージを受信
 
@@ -504,6 +603,8 @@ static request_t server_recv_message_get(int so) {
 
    (3) get 空白 QUERY_LEN 空白 QUERY
 
+   (4) getcm 空白 N 空白 QUERY_LEN 空白 QUERY (空白 QUERY_LEN 空白 QUERY)*
+
  */
 
 static request_t server_recv_message(int so) {
@@ -532,6 +633,8 @@ static request_t server_recv_message(int so) {
     return server_recv_message_put(so);
   } else if (strcasecmp(inst, "getc") == 0) {
     return server_recv_message_getc(so);
+  } else if (strcasecmp(inst, "getcm") == 0) {
+    return server_recv_message_getcm(so);
   } else if (strcasecmp(inst, "get") == 0) {
     return server_recv_message_get(so);
   } else {
@@ -583,9 +686,146 @@ static int connection_handle_getc(request_t req, int so, server_t * sv) {
   return send_ok_and_num(so, c, '\n');
 }
 
+/**
+   @brief getcmメッセージを処理
+   @return 1 (成功) または 0 (失敗)
+
+   @details 全検索文字列の出現数を document_repo_querycm で
+   (ドキュメントの1回の走査で)求める. 返事の形式:
+
+     OK N <改行> (QUERY_LEN QUERY 空白 COUNT <改行>)* 0 <改行>
+
+   各行は受信した順の検索文字列とその出現数.
+  */
+static int connection_handle_getcm(request_t req, int so, server_t * sv) {
+  size_t n = req.getcm.n;
+  char ** q = req.getcm.query;
+  size_t * qlen = req.getcm.query_len;
+  if (sv->log_wp) {
+    for (size_t k = 0; k < n; k++) {
+      fprintf(sv->log_wp, "getcm %ld/%ld query[%ld]=[%s]\n",
+              k, n, qlen[k], q[k]);
+    }
+    fflush(sv->log_wp);
+  }
+  int ok = 1;
+  size_t * counts = malloc_or_err(sizeof(size_t) * n);
+  if (!counts || document_repo_querycm(sv->repo, q, qlen, n, counts) == -1) {
+    ok = send_ng(so, "could not allocate memory for the queries");
+  } else if (!send_ok_and_num(so, n, '\n')) {
+    ok = 0;
+  } else {
+    for (size_t k = 0; ok && k < n; k++) {
+      ok = (send_num(so, qlen[k], ' ')
+            && send_bytes(so, q[k], qlen[k]) == (ssize_t)qlen[k]
+            && send_bytes(so, " ", 1) == 1
+            && send_num(so, counts[k], '\n'));
+    }
+    if (ok) ok = send_num(so, 0, '\n');
+  }
+  if (counts) my_free(counts);
+  getcm_queries_destroy(n, q, qlen);
+  return ok;
+}
+
+/** @brief getで件数を送る前に溜めておく返事の最大のバイト数
+    (越えたら件数を document_repo_queryc で別に数える) */
+static const long get_buffer_max = 1 << 23;
+
+/**
+   @brief 送信する返事を溜めておくバッファ
+  */
+typedef struct {
+  char * a;                     /**< 返事 */
+  long n;                       /**< aの長さ */
+  long sz;                      /**< aの容量 */
+  int error;                    /**< メモリ割り当てに失敗したら1 */
+} reply_buf_t;
+
+/**
+   @brief reply_buf_t の末尾に s[0:len] を追加
+  */
+static void reply_buf_append(reply_buf_t * rb, char * s, long len) {
+  if (rb->error) return;
+  if (rb->n + len > rb->sz) {
+    long sz = (rb->n + len) * 2;
+    char * a = realloc(rb->a, sz);
+    if (!a) {
+      api_err("realloc");
+      rb->error = 1;
+      return;
+    }
+    rb->a = a;
+    rb->sz = sz;
+  }
+  memcpy(rb->a + rb->n, s, len);
+  rb->n += len;
+}
+
+/**
+   @brief reply_buf_t の末尾に数字 x と空白文字 ws を追加
+  */
+static void reply_buf_append_num(reply_buf_t * rb, long x, int ws) {
+  char s[24];
+  int n = sprintf(s, "%ld%c", x, ws);
+  reply_buf_append(rb, s, n);
+}
+
+/**
+   @brief 出現 occ を get の返事の1レコードとして reply_buf_t の末尾に追加
+
+   @details 形式: LABEL_LEN LABEL OFFSET SNIPPET_LEN SNIPPET <改行>
+
+   出現位置を含む周辺(スニペット)を返す.
+   例えば O バイト目に現れたら 
+   (O - snippet_prefix_len) バイト目から
+   (O + 検索文字列長 + snippet_suffix_len - 1) バイト目
+   までを返す.
+   ただしドキュメントの先頭や終了を飛び越えないように注意
+  */
+static void reply_buf_append_occurrence(reply_buf_t * rb, occurrence_t occ, size_t qlen) {
+  /* 出現位置 */
+  ssize_t o = occ.offset;
+  /* スニペット先頭. ただし < 0 になったら 0 */
+  ssize_t start = o - snippet_prefix_len;
+  if (start < 0) start = 0;
+  /* スニペット終わり. ただし >= ドキュメント長 になったらドキュメント長  */
+  ssize_t end = o + qlen + snippet_suffix_len;
+  if (end > (ssize_t)occ.doc.data_len) end = occ.doc.data_len;
+  reply_buf_append_num(rb, occ.doc.label_len, ' ');
+  reply_buf_append(rb, occ.doc.label, occ.doc.label_len);
+  reply_buf_append(rb, " ", 1);
+  reply_buf_append_num(rb, occ.offset, ' ');
+  reply_buf_append_num(rb, end - start, ' ');
+  reply_buf_append(rb, occ.doc.data + start, end - start);
+  reply_buf_append(rb, "\n", 1);
+}
+
+/**
+   @brief 検索結果 qr の続きを, レコードが get_buffer_max バイトを越えるまで rb に溜める
+   @return 結果を辿り終えたら1
+
+   @details 溜めたレコード数を *cx に加える
+  */
+static int get_fill_reply(reply_buf_t * rb, query_result_t * qr, size_t qlen, size_t * cx) {
+  while (!rb->error && rb->n < get_buffer_max) {
+    occurrence_t occ = query_result_next(qr);
+    if (!occ.doc.label) return 1;
+    (*cx)++;
+    reply_buf_append_occurrence(rb, occ, qlen);
+  }
+  return 0;
+}
+
 /**
    @brief getメッセージを処理
    @return 1 (成功) または 0 (失敗)
+
+   @details 結果(出現位置)を1度だけ辿ってレコードを溜め, 辿り終えたら
+   その数を件数として送ってからレコードを送る(件数のためにもう一度
+   検索しない). 溜めた量が get_buffer_max を越えたら, 件数を
+   document_repo_queryc で数えて送り, 溜めた分に続けて残りを
+   辿りながら送る.
   */
 static int connection_handle_get(request_t req, int so, server_t * sv) {
   char * q = req.get.query;
@@ -595,53 +835,40 @@ static int connection_handle_get(request_t req, int so, server_t * sv) {
     fflush(sv->log_wp);
   }
   /* 検索を実行 */
-  size_t c = document_repo_queryc(sv->repo, q, qlen);
-  if (!send_ok_and_num(so, c, '\n')) return 0;
-  
   query_result_t qr[1] = { document_repo_query(sv->repo, q, qlen) };
-  /* 結果(出現位置)を順に取り出して返事を送信. 形式:
+  /* 結果(出現位置)を順に取り出して返事を作る. 形式:
 
      (LABEL_LEN LABEL <改行> SNIPPET_LEN SNIPPET <改行>)* 0
 
      LABEL_LEN, SNIPPET_LENはそれぞれLABEL, SNIPPETの長さ(バイト数)
      
  */
+  reply_buf_t rb[1] = { { 0, 0, 0, 0 } };
   size_t cx = 0;
-  while (1) {
-    occurrence_t occ = query_result_next(qr);
-    if (!occ.doc.label) break;
-    cx++;
-    /* 出現位置 */
-    ssize_t o = occ.offset;
-    /* 出現位置を含む周辺(スニペット)を返す.
-       例えば O バイト目に現れたら 
-       (O - snippet_prefix_len) バイト目から
-       (O + 検索文字列長 + snippet_suffix_len - 1) バイト目
-       までを返す.
-       ただしドキュメントの先頭や終了を飛び越えないように注意 */
-    /* スニペット先頭. ただし < 0 になったら 0 */
-    ssize_t start = o - snippet_prefix_len;
-    if (start < 0) start = 0;
-    /* スニペット終わり. ただし >= ドキュメント長 になったらドキュメント長  */
-    ssize_t end = o + qlen + snippet_suffix_len;
-    if (end > (ssize_t)occ.doc.data_len) end = occ.doc.data_len;
-    /* ラベル長 ラベル を送信 */
-    if (!send_num(so, occ.doc.label_len, ' ')) return 0;
-    if (!send_bytes(so, occ.doc.label, occ.doc.label_len)) return 0;
-    if (!send_bytes(so, " ", 1)) return 0;
-    /* 出現位置を送信 */
-    if (!send_num(so, occ.offset, ' ')) return 0;
-    /* スニペット長 スニペット を送信 */
-    if (!send_num(so, end - start, ' ')) return 0;
-    if (!send_bytes(so, occ.doc.data + start, end - start)) return 0;
-    if (!send_bytes(so, "\n", 1)) return 0;
+  int complete = get_fill_reply(rb, qr, qlen, &cx);
+  if (rb->error) {
+    free(rb->a);
+    my_free(q);
+    return send_ng(so, "could not allocate memory for the result");
   }
-  if (cx != c) {
+  /* 辿り終えていれば溜めた数が件数. そうでなければ別に数える */
+  size_t c = (complete ? cx : document_repo_queryc(sv->repo, q, qlen));
+  int ok = send_ok_and_num(so, c, '\n');
+  while (ok) {
+    ok = (send_bytes(so, rb->a, rb->n) != -1);
+    if (complete) break;
+    /* 残りを溜めては送る */
+    rb->n = 0;
+    complete = get_fill_reply(rb, qr, qlen, &cx);
+    if (rb->error) ok = 0;
+  }
+  free(rb->a);
+  if (ok && cx != c) {
     fprintf(stderr, "occurrence count did not match (before: %ld after: %ld)\n",
             c, cx);
   }
   my_free(q);
-  return send_num(so, 0, '\n');
+  return ok && send_num(so, 0, '\n');
 }
 
 /**
@@ -759,6 +986,9 @@ static void server_process_connection(int so, server_t * sv) {
     case request_kind_getc:
       connection_continues = connection_handle_getc(req, so, sv);
       break;
+    case request_kind_getcm:
+      connection_continues = connection_handle_getcm(req, so, sv);
+      break;
     case request_kind_get:
       connection_continues = connection_handle_get(req, so, sv);
       break;